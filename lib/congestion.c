@@ -0,0 +1,406 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "congestion.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t
+cc_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t
+cc_flight (const microtcp_sock_t *socket)
+{
+  return (uint32_t) (socket->seq_number - socket->snd_una);
+}
+
+/**
+ * Slow start with appropriate byte counting (RFC 3465). Up to two MSS per
+ * ACK, as the receiver acknowledges every second segment.
+ */
+static void
+cc_slow_start (microtcp_sock_t *socket, uint32_t acked)
+{
+  socket->cwnd += acked < 2 * MICROTCP_MSS ? acked : 2 * MICROTCP_MSS;
+}
+
+/*
+ * Reno (RFC 5681)
+ */
+
+static void
+reno_init (microtcp_sock_t *socket)
+{
+}
+
+static void
+reno_on_ack (microtcp_sock_t *socket, uint32_t acked, uint32_t rtt_us)
+{
+  if (socket->in_recovery) {
+    return;
+  }
+  if (socket->cwnd < socket->ssthresh) {
+    cc_slow_start (socket, acked);
+  }
+  else {
+    /* Congestion avoidance: roughly one MSS per RTT */
+    socket->cwnd += (MICROTCP_MSS * (size_t) acked) / socket->cwnd + 1;
+  }
+}
+
+static void
+reno_on_loss (microtcp_sock_t *socket)
+{
+  socket->ssthresh = cc_flight (socket) / 2;
+  if (socket->ssthresh < 2 * MICROTCP_MSS) {
+    socket->ssthresh = 2 * MICROTCP_MSS;
+  }
+  socket->cwnd = socket->ssthresh;
+}
+
+static void
+reno_on_rto (microtcp_sock_t *socket)
+{
+  reno_on_loss (socket);
+  socket->cwnd = MICROTCP_INIT_CWND;
+}
+
+static uint64_t
+reno_pacing_rate (microtcp_sock_t *socket)
+{
+  return 0;
+}
+
+/*
+ * CUBIC (RFC 8312). Windows are kept in segments, as in the RFC.
+ */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic
+{
+  double w_max;                 /**< Window before the last reduction */
+  double w_last_max;            /**< w_max before the last reduction */
+  double k;                     /**< Seconds until the window is w_max */
+  double origin;                /**< The plateau of the cubic function */
+  double w_est;                 /**< What Reno would have by now */
+  double carry;                 /**< Growth below one byte */
+  uint64_t epoch_start;         /**< Start of the growth epoch, 0 if none */
+};
+
+static void
+cubic_init (microtcp_sock_t *socket)
+{
+  memset (socket->cc_priv, 0, sizeof(struct cubic));
+}
+
+static void
+cubic_on_ack (microtcp_sock_t *socket, uint32_t acked, uint32_t rtt_us)
+{
+  struct cubic *ca = (struct cubic *) socket->cc_priv;
+  double cwnd = (double) socket->cwnd / MICROTCP_MSS;
+  double target;
+  double t;
+  uint64_t now;
+
+  if (socket->in_recovery) {
+    return;
+  }
+  if (socket->cwnd < socket->ssthresh) {
+    cc_slow_start (socket, acked);
+    return;
+  }
+
+  now = cc_now_us ();
+  if (ca->epoch_start == 0) {
+    ca->epoch_start = now;
+    if (cwnd < ca->w_max) {
+      ca->k = cbrt ((ca->w_max - cwnd) / CUBIC_C);
+      ca->origin = ca->w_max;
+    }
+    else {
+      ca->k = 0;
+      ca->origin = cwnd;
+    }
+    ca->w_est = cwnd;
+  }
+
+  /* Where the window should be one RTT from now */
+  t = (now - ca->epoch_start + socket->srtt_us) / 1e6;
+  target = ca->origin + CUBIC_C * (t - ca->k) * (t - ca->k) * (t - ca->k);
+
+  /* Never grow slower than Reno would */
+  ca->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA)
+      * ((double) acked / MICROTCP_MSS) / cwnd;
+  if (target < ca->w_est) {
+    target = ca->w_est;
+  }
+  if (target > 1.5 * cwnd) {
+    target = 1.5 * cwnd;
+  }
+
+  if (target > cwnd) {
+    ca->carry += (target - cwnd) / cwnd * acked;
+  }
+  else {
+    ca->carry += (double) acked / (100 * cwnd);
+  }
+  socket->cwnd += (size_t) ca->carry;
+  ca->carry -= (size_t) ca->carry;
+}
+
+static void
+cubic_reduce (microtcp_sock_t *socket)
+{
+  struct cubic *ca = (struct cubic *) socket->cc_priv;
+  double cwnd = (double) socket->cwnd / MICROTCP_MSS;
+
+  /* Fast convergence: release bandwidth for newer flows */
+  if (cwnd < ca->w_last_max) {
+    ca->w_last_max = cwnd;
+    ca->w_max = cwnd * (1 + CUBIC_BETA) / 2;
+  }
+  else {
+    ca->w_max = ca->w_last_max = cwnd;
+  }
+  ca->epoch_start = 0;
+  socket->ssthresh = socket->cwnd * CUBIC_BETA;
+  if (socket->ssthresh < 2 * MICROTCP_MSS) {
+    socket->ssthresh = 2 * MICROTCP_MSS;
+  }
+}
+
+static void
+cubic_on_loss (microtcp_sock_t *socket)
+{
+  cubic_reduce (socket);
+  socket->cwnd = socket->ssthresh;
+}
+
+static void
+cubic_on_rto (microtcp_sock_t *socket)
+{
+  cubic_reduce (socket);
+  socket->cwnd = MICROTCP_INIT_CWND;
+}
+
+/*
+ * A simplified BBR. It models the path with the maximum delivery rate of
+ * the last 10 rounds and the minimum RTT of the last 10 seconds, and it
+ * runs STARTUP, DRAIN and PROBE_BW. There is no PROBE_RTT, the minimum RTT
+ * is simply re-measured when it expires. Losses do not reduce the window.
+ */
+
+#define BBR_HIGH_GAIN 2885      /* 2/ln(2), in thousandths */
+#define BBR_CWND_GAIN 2000
+#define BBR_BW_ROUNDS 10
+#define BBR_MIN_RTT_US 10000000
+#define BBR_CYCLE_LEN 8
+
+enum bbr_mode
+{
+  BBR_STARTUP,
+  BBR_DRAIN,
+  BBR_PROBE_BW
+};
+
+static const uint32_t bbr_cycle_gain[BBR_CYCLE_LEN] =
+  { 1250, 750, 1000, 1000, 1000, 1000, 1000, 1000 };
+
+struct bbr
+{
+  uint64_t bw;                  /**< Bottleneck bandwidth in bytes/s */
+  uint64_t bw_round;            /**< Round in which bw was measured */
+  uint64_t round;               /**< Rounds since the start */
+  uint64_t round_start;         /**< When the current round started */
+  uint64_t round_delivered;     /**< Bytes delivered in the current round */
+  uint64_t full_bw;             /**< Bandwidth when STARTUP last grew */
+  uint64_t min_rtt_stamp;
+  uint64_t cycle_stamp;
+  uint32_t round_end;           /**< The round ends when this is ACKed */
+  uint32_t min_rtt_us;
+  uint32_t full_bw_cnt;         /**< Rounds without 25% growth */
+  uint32_t cycle_idx;
+  enum bbr_mode mode;
+};
+
+static void
+bbr_init (microtcp_sock_t *socket)
+{
+  struct bbr *bbr = (struct bbr *) socket->cc_priv;
+
+  memset (bbr, 0, sizeof(struct bbr));
+  bbr->mode = BBR_STARTUP;
+  bbr->round_start = cc_now_us ();
+  bbr->round_end = socket->seq_number;
+  bbr->min_rtt_us = UINT32_MAX;
+}
+
+static uint32_t
+bbr_pacing_gain (const struct bbr *bbr)
+{
+  switch (bbr->mode)
+    {
+    case BBR_STARTUP:
+      return BBR_HIGH_GAIN;
+    case BBR_DRAIN:
+      return 1000 * 1000 / BBR_HIGH_GAIN;
+    default:
+      return bbr_cycle_gain[bbr->cycle_idx];
+    }
+}
+
+static uint64_t
+bbr_bdp (const struct bbr *bbr)
+{
+  return bbr->bw * bbr->min_rtt_us / 1000000;
+}
+
+static void
+bbr_on_ack (microtcp_sock_t *socket, uint32_t acked, uint32_t rtt_us)
+{
+  struct bbr *bbr = (struct bbr *) socket->cc_priv;
+  uint64_t now = cc_now_us ();
+  uint64_t sample;
+  uint64_t target;
+
+  if (rtt_us && (rtt_us <= bbr->min_rtt_us
+      || now - bbr->min_rtt_stamp > BBR_MIN_RTT_US)) {
+    bbr->min_rtt_us = rtt_us;
+    bbr->min_rtt_stamp = now;
+  }
+
+  /* A round trip ends when the data sent at its start are ACKed */
+  bbr->round_delivered += acked;
+  if ((int32_t) (socket->snd_una - bbr->round_end) >= 0) {
+    if (now > bbr->round_start) {
+      sample = bbr->round_delivered * 1000000 / (now - bbr->round_start);
+      if (sample >= bbr->bw || bbr->round - bbr->bw_round > BBR_BW_ROUNDS) {
+        bbr->bw = sample;
+        bbr->bw_round = bbr->round;
+      }
+    }
+    bbr->round++;
+    bbr->round_end = socket->seq_number;
+    bbr->round_start = now;
+    bbr->round_delivered = 0;
+
+    /* STARTUP is over when 3 rounds do not grow the bandwidth by 25% */
+    if (bbr->mode == BBR_STARTUP) {
+      if (bbr->bw >= bbr->full_bw * 5 / 4) {
+        bbr->full_bw = bbr->bw;
+        bbr->full_bw_cnt = 0;
+      }
+      else if (++bbr->full_bw_cnt >= 3) {
+        bbr->mode = BBR_DRAIN;
+      }
+    }
+  }
+
+  if (bbr->mode == BBR_DRAIN && cc_flight (socket) <= bbr_bdp (bbr)) {
+    bbr->mode = BBR_PROBE_BW;
+    bbr->cycle_idx = 0;
+    bbr->cycle_stamp = now;
+  }
+  if (bbr->mode == BBR_PROBE_BW && bbr->min_rtt_us != UINT32_MAX
+      && now - bbr->cycle_stamp > bbr->min_rtt_us) {
+    bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+    bbr->cycle_stamp = now;
+  }
+
+  if (bbr->bw == 0 || bbr->min_rtt_us == UINT32_MAX) {
+    socket->cwnd += acked;
+    return;
+  }
+  target = bbr_bdp (bbr) * (bbr->mode == BBR_STARTUP ?
+      BBR_HIGH_GAIN : BBR_CWND_GAIN) / 1000 + 3 * MICROTCP_MSS;
+  if (socket->cwnd < target) {
+    socket->cwnd += acked;
+    if (socket->cwnd > target) {
+      socket->cwnd = target;
+    }
+  }
+  else if (bbr->mode != BBR_STARTUP) {
+    socket->cwnd = target;
+  }
+}
+
+static void
+bbr_on_loss (microtcp_sock_t *socket)
+{
+  /* Keep the window, recovery restores cwnd from ssthresh */
+  socket->ssthresh = socket->cwnd;
+}
+
+static void
+bbr_on_rto (microtcp_sock_t *socket)
+{
+  socket->ssthresh = socket->cwnd;
+  socket->cwnd = MICROTCP_INIT_CWND;
+}
+
+static uint64_t
+bbr_pacing_rate (microtcp_sock_t *socket)
+{
+  struct bbr *bbr = (struct bbr *) socket->cc_priv;
+
+  return bbr->bw * bbr_pacing_gain (bbr) / 1000;
+}
+
+static const struct microtcp_cc_ops microtcp_cc_reno =
+  { "reno", reno_init, reno_on_ack, reno_on_loss, reno_on_rto,
+    reno_pacing_rate };
+
+static const struct microtcp_cc_ops microtcp_cc_cubic =
+  { "cubic", cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_rto,
+    reno_pacing_rate };
+
+static const struct microtcp_cc_ops microtcp_cc_bbr =
+  { "bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto, bbr_pacing_rate };
+
+/* Every module must fit its state in cc_priv */
+typedef char cubic_fits[sizeof(struct cubic)
+    <= sizeof(((microtcp_sock_t *) 0)->cc_priv) ? 1 : -1];
+typedef char bbr_fits[sizeof(struct bbr)
+    <= sizeof(((microtcp_sock_t *) 0)->cc_priv) ? 1 : -1];
+
+const struct microtcp_cc_ops *
+microtcp_cc_get (int algorithm)
+{
+  switch (algorithm)
+    {
+    case MICROTCP_CC_RENO:
+      return &microtcp_cc_reno;
+    case MICROTCP_CC_CUBIC:
+      return &microtcp_cc_cubic;
+    case MICROTCP_CC_BBR:
+      return &microtcp_cc_bbr;
+    default:
+      return NULL;
+    }
+}
@@ -0,0 +1,68 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_CONGESTION_H_
+#define LIB_CONGESTION_H_
+
+#include "microtcp.h"
+
+/**
+ * A congestion control module. The transmit path owns the loss recovery
+ * and the window accounting, the module only decides how cwnd and
+ * ssthresh react to ACKs and losses. Its state lives in the cc_priv field
+ * of the socket.
+ */
+struct microtcp_cc_ops
+{
+  const char *name;
+
+  /** Resets the state of the module, cwnd and ssthresh are kept */
+  void (*init) (microtcp_sock_t *socket);
+
+  /**
+   * Called for every ACK that acknowledges new data, also during fast
+   * recovery (see in_recovery).
+   *
+   * @param acked the newly acknowledged bytes
+   * @param rtt_us the RTT sample taken from this ACK, 0 if none
+   */
+  void (*on_ack) (microtcp_sock_t *socket, uint32_t acked, uint32_t rtt_us);
+
+  /** Fast recovery starts: set ssthresh and the cwnd to recover with */
+  void (*on_loss) (microtcp_sock_t *socket);
+
+  /** The retransmission timer expired */
+  void (*on_rto) (microtcp_sock_t *socket);
+
+  /**
+   * @return the rate to pace the transmissions at in bytes per second, 0
+   * if the module has no opinion
+   */
+  uint64_t (*pacing_rate) (microtcp_sock_t *socket);
+};
+
+/**
+ * @param algorithm one of MICROTCP_CC_*
+ * @return the module, NULL if there is no such algorithm
+ */
+const struct microtcp_cc_ops *
+microtcp_cc_get (int algorithm);
+
+#endif /* LIB_CONGESTION_H_ */
@@ -0,0 +1,235 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "demux.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+
+int
+microtcp_demux_make_key (struct microtcp_demux_key *key,
+                         const struct sockaddr *addr, socklen_t len)
+{
+  const struct sockaddr_in *in4 = (const struct sockaddr_in *) addr;
+  const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) addr;
+
+  memset (key, 0, sizeof(struct microtcp_demux_key));
+  if (addr->sa_family == AF_INET && len >= sizeof(struct sockaddr_in)) {
+    key->family = AF_INET;
+    key->port = in4->sin_port;
+    memcpy (key->addr, &in4->sin_addr, sizeof(in4->sin_addr));
+    return 0;
+  }
+  if (addr->sa_family == AF_INET6 && len >= sizeof(struct sockaddr_in6)) {
+    key->family = AF_INET6;
+    key->port = in6->sin6_port;
+    key->scope = in6->sin6_scope_id;
+    memcpy (key->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+    return 0;
+  }
+  return -1;
+}
+
+static uint64_t
+demux_mix (uint64_t h)
+{
+  /* The finalizer of SplitMix64 */
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+static uint64_t
+demux_hash (const struct microtcp_demux_key *key)
+{
+  uint64_t lo;
+  uint64_t hi;
+
+  memcpy (&lo, key->addr, 8);
+  memcpy (&hi, key->addr + 8, 8);
+  return demux_mix (demux_mix (((uint64_t) key->family << 48)
+      ^ ((uint64_t) key->port << 32) ^ key->scope ^ lo) ^ hi);
+}
+
+/**
+ * @return the slot of the key, or the free slot that ends its probe
+ * sequence
+ */
+static size_t
+demux_find (const microtcp_demux_t *demux, const struct microtcp_demux_key *key,
+            uint64_t hash)
+{
+  size_t mask = demux->capacity - 1;
+  size_t i = hash & mask;
+
+  while (demux->slots[i].value
+      && (demux->slots[i].hash != hash
+          || memcmp (&demux->slots[i].key, key,
+                     sizeof(struct microtcp_demux_key)))) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int
+demux_grow (microtcp_demux_t *demux)
+{
+  microtcp_demux_entry_t *old = demux->slots;
+  size_t old_capacity = demux->capacity;
+  size_t i;
+  size_t j;
+
+  demux->slots = calloc (old_capacity * 2, sizeof(microtcp_demux_entry_t));
+  if (!demux->slots) {
+    demux->slots = old;
+    return -1;
+  }
+  demux->capacity = old_capacity * 2;
+  for (i = 0; i < old_capacity; i++) {
+    if (old[i].value) {
+      j = demux_find (demux, &old[i].key, old[i].hash);
+      demux->slots[j] = old[i];
+    }
+  }
+  free (old);
+  return 0;
+}
+
+int
+microtcp_demux_init (microtcp_demux_t *demux, size_t capacity)
+{
+  size_t size = 2;
+
+  while (size < capacity) {
+    size <<= 1;
+  }
+  demux->slots = calloc (size, sizeof(microtcp_demux_entry_t));
+  if (!demux->slots) {
+    return -1;
+  }
+  demux->capacity = size;
+  demux->count = 0;
+  return 0;
+}
+
+void
+microtcp_demux_destroy (microtcp_demux_t *demux)
+{
+  free (demux->slots);
+  demux->slots = NULL;
+  demux->capacity = 0;
+  demux->count = 0;
+}
+
+int
+microtcp_demux_insert (microtcp_demux_t *demux, const struct sockaddr *addr,
+                       socklen_t len, void *value)
+{
+  struct microtcp_demux_key key;
+  uint64_t hash;
+  size_t i;
+
+  if (microtcp_demux_make_key (&key, addr, len)) {
+    errno = EAFNOSUPPORT;
+    return -1;
+  }
+  if ((demux->count + 1) * 2 > demux->capacity && demux_grow (demux)) {
+    return -1;
+  }
+  hash = demux_hash (&key);
+  i = demux_find (demux, &key, hash);
+  if (demux->slots[i].value) {
+    errno = EEXIST;
+    return -1;
+  }
+  demux->slots[i].hash = hash;
+  demux->slots[i].key = key;
+  demux->slots[i].value = value;
+  demux->count++;
+  return 0;
+}
+
+void *
+microtcp_demux_lookup (const microtcp_demux_t *demux,
+                       const struct sockaddr *addr, socklen_t len)
+{
+  struct microtcp_demux_key key;
+
+  if (microtcp_demux_make_key (&key, addr, len)) {
+    return NULL;
+  }
+  return demux->slots[demux_find (demux, &key, demux_hash (&key))].value;
+}
+
+void *
+microtcp_demux_replace (microtcp_demux_t *demux, const struct sockaddr *addr,
+                        socklen_t len, void *value)
+{
+  struct microtcp_demux_key key;
+  void *old;
+  size_t i;
+
+  if (microtcp_demux_make_key (&key, addr, len)) {
+    return NULL;
+  }
+  i = demux_find (demux, &key, demux_hash (&key));
+  old = demux->slots[i].value;
+  if (old) {
+    demux->slots[i].value = value;
+  }
+  return old;
+}
+
+void *
+microtcp_demux_remove (microtcp_demux_t *demux, const struct sockaddr *addr,
+                       socklen_t len)
+{
+  struct microtcp_demux_key key;
+  size_t mask = demux->capacity - 1;
+  size_t home;
+  size_t i;
+  size_t j;
+  void *value;
+
+  if (microtcp_demux_make_key (&key, addr, len)) {
+    return NULL;
+  }
+  i = demux_find (demux, &key, demux_hash (&key));
+  value = demux->slots[i].value;
+  if (!value) {
+    return NULL;
+  }
+
+  /*
+   * Shift back the entries of the probe sequence that follows, unless
+   * that would move one before its home slot
+   */
+  for (j = (i + 1) & mask; demux->slots[j].value; j = (j + 1) & mask) {
+    home = demux->slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      demux->slots[i] = demux->slots[j];
+      i = j;
+    }
+  }
+  demux->slots[i].value = NULL;
+  demux->count--;
+  return value;
+}
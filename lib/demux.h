@@ -0,0 +1,118 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_DEMUX_H_
+#define LIB_DEMUX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * Maps the address of a remote peer to the connection that talks to it,
+ * for connections that share one UDP socket. The local half of their
+ * 4-tuple is the address of that socket, so the peer address is the key.
+ *
+ * Open addressing with linear probing over a power-of-two array. Entries
+ * keep the hash and the key inline, so a lookup usually touches a single
+ * cache line, and removals shift the following entries back instead of
+ * leaving tombstones.
+ */
+
+struct microtcp_demux_key
+{
+  uint16_t family;
+  uint16_t port;                /**< Network byte order */
+  uint32_t scope;               /**< Scope of IPv6 link-local addresses */
+  uint8_t addr[16];             /**< IPv4 addresses use the first 4 bytes */
+};
+
+typedef struct
+{
+  uint64_t hash;
+  struct microtcp_demux_key key;
+  void *value;                  /**< NULL if the slot is free */
+} microtcp_demux_entry_t;
+
+typedef struct microtcp_demux
+{
+  microtcp_demux_entry_t *slots;
+  size_t capacity;              /**< A power of two */
+  size_t count;
+} microtcp_demux_t;
+
+/**
+ * Builds the key of a peer address, with any padding zeroed so that the
+ * key can be hashed as a whole.
+ *
+ * @return 0 on success, -1 for an unsupported address family
+ */
+int
+microtcp_demux_make_key (struct microtcp_demux_key *key,
+                         const struct sockaddr *addr, socklen_t len);
+
+/**
+ * @param capacity the initial number of slots, rounded up to a power of two
+ * @return 0 on success, -1 if the slots cannot be allocated
+ */
+int
+microtcp_demux_init (microtcp_demux_t *demux, size_t capacity);
+
+void
+microtcp_demux_destroy (microtcp_demux_t *demux);
+
+/**
+ * Adds the connection of a peer, growing the table when it gets half full.
+ *
+ * @return 0 on success, -1 if the peer is already there (EEXIST), its
+ * address family is not supported (EAFNOSUPPORT) or memory runs out
+ */
+int
+microtcp_demux_insert (microtcp_demux_t *demux, const struct sockaddr *addr,
+                       socklen_t len, void *value);
+
+/**
+ * @return the connection of the peer, NULL if there is none
+ */
+void *
+microtcp_demux_lookup (const microtcp_demux_t *demux,
+                       const struct sockaddr *addr, socklen_t len);
+
+/**
+ * Points the entry of a peer to another connection, as when the
+ * connection moves in memory. Unlike a removal and an insertion, it never
+ * fails for a peer that is there.
+ *
+ * @return the previous connection of the peer, NULL if the peer is not
+ * there, in which case nothing is added
+ */
+void *
+microtcp_demux_replace (microtcp_demux_t *demux, const struct sockaddr *addr,
+                        socklen_t len, void *value);
+
+/**
+ * @return the connection of the peer that was removed, NULL if there was
+ * none
+ */
+void *
+microtcp_demux_remove (microtcp_demux_t *demux, const struct sockaddr *addr,
+                       socklen_t len);
+
+#endif /* LIB_DEMUX_H_ */
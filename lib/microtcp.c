@@ -18,49 +18,3062 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "microtcp.h"
+#include "congestion.h"
+#include "demux.h"
+#include "poller.h"
+#include "uring.h"
 #include "../utils/crc32.h"
+#include "../utils/siphash.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/random.h>
 
-microtcp_sock_t
-microtcp_socket (int domain, int type, int protocol)
+/* Sequence number comparisons that survive the 32-bit wrap around */
+#define SEQ_LT(a, b)  ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define SEQ_GT(a, b)  SEQ_LT(b, a)
+#define SEQ_GEQ(a, b) SEQ_LEQ(b, a)
+
+#define MICROTCP_MAX_SEGMENT (sizeof(microtcp_header_t) + MICROTCP_MSS)
+
+/* Timers that fired, see timer_events */
+#define MICROTCP_EV_RTO 0x1
+#define MICROTCP_EV_FIN 0x2
+#define MICROTCP_EV_PACE 0x4
+
+/* RTOs of silence from the peer before a closed socket stops lingering */
+#define MICROTCP_LINGER_RTOS 4
+
+/* A non-blocking close, see closing */
+#define MICROTCP_CLOSE_ACTIVE 1  /**< Our FIN goes first */
+#define MICROTCP_CLOSE_PASSIVE 2 /**< The peer had already sent its FIN */
+#define MICROTCP_CLOSE_FAILED 3  /**< The peer stopped answering */
+
+/* The token bucket holds at least this many full segments */
+#define MICROTCP_PACE_MIN_BURST 2
+/* Faster than this the bucket cannot be kept, and need not be */
+#define MICROTCP_PACE_MAX_RATE 100000000000ULL
+/* Rate changes below 1/8 are not passed to SO_MAX_PACING_RATE */
+#define MICROTCP_PACE_KERNEL_SLACK 3
+
+/*
+ * Layout of a SYN cookie, the ISN of a stateless SYN-ACK. The low bits
+ * keep the options negotiated with the SYN (MICROTCP_OPT_* flags, the
+ * window shift of the peer and the checksum mode), then come the low bits
+ * of the epoch the cookie was made in and a MAC of all these, the address
+ * and the ISN of the peer. A cookie is valid during its epoch and the next.
+ */
+#define MICROTCP_COOKIE_FLAGS 0x7
+#define MICROTCP_COOKIE_WSCALE_SHIFT 3
+#define MICROTCP_COOKIE_CSUM_SHIFT 7
+#define MICROTCP_COOKIE_EPOCH_SHIFT 9
+#define MICROTCP_COOKIE_MAC_SHIFT 11
+#define MICROTCP_COOKIE_EPOCH_US 64000000ULL
+
+/*
+ * A fast open SYN has MICROTCP_OPT_FASTOPEN and its payload starts with a
+ * cookie, which takes no sequence space, followed by data from ISN + 1. A
+ * SYN without a cookie asks for one, which the SYN-ACK carries as its
+ * payload. The cookie is a MAC of the address of the client.
+ */
+#define MICROTCP_FASTOPEN_COOKIE_LEN sizeof(uint64_t)
+/* Servers whose fast open cookies a thread remembers */
+#define MICROTCP_FASTOPEN_CACHE_LEN 64
+
+/* Initial slots of the connection table of a listener */
+#define MICROTCP_DEMUX_INIT_LEN 64
+
+/* The timers of all the sockets a thread creates share a wheel */
+static __thread microtcp_timer_wheel_t *microtcp_thread_wheel;
+
+struct microtcp_fastopen_entry
+{
+  struct microtcp_demux_key server;
+  uint64_t cookie;
+};
+
+/* Fast open cookies of the servers, replaced in turn once all are used */
+static __thread struct microtcp_fastopen_entry
+    microtcp_fastopen_cache[MICROTCP_FASTOPEN_CACHE_LEN];
+static __thread unsigned int microtcp_fastopen_next;
+/* Header plus payload slices of an outgoing segment */
+#define MICROTCP_SEG_IOV_LEN 8
+
+/**
+ * The user data of an ongoing send. The first byte of the data has the
+ * sequence number base.
+ */
+struct microtcp_source
+{
+  const struct iovec *iov;
+  int iovcnt;
+  size_t length;
+  uint32_t base;
+  int hold;                     /**< A partial segment at the end waits for
+                                     more data */
+};
+
+/*
+ * A GSO superbuffer must fit in a single UDP datagram and the kernel
+ * splits it in at most UDP_MAX_SEGMENTS (64) segments
+ */
+#define MICROTCP_GSO_MAX_SEGS (65507 / MICROTCP_MAX_SEGMENT)
+/* A GRO datagram may coalesce up to 64 KB of segments */
+#define MICROTCP_GRO_BUF_LEN 65536
+#define MICROTCP_GRO_BATCH_LEN 8
+
+/**
+ * A set of datagram buffers registered once with an array of mmsghdr, so
+ * a whole batch moves with a single sendmmsg() or recvmmsg() call.
+ */
+struct microtcp_batch
+{
+  struct mmsghdr msgs[MICROTCP_BATCH_LEN];
+  struct iovec iov[MICROTCP_BATCH_LEN][MICROTCP_SEG_IOV_LEN];
+  struct sockaddr_storage addrs[MICROTCP_BATCH_LEN];
+  union
+  {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrl[MICROTCP_BATCH_LEN];   /**< Receives the UDP_GRO segment size */
+  size_t seg_size[MICROTCP_BATCH_LEN]; /**< Size of the segments coalesced
+                                     in each received datagram */
+
+  /* Superbuffers of consecutive segments for UDP_SEGMENT */
+  struct mmsghdr gso_msgs[MICROTCP_BATCH_LEN];
+  struct iovec gso_iov[MICROTCP_BATCH_LEN * MICROTCP_SEG_IOV_LEN];
+
+  unsigned int nbufs;           /**< Number of datagram buffers */
+  size_t buf_len;               /**< Size of each datagram buffer */
+  unsigned int count;           /**< Datagrams queued or received */
+  unsigned int next;            /**< Next received datagram to process */
+  size_t next_off;              /**< Offset of the next segment in it */
+  uint8_t *bufs[MICROTCP_BATCH_LEN];
+  uint8_t data[];
+};
+
+static struct microtcp_batch *
+microtcp_batch_new (unsigned int nbufs, size_t buf_len)
+{
+  struct microtcp_batch *batch;
+  unsigned int i;
+
+  batch = calloc (1, sizeof(struct microtcp_batch) + nbufs * buf_len);
+  if (!batch) {
+    return NULL;
+  }
+  batch->nbufs = nbufs;
+  batch->buf_len = buf_len;
+  for (i = 0; i < nbufs; i++) {
+    batch->bufs[i] = batch->data + i * buf_len;
+    batch->iov[i][0].iov_base = batch->bufs[i];
+    batch->iov[i][0].iov_len = buf_len;
+    batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+  }
+  return batch;
+}
+
+/**
+ * @return the socket that owns the UDP socket of this one
+ */
+static microtcp_sock_t *
+microtcp_listener_of (microtcp_sock_t *socket)
+{
+  return socket->listener ? socket->listener : socket;
+}
+
+static int
+microtcp_sendmmsg (int sd, struct mmsghdr *msgs, unsigned int count)
+{
+  unsigned int sent = 0;
+  int ret;
+
+  while (sent < count) {
+    ret = sendmmsg (sd, &msgs[sent], count - sent, 0);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    sent += ret;
+  }
+  return 0;
+}
+
+static size_t
+microtcp_msg_len (const struct msghdr *msg)
+{
+  size_t len = 0;
+  size_t i;
+
+  for (i = 0; i < msg->msg_iovlen; i++) {
+    len += msg->msg_iov[i].iov_len;
+  }
+  return len;
+}
+
+/**
+ * Merges runs of consecutive full-sized segments of the transmit batch
+ * into superbuffers. The kernel cuts them back into segments, because
+ * UDP_SEGMENT is set on the socket with the size of a full segment.
+ *
+ * @return the number of messages in gso_msgs
+ */
+static unsigned int
+microtcp_gso_coalesce (struct microtcp_batch *txq)
+{
+  struct iovec *iov = txq->gso_iov;
+  struct msghdr *msg = NULL;
+  unsigned int n = 0;
+  unsigned int segs = 0;
+  unsigned int i;
+  int full = 0;
+
+  for (i = 0; i < txq->count; i++) {
+    /* Only the last segment of a superbuffer may be shorter */
+    if (!full || segs == MICROTCP_GSO_MAX_SEGS) {
+      msg = &txq->gso_msgs[n++].msg_hdr;
+      *msg = txq->msgs[i].msg_hdr;
+      msg->msg_iov = iov;
+      msg->msg_iovlen = 0;
+      segs = 0;
+    }
+    memcpy (iov, txq->msgs[i].msg_hdr.msg_iov,
+            txq->msgs[i].msg_hdr.msg_iovlen * sizeof(struct iovec));
+    iov += txq->msgs[i].msg_hdr.msg_iovlen;
+    msg->msg_iovlen += txq->msgs[i].msg_hdr.msg_iovlen;
+    full = microtcp_msg_len (&txq->msgs[i].msg_hdr) == MICROTCP_MAX_SEGMENT;
+    segs++;
+  }
+  return n;
+}
+
+/**
+ * Transmits every queued segment. With GSO enabled, full-sized segments
+ * leave in superbuffers. If the kernel refuses them, GSO is turned off and
+ * the batch is sent segment by segment. A socket in an io_uring only
+ * queues the segments to its ring.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_flush (microtcp_sock_t *socket)
+{
+  struct microtcp_batch *txq = socket->txq;
+  struct microtcp_uring *uring = microtcp_listener_of (socket)->uring;
+  unsigned int n;
+  int ret;
+
+  if (txq->count == 0) {
+    return 0;
+  }
+  if (uring) {
+    ret = microtcp_uring_sendmmsg (uring, socket->sd, txq->msgs, txq->count);
+    goto out;
+  }
+  if (socket->gso_enabled && txq->count > 1) {
+    n = microtcp_gso_coalesce (txq);
+    ret = microtcp_sendmmsg (socket->sd, txq->gso_msgs, n);
+    if (ret == 0 || (errno != EIO && errno != EINVAL)) {
+      goto out;
+    }
+    socket->gso_enabled = 0;
+    microtcp_setsockopt (socket, MICROTCP_SO_GSO, &socket->gso_enabled,
+                         sizeof(int));
+  }
+  ret = microtcp_sendmmsg (socket->sd, txq->msgs, txq->count);
+
+out:
+  if (ret) {
+    perror ("SEND ERROR");
+  }
+  txq->count = 0;
+  return ret;
+}
+
+/**
+ * @return the checksum mode of a segment. The handshake always uses a full
+ * checksum, as the mode is still being negotiated.
+ */
+static int
+microtcp_csum_mode (const microtcp_sock_t *socket, uint16_t control)
+{
+  return control & MICROTCP_SYN ? MICROTCP_CSUM_FULL : socket->csum_mode;
+}
+
+/**
+ * Computes the CRC-32 of a segment whose payload is scattered in iovcnt
+ * buffers. The checksum covers the header, with its checksum field
+ * zeroed, followed by the payload unless the mode leaves it out.
+ *
+ * @param mode the MICROTCP_CSUM_* of the segment
+ */
+static uint32_t
+microtcp_checksum_iov (const microtcp_header_t *header,
+                       const struct iovec *iov, int iovcnt, int mode)
+{
+  microtcp_header_t tmp = *header;
+  uint32_t crc;
+  int i;
+
+  if (mode == MICROTCP_CSUM_NONE) {
+    return 0;
+  }
+  tmp.checksum = 0;
+  crc = update_crc32_best (0xffffffff, (const uint8_t *) &tmp,
+                           sizeof(tmp));
+  for (i = 0; mode == MICROTCP_CSUM_FULL && i < iovcnt; i++) {
+    crc = update_crc32_best (crc, iov[i].iov_base, iov[i].iov_len);
+  }
+  return crc ^ 0xffffffff;
+}
+
+/**
+ * Verifies the checksum of a received segment, as far as the checksum
+ * mode of the connection covers it. The payload of a segment
+ * that is next in order is copied to its place in the receive buffer in
+ * the same pass, see rx_inplace. The space after the buffered data is not
+ * in use while no out-of-order data is held, so a copy that fails the
+ * check does no harm.
+ *
+ * @return 1 if the checksum is correct, 0 otherwise
+ */
+static int
+microtcp_checksum_ok (microtcp_sock_t *socket,
+                      const microtcp_header_t *header, const uint8_t *payload)
+{
+  microtcp_header_t tmp = *header;
+  size_t len = header->data_len;
+  int mode = microtcp_csum_mode (socket, header->control);
+  uint32_t crc;
+  size_t pos;
+  size_t n;
+
+  /* Only its cookie tells the mode of a segment completing a handshake */
+  if (socket->syn_cookies && socket->state == LISTEN
+      && !(header->control & MICROTCP_SYN)) {
+    mode = ((header->ack_number - 1) >> MICROTCP_COOKIE_CSUM_SHIFT) & 0x3;
+  }
+  socket->rx_inplace = NULL;
+  if (mode == MICROTCP_CSUM_NONE) {
+    return 1;
+  }
+  tmp.checksum = 0;
+  crc = update_crc32_best (0xffffffff, (const uint8_t *) &tmp, sizeof(tmp));
+  if (mode == MICROTCP_CSUM_FULL && len && socket->recvbuf
+      && !socket->ooo_count
+      && header->seq_number == socket->ack_number
+      && len <= socket->recvbuf_len - socket->buf_fill_level
+      && (socket->state == ESTABLISHED || socket->state == CLOSING_BY_HOST)) {
+    pos = (socket->recvbuf_head + socket->buf_fill_level)
+        & (socket->recvbuf_len - 1);
+    n = socket->recvbuf_len - pos;
+    if (n > len) {
+      n = len;
+    }
+    crc = update_crc32_copy_best (crc, socket->recvbuf + pos, payload, n);
+    crc = update_crc32_copy_best (crc, socket->recvbuf, payload + n,
+                                  len - n);
+    socket->rx_inplace = payload;
+  }
+  else if (mode == MICROTCP_CSUM_FULL) {
+    crc = update_crc32_best (crc, payload, len);
+  }
+  if ((crc ^ 0xffffffff) != header->checksum) {
+    socket->rx_inplace = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Describes the bytes [off, off + len) of the source with at most max
+ * iovecs that point straight into the user buffers.
+ *
+ * @return the number of bytes described, less than len if more than max
+ * iovecs would be needed
+ */
+static size_t
+microtcp_source_slice (const struct microtcp_source *src, size_t off,
+                       size_t len, struct iovec *out, int max, int *cnt)
+{
+  size_t done = 0;
+  size_t n;
+  int i = 0;
+
+  *cnt = 0;
+  while (i < src->iovcnt && off >= src->iov[i].iov_len) {
+    off -= src->iov[i++].iov_len;
+  }
+  for (; i < src->iovcnt && done < len && *cnt < max; i++, off = 0) {
+    n = src->iov[i].iov_len - off;
+    if (n == 0) {
+      continue;
+    }
+    if (n > len - done) {
+      n = len - done;
+    }
+    out[*cnt].iov_base = (uint8_t *) src->iov[i].iov_base + off;
+    out[*cnt].iov_len = n;
+    (*cnt)++;
+    done += n;
+  }
+  return done;
+}
+
+static int
+microtcp_same_peer (const struct sockaddr_storage *a,
+                    const struct sockaddr_storage *b, socklen_t len)
+{
+  return memcmp (a, b, len) == 0;
+}
+
+/**
+ * Inserts the range [start, end) in a sorted list of blocks, merging it
+ * with every block it overlaps or touches.
+ *
+ * @return 0 on success, -1 if the list is full
+ */
+static int
+microtcp_blocks_insert (microtcp_seq_block_t *blocks, size_t *count,
+                        uint32_t start, uint32_t end)
+{
+  size_t i = 0;
+  size_t j;
+
+  while (i < *count && SEQ_LT(blocks[i].end, start)) {
+    i++;
+  }
+  for (j = i; j < *count && SEQ_LEQ(blocks[j].start, end); j++) {
+    if (SEQ_LT(blocks[j].start, start)) {
+      start = blocks[j].start;
+    }
+    if (SEQ_GT(blocks[j].end, end)) {
+      end = blocks[j].end;
+    }
+  }
+
+  if (j == i) {
+    if (*count == MICROTCP_MAX_SEQ_BLOCKS) {
+      return -1;
+    }
+    memmove (&blocks[i + 1], &blocks[i], (*count - i) * sizeof(*blocks));
+    (*count)++;
+  }
+  else if (j > i + 1) {
+    memmove (&blocks[i + 1], &blocks[j], (*count - j) * sizeof(*blocks));
+    *count -= j - i - 1;
+  }
+  blocks[i].start = start;
+  blocks[i].end = end;
+  return 0;
+}
+
+/**
+ * Removes from a sorted list of blocks everything below seq.
+ */
+static void
+microtcp_blocks_trim (microtcp_seq_block_t *blocks, size_t *count,
+                      uint32_t seq)
+{
+  size_t i = 0;
+
+  while (i < *count && SEQ_LEQ(blocks[i].end, seq)) {
+    i++;
+  }
+  memmove (blocks, &blocks[i], (*count - i) * sizeof(*blocks));
+  *count -= i;
+  if (*count && SEQ_LT(blocks[0].start, seq)) {
+    blocks[0].start = seq;
+  }
+}
+
+/**
+ * @return the number of bytes of [start, end) covered by the blocks
+ */
+static uint32_t
+microtcp_blocks_covered (const microtcp_seq_block_t *blocks, size_t count,
+                         uint32_t start, uint32_t end)
+{
+  uint32_t covered = 0;
+  uint32_t s;
+  uint32_t e;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    s = SEQ_GT(blocks[i].start, start) ? blocks[i].start : start;
+    e = SEQ_LT(blocks[i].end, end) ? blocks[i].end : end;
+    if (SEQ_LT(s, e)) {
+      covered += e - s;
+    }
+  }
+  return covered;
+}
+
+/**
+ * Encodes an out-of-order block as a SACK word: the offset of the block
+ * from the ACK number in the upper 16 bits and its length in the lower.
+ * Both are in the units of our window scale. The block is rounded inwards,
+ * so the peer never considers SACKed a byte we do not hold.
+ *
+ * @return 0 if the block cannot be represented
+ */
+static uint32_t
+microtcp_sack_encode (uint32_t ack, const microtcp_seq_block_t *block,
+                      uint8_t shift)
+{
+  uint32_t unit = (uint32_t) 1 << shift;
+  uint32_t off = ((block->start - ack) + unit - 1) >> shift;
+  uint32_t end = (block->end - ack) >> shift;
+  uint32_t len;
+
+  if (off > 0xffff || end <= off) {
+    return 0;
+  }
+  len = end - off;
+  if (len > 0xffff) {
+    len = 0xffff;
+  }
+  return (off << 16) | len;
+}
+
+/**
+ * Reports the out-of-order blocks of the receive buffer in the future_use
+ * fields. As in RFC 2018, the block holding the most recently received
+ * segment goes first. With timestamps only that block fits.
+ */
+static void
+microtcp_fill_sack (microtcp_sock_t *socket, microtcp_header_t *header)
+{
+  uint32_t *words[MICROTCP_MAX_SACK_BLOCKS] =
+    { &header->future_use0, &header->future_use1, &header->future_use2 };
+  uint32_t ack = socket->ack_number;
+  uint8_t shift = socket->rcv_wscale;
+  size_t max = socket->opts & MICROTCP_OPT_TIMESTAMPS ?
+      1 : MICROTCP_MAX_SACK_BLOCKS;
+  size_t first;
+  size_t n = 0;
+  size_t i;
+
+  for (first = 0; first < socket->ooo_count; first++) {
+    if (SEQ_LEQ(socket->ooo_blocks[first].start, socket->ooo_recent)
+        && SEQ_LT(socket->ooo_recent, socket->ooo_blocks[first].end)) {
+      *words[n] = microtcp_sack_encode (ack, &socket->ooo_blocks[first], shift);
+      n += *words[n] != 0;
+      break;
+    }
+  }
+  for (i = 0; i < socket->ooo_count && n < max; i++) {
+    if (i != first) {
+      *words[n] = microtcp_sack_encode (ack, &socket->ooo_blocks[i], shift);
+      n += *words[n] != 0;
+    }
+  }
+  if (n) {
+    header->control |= MICROTCP_SACK;
+  }
+}
+
+static uint64_t
+microtcp_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Feeds an RTT measurement to the estimator of RFC 6298 (Jacobson/Karels)
+ * and recomputes the RTO. A fresh sample also drops any backoff.
+ */
+static void
+microtcp_rtt_sample (microtcp_sock_t *socket, uint32_t rtt)
+{
+  uint32_t delta;
+  uint64_t rto;
+
+  if (rtt == 0) {
+    rtt = 1;
+  }
+  if (socket->srtt_us == 0) {
+    socket->srtt_us = rtt;
+    socket->rttvar_us = rtt / 2;
+  }
+  else {
+    delta = socket->srtt_us > rtt ?
+        socket->srtt_us - rtt : rtt - socket->srtt_us;
+    /* rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt */
+    socket->rttvar_us += ((int64_t) delta - socket->rttvar_us) / 4;
+    socket->srtt_us += ((int64_t) rtt - socket->srtt_us) / 8;
+  }
+
+  rto = (uint64_t) socket->srtt_us + 4 * (uint64_t) socket->rttvar_us;
+  if (rto < MICROTCP_MIN_RTO_US) {
+    rto = MICROTCP_MIN_RTO_US;
+  }
+  if (rto > MICROTCP_MAX_RTO_US) {
+    rto = MICROTCP_MAX_RTO_US;
+  }
+  socket->rto_us = rto;
+}
+
+/**
+ * Doubles the RTO after a retransmission timeout.
+ */
+static void
+microtcp_rto_backoff (microtcp_sock_t *socket)
+{
+  socket->rto_us *= 2;
+  if (socket->rto_us > MICROTCP_MAX_RTO_US) {
+    socket->rto_us = MICROTCP_MAX_RTO_US;
+  }
+}
+
+/**
+ * Takes an RTT sample from the segment that completed the handshake. If
+ * our SYN was retransmitted, only an echoed timestamp tells which copy it
+ * answers (Karn's algorithm).
+ *
+ * @param sent when the first copy of our SYN was sent
+ */
+static void
+microtcp_handshake_rtt (microtcp_sock_t *socket,
+                        const microtcp_header_t *header, uint64_t sent,
+                        int retries)
+{
+  uint64_t now = microtcp_now_us ();
+
+  if ((socket->opts & MICROTCP_OPT_TIMESTAMPS)
+      && (header->control & MICROTCP_TS) && header->future_use2) {
+    microtcp_rtt_sample (socket, (uint32_t) now - header->future_use2);
+  }
+  else if (retries == 0) {
+    microtcp_rtt_sample (socket, now - sent);
+  }
+}
+
+/**
+ * The window we advertise to the peer, based on the free space of the
+ * receive buffer. As in TCP, the window of a SYN is never scaled.
+ */
+static uint16_t
+microtcp_adv_window (microtcp_sock_t *socket, uint16_t control)
+{
+  size_t win;
+
+  socket->curr_win_size = socket->recvbuf_len - socket->buf_fill_level;
+  win = socket->curr_win_size;
+  if (!(control & MICROTCP_SYN)) {
+    win >>= socket->rcv_wscale;
+  }
+  return win > 0xffff ? 0xffff : win;
+}
+
+/**
+ * @return the smallest shift that lets a window of len bytes fit in the
+ * 16-bit window field
+ */
+static uint8_t
+microtcp_wscale (size_t len)
+{
+  uint8_t shift = 0;
+
+  while (shift < MICROTCP_MAX_WSCALE && (len >> shift) > 0xffff) {
+    shift++;
+  }
+  return shift;
+}
+
+/**
+ * Applies the options of the SYN or the SYN-ACK of the peer. Only the
+ * flags both sides offered remain, and with window scaling the shift of
+ * the peer applies to every window it sends from now on.
+ */
+static void
+microtcp_negotiate (microtcp_sock_t *socket, uint32_t peer_opts)
+{
+  uint32_t peer_csum = (peer_opts & MICROTCP_OPT_CSUM_MASK)
+      >> MICROTCP_OPT_CSUM_OFFSET;
+
+  socket->opts &= peer_opts & MICROTCP_OPT_FLAGS;
+  /* The stricter mode wins, anything unknown means a full checksum */
+  if (peer_csum > MICROTCP_CSUM_NONE) {
+    peer_csum = MICROTCP_CSUM_FULL;
+  }
+  if ((int) peer_csum < socket->csum_mode) {
+    socket->csum_mode = peer_csum;
+  }
+  if (socket->opts & MICROTCP_OPT_WSCALE) {
+    socket->snd_wscale = (peer_opts & MICROTCP_OPT_WSCALE_MASK)
+        >> MICROTCP_OPT_WSCALE_OFFSET;
+    if (socket->snd_wscale > MICROTCP_MAX_WSCALE) {
+      socket->snd_wscale = MICROTCP_MAX_WSCALE;
+    }
+  }
+  else {
+    socket->snd_wscale = 0;
+    socket->rcv_wscale = 0;
+  }
+}
+
+/**
+ * Starts slow start from the largest window the peer can advertise, so a
+ * large receive buffer is not held back by the default threshold.
+ */
+static void
+microtcp_init_ssthresh (microtcp_sock_t *socket)
+{
+  size_t max_win = (size_t) 0xffff << socket->snd_wscale;
+
+  if (socket->ssthresh < max_win) {
+    socket->ssthresh = max_win;
+  }
+}
+
+/**
+ * Stores len bytes in the receive ring, off bytes after the first unread
+ * byte.
+ */
+static void
+microtcp_ring_write (microtcp_sock_t *socket, size_t off, const uint8_t *src,
+                     size_t len)
+{
+  size_t pos = (socket->recvbuf_head + off) & (socket->recvbuf_len - 1);
+  size_t n = socket->recvbuf_len - pos;
+
+  if (n > len) {
+    n = len;
+  }
+  memcpy (socket->recvbuf + pos, src, n);
+  memcpy (socket->recvbuf, src + n, len - n);
+}
+
+/**
+ * Consumes len bytes from the start of the receive ring.
+ */
+static void
+microtcp_ring_read (microtcp_sock_t *socket, uint8_t *dst, size_t len)
+{
+  size_t pos = socket->recvbuf_head;
+  size_t n = socket->recvbuf_len - pos;
+
+  if (n > len) {
+    n = len;
+  }
+  memcpy (dst, socket->recvbuf + pos, n);
+  memcpy (dst + n, socket->recvbuf, len - n);
+  socket->recvbuf_head = (pos + len) & (socket->recvbuf_len - 1);
+}
+
+/**
+ * Builds and transmits a single segment to the peer of the socket. Only
+ * the header is written in the transmit batch, the payload iovecs are
+ * passed to the kernel as they are, so the payload is never copied.
+ *
+ * @param seq the sequence number of the segment
+ * @param control the control bits
+ * @param payload the payload of the segment, NULL if there is not any
+ * @param iovcnt the number of payload iovecs, at most
+ * MICROTCP_SEG_IOV_LEN - 1
+ * @param len the length of the payload
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_send_segment (microtcp_sock_t *socket, uint32_t seq, uint16_t control,
+                       const struct iovec *payload, int iovcnt, size_t len)
+{
+  struct microtcp_batch *txq = socket->txq;
+  struct iovec *iov;
+  microtcp_header_t *header;
+
+  if (txq->count == MICROTCP_BATCH_LEN && microtcp_flush (socket)) {
+    return -1;
+  }
+  iov = txq->iov[txq->count];
+  header = (microtcp_header_t *) txq->bufs[txq->count];
+
+  memset (header, 0, sizeof(microtcp_header_t));
+  header->seq_number = seq;
+  header->ack_number = socket->ack_number;
+  header->control = control;
+  header->window = microtcp_adv_window (socket, control);
+  header->data_len = len;
+  if (control & MICROTCP_SYN) {
+    header->future_use0 = socket->opts;
+    if (socket->opts & MICROTCP_OPT_WSCALE) {
+      header->future_use0 |= (uint32_t) socket->rcv_wscale
+          << MICROTCP_OPT_WSCALE_OFFSET;
+    }
+    header->future_use0 |= (uint32_t) socket->csum_mode
+        << MICROTCP_OPT_CSUM_OFFSET;
+  }
+  else if ((control & MICROTCP_ACK) && socket->ooo_count
+      && (socket->opts & MICROTCP_OPT_SACK_PERMITTED)) {
+    microtcp_fill_sack (socket, header);
+  }
+  if (socket->opts & MICROTCP_OPT_TIMESTAMPS) {
+    header->control |= MICROTCP_TS;
+    header->future_use1 = microtcp_now_us ();
+    header->future_use2 = socket->ts_recent;
+  }
+  header->checksum = microtcp_checksum_iov (header, payload, iovcnt,
+                                            microtcp_csum_mode (socket,
+                                                                control));
+  if (control & MICROTCP_ACK) {
+    /* Any ACK carries what a deferred one would */
+    socket->ack_pending = 0;
+    microtcp_timer_cancel (socket->wheel, &socket->dack_timer);
+  }
+
+  /* Queue it, the batch goes out before we block or return to the user */
+  iov[0].iov_len = sizeof(microtcp_header_t);
+  memcpy (&iov[1], payload, iovcnt * sizeof(struct iovec));
+  txq->msgs[txq->count].msg_hdr.msg_iovlen = 1 + iovcnt;
+  txq->msgs[txq->count].msg_hdr.msg_name = &socket->peer_addr;
+  txq->msgs[txq->count].msg_hdr.msg_namelen = socket->peer_addr_len;
+  txq->count++;
+  socket->packets_send++;
+  socket->bytes_send += len;
+  return 0;
+}
+
+static int
+microtcp_send_ack (microtcp_sock_t *socket)
+{
+  return microtcp_send_segment (socket, socket->seq_number, MICROTCP_ACK,
+                                NULL, 0, 0);
+}
+
+/**
+ * Sends the SYN-ACK of a passive open. During the handshake it gives a
+ * peer that offered fast open its cookie.
+ */
+static int
+microtcp_send_synack (microtcp_sock_t *socket, uint32_t seq)
+{
+  struct iovec iov = { &socket->fastopen_cookie,
+                       MICROTCP_FASTOPEN_COOKIE_LEN };
+
+  if (socket->state == HANDSHAKE
+      && (socket->opts & MICROTCP_OPT_FASTOPEN)) {
+    return microtcp_send_segment (socket, seq, MICROTCP_SYN | MICROTCP_ACK,
+                                  &iov, 1, iov.iov_len);
+  }
+  return microtcp_send_segment (socket, seq, MICROTCP_SYN | MICROTCP_ACK,
+                                NULL, 0, 0);
+}
+
+/**
+ * (Re)arms a timer of the socket and forgets any earlier expiration of it.
+ *
+ * @param event the MICROTCP_EV_* bit the timer sets when it fires
+ * @param delay_us the time from now until the timer fires
+ */
+static void
+microtcp_timer_start (microtcp_sock_t *socket, microtcp_timer_t *timer,
+                      unsigned int event, uint64_t delay_us)
+{
+  socket->timer_events &= ~event;
+  timer->arg = socket;
+  microtcp_timer_arm (socket->wheel, timer, microtcp_now_us () + delay_us);
+}
+
+static void
+microtcp_timer_stop (microtcp_sock_t *socket, microtcp_timer_t *timer,
+                     unsigned int event)
+{
+  socket->timer_events &= ~event;
+  microtcp_timer_cancel (socket->wheel, timer);
+}
+
+static void
+microtcp_rto_start (microtcp_sock_t *socket)
+{
+  microtcp_timer_start (socket, &socket->rto_timer, MICROTCP_EV_RTO,
+                        socket->rto_us);
+}
+
+/**
+ * @return the rate to pace the transmissions at in bytes per second, 0 if
+ * there is no RTT estimate yet
+ */
+static uint64_t
+microtcp_pacing_rate (microtcp_sock_t *socket)
+{
+  uint64_t rate = socket->cc->pacing_rate (socket);
+
+  if (rate == 0 && socket->srtt_us) {
+    /*
+     * The window spread over an RTT. As Linux does, twice that in slow
+     * start so the window can still double, a bit more after it.
+     */
+    rate = (uint64_t) socket->cwnd * 1000000 / socket->srtt_us;
+    if (socket->cwnd < socket->ssthresh) {
+      rate *= 2;
+    }
+    else {
+      rate = rate * 5 / 4;
+    }
+  }
+  return rate;
+}
+
+/**
+ * Passes the pacing rate to the kernel whenever it has changed noticeably.
+ * If the kernel does not take it, the token bucket paces instead.
+ */
+static void
+microtcp_pace_kernel (microtcp_sock_t *socket)
+{
+  uint64_t rate = microtcp_pacing_rate (socket);
+  uint64_t diff;
+
+  if (rate == 0) {
+    return;
+  }
+  diff = rate > socket->pace_kernel_rate ? rate - socket->pace_kernel_rate
+      : socket->pace_kernel_rate - rate;
+  if (diff <= socket->pace_kernel_rate >> MICROTCP_PACE_KERNEL_SLACK) {
+    return;
+  }
+#ifdef SO_MAX_PACING_RATE
+  if (setsockopt (socket->sd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                  sizeof(uint64_t)) == 0) {
+    socket->pace_kernel_rate = rate;
+    return;
+  }
+#endif
+  socket->pacing = MICROTCP_PACING_BUCKET;
+}
+
+/**
+ * Takes a segment out of the token bucket. The bucket fills at the pacing
+ * rate and holds about a tick of the timer wheel worth of bytes, as no
+ * shorter gap between two bursts can be timed.
+ *
+ * @param len the length of the segment
+ * @return 1 if the segment may be sent now, 0 if the pacing timer was
+ * armed to wait for the bucket to refill
+ */
+static int
+microtcp_pace (microtcp_sock_t *socket, size_t len)
+{
+  uint64_t rate;
+  uint64_t now;
+  uint64_t elapsed;
+  int64_t burst;
+
+  if (socket->pacing != MICROTCP_PACING_BUCKET) {
+    return 1;
+  }
+  rate = microtcp_pacing_rate (socket);
+  if (rate == 0 || rate > MICROTCP_PACE_MAX_RATE) {
+    return 1;
+  }
+
+  burst = (int64_t) (rate * MICROTCP_TIMER_TICK_US);
+  if (burst < (int64_t) MICROTCP_PACE_MIN_BURST * MICROTCP_MSS * 1000000) {
+    burst = (int64_t) MICROTCP_PACE_MIN_BURST * MICROTCP_MSS * 1000000;
+  }
+  now = microtcp_now_us ();
+  elapsed = now - socket->pace_stamp;
+  /* Keeps the product in range, a second fills any bucket anyway */
+  if (elapsed > 1000000) {
+    elapsed = 1000000;
+  }
+  socket->pace_stamp = now;
+  socket->pace_tokens += (int64_t) (elapsed * rate);
+  if (socket->pace_tokens > burst) {
+    socket->pace_tokens = burst;
+  }
+
+  if (socket->pace_tokens <= 0) {
+    microtcp_timer_start (socket, &socket->pace_timer, MICROTCP_EV_PACE,
+                          (uint64_t) -socket->pace_tokens / rate + 1);
+    return 0;
+  }
+  socket->pace_tokens -= (int64_t) len * 1000000;
+  return 1;
+}
+
+/**
+ * @return the bytes that are considered to be in the network: everything
+ * outstanding, except the SACKed ranges and the holes that wait for a
+ * retransmission.
+ */
+static size_t
+microtcp_pipe (const microtcp_sock_t *socket)
+{
+  uint32_t snd_nxt = socket->seq_number;
+  size_t pipe;
+
+  pipe = (uint32_t) (snd_nxt - socket->snd_una)
+      - microtcp_blocks_covered (socket->sacked, socket->sacked_count,
+                                 socket->snd_una, snd_nxt);
+  if (SEQ_LT(socket->rtx_nxt, socket->rtx_high)) {
+    pipe -= (socket->rtx_high - socket->rtx_nxt)
+        - microtcp_blocks_covered (socket->sacked, socket->sacked_count,
+                                   socket->rtx_nxt, socket->rtx_high);
+  }
+  return pipe;
+}
+
+/**
+ * Finds the next hole in [rtx_nxt, rtx_high) that the peer has not SACKed.
+ *
+ * @return 1 if a hole was found, 0 otherwise
+ */
+static int
+microtcp_next_hole (microtcp_sock_t *socket, uint32_t *seq, size_t *len)
+{
+  uint32_t p = socket->rtx_nxt;
+  uint32_t end = socket->rtx_high;
+  size_t i;
+
+  for (i = 0; i < socket->sacked_count; i++) {
+    if (SEQ_LEQ(socket->sacked[i].end, p)) {
+      continue;
+    }
+    if (SEQ_GT(socket->sacked[i].start, p)) {
+      break;
+    }
+    p = socket->sacked[i].end;
+  }
+  if (!SEQ_LT(p, end)) {
+    socket->rtx_nxt = end;
+    return 0;
+  }
+  if (i < socket->sacked_count && SEQ_LT(socket->sacked[i].start, end)) {
+    end = socket->sacked[i].start;
+  }
+  socket->rtx_nxt = p;
+  *seq = p;
+  *len = end - p;
+  return 1;
+}
+
+/**
+ * @param end the sequence number after the segment
+ * @return the control bits of a data segment
+ */
+static uint16_t
+microtcp_data_control (const struct microtcp_source *src, uint32_t end)
+{
+  /*
+   * The write blocks until its end is acknowledged, so the peer should
+   * not delay that ACK
+   */
+  if (end == src->base + src->length) {
+    return MICROTCP_ACK | MICROTCP_PSH;
+  }
+  return MICROTCP_ACK;
+}
+
+/**
+ * Transmits as much as the congestion and the flow control allow. Holes
+ * pending retransmission go out before any new data.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_transmit (microtcp_sock_t *socket, const struct microtcp_source *src)
+{
+  struct iovec slices[MICROTCP_SEG_IOV_LEN - 1];
+  uint32_t seq;
+  size_t pipe;
+  size_t room;
+  size_t flow;
+  size_t off;
+  size_t seg;
+  int cnt;
+
+  if (socket->pacing == MICROTCP_PACING_KERNEL) {
+    microtcp_pace_kernel (socket);
+  }
+
+  while ((pipe = microtcp_pipe (socket)) < socket->cwnd) {
+    room = socket->cwnd - pipe;
+
+    if (microtcp_next_hole (socket, &seq, &seg)) {
+      if (seg > MICROTCP_MSS) {
+        seg = MICROTCP_MSS;
+      }
+      if (seg > room) {
+        seg = room;
+      }
+      seg = microtcp_source_slice (src, (uint32_t) (seq - src->base), seg,
+                                   slices, MICROTCP_SEG_IOV_LEN - 1, &cnt);
+      if (!microtcp_pace (socket, seg)) {
+        break;
+      }
+      if (microtcp_send_segment (socket, seq, microtcp_data_control (src,
+                                 seq + seg), slices, cnt, seg)) {
+        return -1;
+      }
+      socket->rtx_nxt = seq + seg;
+      /* Karn: an ACK after a retransmission is no RTT sample */
+      socket->rtt_timing = 0;
+      /* Timeouts count their losses up front */
+      if (socket->in_recovery) {
+        socket->packets_lost++;
+        socket->bytes_lost += seg;
+        socket->packets_lost_dupack++;
+        socket->bytes_lost_dupack += seg;
+      }
+      continue;
+    }
+
+    off = (uint32_t) (socket->seq_number - src->base);
+    flow = (uint32_t) (socket->snd_una + socket->peer_win
+        - socket->seq_number);
+    if (off >= src->length || SEQ_GEQ(socket->seq_number,
+                                      socket->snd_una + socket->peer_win)) {
+      break;
+    }
+    seg = src->length - off;
+    if (seg < MICROTCP_MSS && src->hold) {
+      break;
+    }
+    if (seg > MICROTCP_MSS) {
+      seg = MICROTCP_MSS;
+    }
+    if (seg > room) {
+      seg = room;
+    }
+    if (seg > flow) {
+      seg = flow;
+    }
+    seg = microtcp_source_slice (src, off, seg, slices,
+                                 MICROTCP_SEG_IOV_LEN - 1, &cnt);
+    if (!microtcp_pace (socket, seg)) {
+      break;
+    }
+    if (socket->seq_number == socket->snd_una) {
+      microtcp_rto_start (socket);
+    }
+    if (!socket->rtt_timing
+        && !(socket->opts & MICROTCP_OPT_TIMESTAMPS)) {
+      socket->rtt_timing = 1;
+      socket->rtt_seq = socket->seq_number;
+      socket->rtt_start = microtcp_now_us ();
+    }
+    if (microtcp_send_segment (socket, socket->seq_number,
+                               microtcp_data_control (src,
+                                                      socket->seq_number + seg),
+                               slices, cnt, seg)) {
+      return -1;
+    }
+    socket->seq_number += seg;
+  }
+  return 0;
+}
+
+/**
+ * Acts on the expiration of the retransmission timer: everything
+ * outstanding is presumed lost, or the zero window of the peer is probed
+ * if nothing is.
+ */
+static void
+microtcp_rto_recover (microtcp_sock_t *socket)
+{
+  size_t flight;
+  size_t lost;
+
+  flight = (uint32_t) (socket->seq_number - socket->snd_una);
+  if (flight == 0) {
+    /*
+     * The peer advertised a zero window. Probe it with an empty segment
+     * below its ACK number, which it answers with its current window.
+     */
+    microtcp_send_segment (socket, socket->seq_number - 1, MICROTCP_ACK,
+                           NULL, 0, 0);
+    microtcp_rto_start (socket);
+    return;
+  }
+
+  /*
+   * Timeout: the congestion control restarts from a small window and
+   * everything the peer has not SACKed is retransmitted. Without SACK, go
+   * back to the oldest unacknowledged byte.
+   */
+  lost = flight - microtcp_blocks_covered (socket->sacked,
+                                           socket->sacked_count,
+                                           socket->snd_una,
+                                           socket->seq_number);
+  socket->packets_lost += (lost + MICROTCP_MSS - 1) / MICROTCP_MSS;
+  socket->bytes_lost += lost;
+  socket->packets_lost_rto += (lost + MICROTCP_MSS - 1) / MICROTCP_MSS;
+  socket->bytes_lost_rto += lost;
+  socket->in_recovery = 0;
+  socket->dupacks = 0;
+  socket->cc->on_rto (socket);
+  socket->rtt_timing = 0;
+  microtcp_rto_backoff (socket);
+  microtcp_rto_start (socket);
+  if (socket->opts & MICROTCP_OPT_SACK_PERMITTED) {
+    socket->rtx_nxt = socket->snd_una;
+    socket->rtx_high = socket->seq_number;
+  }
+  else {
+    if (SEQ_GT(socket->seq_number, socket->snd_max)) {
+      socket->snd_max = socket->seq_number;
+    }
+    socket->seq_number = socket->snd_una;
+    socket->rtx_nxt = socket->rtx_high = socket->snd_una;
+  }
+}
+
+/**
+ * Describes the data of the send buffer that the peer has not
+ * acknowledged yet, [snd_una, snd_end).
+ *
+ * @return the number of iovecs used, at most 2
+ */
+static int
+microtcp_sndbuf_iov (const microtcp_sock_t *socket, struct iovec *iov)
+{
+  size_t head = socket->snd_una & (socket->sndbuf_len - 1);
+  size_t len = (uint32_t) (socket->snd_end - socket->snd_una);
+
+  iov[0].iov_base = socket->sndbuf + head;
+  if (head + len <= socket->sndbuf_len) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = socket->sndbuf_len - head;
+  iov[1].iov_base = socket->sndbuf;
+  iov[1].iov_len = len - iov[0].iov_len;
+  return 2;
+}
+
+/**
+ * Completes the handshake with the SYN-ACK of the peer and acknowledges it.
+ *
+ * @param sent when the first copy of our SYN was sent
+ * @param retries the retransmissions of the SYN
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_active_established (microtcp_sock_t *socket,
+                             const microtcp_header_t *header, uint64_t sent,
+                             int retries)
+{
+  // Here we update seq,ack variables of the socket
+  // and send the last packet, (3rd of the handshake)
+  socket->ack_number = header->seq_number + 1; //ACK = server.seq + 1
+  /* Past our SYN and any of the data it carried that the peer took */
+  socket->seq_number = header->ack_number;
+  socket->snd_una = socket->seq_number;
+  socket->rtx_nxt = socket->rtx_high = socket->snd_una;
+  socket->snd_max = socket->snd_una;
+  socket->init_win_size = header->window;
+  socket->peer_win = header->window;
+  microtcp_negotiate (socket, header->future_use0);
+  microtcp_init_ssthresh (socket);
+  if (header->control & MICROTCP_TS) {
+    socket->ts_recent = header->future_use1;
+  }
+  microtcp_handshake_rtt (socket, header, sent, retries);
+  socket->cc->init (socket);
+
+  if (microtcp_send_ack (socket) || microtcp_flush (socket)) {
+    socket->state = CLOSED;
+    return -1;
+  }
+
+  socket->state = ESTABLISHED;
+  return 0;
+}
+
+/**
+ * The close handshake of a non-blocking socket, once the peer has
+ * acknowledged its send buffer. It does what microtcp_client_finish() and
+ * microtcp_server_finish() do for blocking sockets, driven by the input
+ * and the timers, and ends in the CLOSED state.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_close_output (microtcp_sock_t *socket)
+{
+  uint32_t fin_seq = socket->snd_end;
+
+  if ((uint32_t) socket->seq_number == fin_seq
+      || (socket->snd_una == fin_seq
+          && (socket->timer_events & MICROTCP_EV_RTO))) {
+    if ((uint32_t) socket->seq_number == fin_seq) {
+      socket->seq_number++;
+      socket->syn_retries = 0;
+    }
+    else if (++socket->syn_retries == MICROTCP_MAX_RETRIES) {
+      socket->closing = MICROTCP_CLOSE_FAILED;
+      socket->state = CLOSED;
+      microtcp_poller_touch (socket);
+      return -1;
+    }
+    else {
+      microtcp_rto_backoff (socket);
+    }
+    socket->timer_events &= ~MICROTCP_EV_RTO;
+    if (microtcp_send_segment (socket, fin_seq, MICROTCP_FIN | MICROTCP_ACK,
+                               NULL, 0, 0)) {
+      return -1;
+    }
+    microtcp_rto_start (socket);
+    return microtcp_flush (socket);
+  }
+  if (socket->snd_una == fin_seq) {
+    return microtcp_flush (socket);
+  }
+
+  /* Our FIN is acknowledged */
+  if (socket->closing == MICROTCP_CLOSE_PASSIVE) {
+    socket->state = CLOSED;
+  }
+  else if (socket->state == ESTABLISHED) {
+    socket->state = CLOSING_BY_HOST;
+    microtcp_timer_start (socket, &socket->fin_timer, MICROTCP_EV_FIN,
+                          (uint64_t) MICROTCP_MAX_RETRIES * socket->rto_us);
+  }
+  else if (socket->timer_events & MICROTCP_EV_FIN) {
+    /* The FIN of the peer never came, or the linger is over */
+    if (socket->state != CLOSING_BY_PEER) {
+      socket->closing = MICROTCP_CLOSE_FAILED;
+    }
+    socket->state = CLOSED;
+  }
+  else if (socket->state == CLOSING_BY_PEER) {
+    /* Linger, in case our last ACK is lost and the FIN comes again */
+    microtcp_timer_start (socket, &socket->fin_timer, MICROTCP_EV_FIN,
+                          MICROTCP_LINGER_RTOS * socket->rto_us);
+  }
+  microtcp_poller_touch (socket);
+  return microtcp_flush (socket);
+}
+
+/**
+ * Moves a non-blocking socket forward, as nobody waits on it to do so: acts
+ * on its expired timers and sends what the windows allow from the send
+ * buffer. During a connect the timer retransmits the SYN, until the
+ * connect fails.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_output (microtcp_sock_t *socket)
+{
+  struct iovec iov[2];
+  struct microtcp_source src;
+
+  microtcp_poller_touch (socket);
+  if (socket->state == HANDSHAKE && !socket->listener) {
+    if (!(socket->timer_events & MICROTCP_EV_RTO)) {
+      return 0;
+    }
+    socket->timer_events &= ~MICROTCP_EV_RTO;
+    if (++socket->syn_retries == MICROTCP_MAX_RETRIES) {
+      socket->state = CLOSED;
+      return -1;
+    }
+    microtcp_rto_backoff (socket);
+    if (microtcp_send_segment (socket, socket->seq_number, MICROTCP_SYN,
+                               NULL, 0, 0)) {
+      return -1;
+    }
+    microtcp_rto_start (socket);
+    return microtcp_flush (socket);
+  }
+  if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER
+      && socket->state != CLOSING_BY_HOST) {
+    return microtcp_flush (socket);
+  }
+
+  /* The bucket has refilled, so transmit again */
+  socket->timer_events &= ~MICROTCP_EV_PACE;
+  if (socket->closing && SEQ_GT(socket->seq_number, socket->snd_end)) {
+    return microtcp_close_output (socket);
+  }
+  if (socket->timer_events & MICROTCP_EV_RTO) {
+    socket->timer_events &= ~MICROTCP_EV_RTO;
+    microtcp_rto_recover (socket);
+  }
+
+  if (socket->sndbuf) {
+    src.iov = iov;
+    src.iovcnt = microtcp_sndbuf_iov (socket, iov);
+    src.length = (uint32_t) (socket->snd_end - socket->snd_una);
+    src.base = socket->snd_una;
+    src.hold = socket->snd_hold;
+    if (microtcp_transmit (socket, &src)) {
+      return -1;
+    }
+    /* Nothing could be sent, so the window is closed. Probe it on RTO. */
+    if (socket->seq_number == socket->snd_una
+        && (src.length >= MICROTCP_MSS || (src.length && !src.hold))
+        && !microtcp_timer_armed (&socket->rto_timer)
+        && !microtcp_timer_armed (&socket->pace_timer)) {
+      microtcp_rto_start (socket);
+    }
+  }
+  if (socket->closing && socket->snd_una == socket->snd_end) {
+    return microtcp_close_output (socket);
+  }
+  return microtcp_flush (socket);
+}
+
+static void
+microtcp_rto_fired (microtcp_timer_t *timer, void *arg)
+{
+  microtcp_sock_t *socket = arg;
+
+  socket->timer_events |= MICROTCP_EV_RTO;
+  if (socket->nonblock) {
+    microtcp_output (socket);
+  }
+}
+
+static void
+microtcp_fin_fired (microtcp_timer_t *timer, void *arg)
+{
+  microtcp_sock_t *socket = arg;
+
+  socket->timer_events |= MICROTCP_EV_FIN;
+  if (socket->nonblock) {
+    microtcp_output (socket);
+  }
+}
+
+static void
+microtcp_pace_fired (microtcp_timer_t *timer, void *arg)
+{
+  microtcp_sock_t *socket = arg;
+
+  socket->timer_events |= MICROTCP_EV_PACE;
+  if (socket->nonblock) {
+    microtcp_output (socket);
+  }
+}
+
+static void
+microtcp_dack_fired (microtcp_timer_t *timer, void *arg)
+{
+  /* The socket may be idle, with nobody else to flush its queue */
+  microtcp_send_ack ((microtcp_sock_t *) arg);
+  microtcp_flush ((microtcp_sock_t *) arg);
+}
+
+/**
+ * Drops from the cork buffer the data that the peer acknowledged after
+ * microtcp_cork_fired() sent it
+ */
+static void
+microtcp_cork_trim (microtcp_sock_t *socket)
+{
+  size_t acked = (uint32_t) (socket->snd_una - socket->cork_seq);
+
+  if (acked == 0 || socket->cork_len == 0) {
+    return;
+  }
+  if (acked > socket->cork_len) {
+    acked = socket->cork_len;
+  }
+  memmove (socket->cork_buf, socket->cork_buf + acked,
+           socket->cork_len - acked);
+  socket->cork_len -= acked;
+  socket->cork_seq += acked;
+}
+
+/**
+ * Sends the data held back by the cork once it is due. A blocking socket
+ * keeps the data in its cork buffer until the peer acknowledges it, for
+ * its next call to retransmit it if needed.
+ */
+static void
+microtcp_cork_fired (microtcp_timer_t *timer, void *arg)
+{
+  microtcp_sock_t *socket = arg;
+  struct microtcp_source src;
+  struct iovec iov;
+
+  if (socket->nonblock) {
+    socket->snd_hold = 0;
+    microtcp_output (socket);
+    return;
+  }
+  if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER) {
+    return;
+  }
+  microtcp_cork_trim (socket);
+  iov.iov_base = socket->cork_buf;
+  iov.iov_len = socket->cork_len;
+  src.iov = &iov;
+  src.iovcnt = 1;
+  src.length = socket->cork_len;
+  src.base = socket->cork_seq;
+  src.hold = 0;
+  if (microtcp_transmit (socket, &src) == 0) {
+    microtcp_flush (socket);
+  }
+}
+
+/**
+ * Blocks until the socket is readable or until the next timer of the wheel
+ * is due.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_poll_input (microtcp_sock_t *socket)
+{
+  struct pollfd pfd = { socket->sd, POLLIN, 0 };
+  uint64_t next = microtcp_timer_wheel_next (socket->wheel);
+  uint64_t now;
+  int timeout = -1;
+
+  if (next != UINT64_MAX) {
+    now = microtcp_now_us ();
+    timeout = next > now ? (next - now + 999) / 1000 : 0;
+  }
+  if (poll (&pfd, 1, timeout) == -1 && errno != EINTR) {
+    perror ("POLL");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stores in seg_size the size of the segments that GRO coalesced in each
+ * datagram of the receive batch.
+ */
+static void
+microtcp_gro_parse (struct microtcp_batch *rxq)
+{
+  struct cmsghdr *cmsg;
+  unsigned int i;
+
+  for (i = 0; i < rxq->count; i++) {
+    rxq->seg_size[i] = rxq->msgs[i].msg_len;
+    for (cmsg = CMSG_FIRSTHDR(&rxq->msgs[i].msg_hdr); cmsg;
+        cmsg = CMSG_NXTHDR(&rxq->msgs[i].msg_hdr, cmsg)) {
+#ifdef UDP_GRO
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        rxq->seg_size[i] = *(int *) CMSG_DATA(cmsg);
+      }
+#endif
+    }
+  }
+}
+
+/**
+ * Returns the next valid microTCP segment received by the socket. When the
+ * datagrams of the last recvmmsg() are exhausted, the timer wheel runs,
+ * the queued segments are flushed and a new batch is read, blocking until
+ * input arrives or a timer fires. Datagrams coalesced by GRO are split back
+ * into segments. A socket in an io_uring takes the batch from its ring.
+ *
+ * On a UDP socket shared by the connections of a listener, the segment may
+ * belong to another connection than the one asking, and its checksum is
+ * verified for the connection it belongs to.
+ *
+ * @param pkt set to the segment, valid until the next call
+ * @param from set to the address of the sender
+ * @param owner set to the connection of the sender, or to the listener if
+ * the sender has none
+ * @param dontwait fail with EAGAIN instead of blocking. Non-blocking
+ * sockets act on their timers as they fire, so no timer interrupts the
+ * call either.
+ * @return the size of the segment, 0 if a timer of the socket fired, -1 on
+ * socket errors
+ */
+static ssize_t
+microtcp_recv_segment (microtcp_sock_t *socket, uint8_t **pkt,
+                       struct sockaddr_storage **from, socklen_t *from_len,
+                       microtcp_sock_t **owner, int dontwait)
+{
+  struct microtcp_batch *rxq = socket->rxq;
+  microtcp_sock_t *listener = microtcp_listener_of (socket);
+  microtcp_header_t *header;
+  uint8_t *seg;
+  unsigned int i;
+  size_t len;
+  int ret;
+
+  while (1) {
+    while (rxq->next < rxq->count) {
+      i = rxq->next;
+      if (rxq->next_off >= rxq->msgs[i].msg_len) {
+        rxq->next++;
+        rxq->next_off = 0;
+        continue;
+      }
+      seg = rxq->bufs[i] + rxq->next_off;
+      len = rxq->msgs[i].msg_len - rxq->next_off;
+      if (len > rxq->seg_size[i]) {
+        len = rxq->seg_size[i];
+      }
+      rxq->next_off += len;
+
+      header = (microtcp_header_t *) seg;
+      *owner = socket;
+      if (listener->demux) {
+        *owner = microtcp_demux_lookup (listener->demux,
+                                        (struct sockaddr *) &rxq->addrs[i],
+                                        rxq->msgs[i].msg_hdr.msg_namelen);
+        if (!*owner) {
+          *owner = listener;
+        }
+      }
+      if (len < sizeof(microtcp_header_t)
+          || (rxq->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+          || header->data_len != len - sizeof(microtcp_header_t)
+          || !microtcp_checksum_ok (*owner, header,
+                                    seg + sizeof(microtcp_header_t))) {
+        continue;
+      }
+      *pkt = seg;
+      *from = &rxq->addrs[i];
+      *from_len = rxq->msgs[i].msg_hdr.msg_namelen;
+      return len;
+    }
+
+    /*
+     * Expired timers go first, so the caller acts on them even while
+     * input keeps arriving. Their callbacks may queue segments.
+     */
+    microtcp_timer_wheel_advance (socket->wheel, microtcp_now_us ());
+    if (microtcp_flush (socket)
+        || (listener != socket && microtcp_flush (listener))) {
+      return -1;
+    }
+    if (socket->timer_events && !dontwait) {
+      return 0;
+    }
+    rxq->count = rxq->next = 0;
+    rxq->next_off = 0;
+    for (i = 0; i < rxq->nbufs; i++) {
+      rxq->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+      rxq->msgs[i].msg_hdr.msg_control = rxq->ctrl[i].buf;
+      rxq->msgs[i].msg_hdr.msg_controllen = sizeof(rxq->ctrl[i].buf);
+      rxq->iov[i][0].iov_len = rxq->buf_len;
+    }
+    /* Take whatever is queued and block in poll() only if nothing is */
+    if (listener->uring) {
+      ret = microtcp_uring_recvmmsg (listener->uring, listener, rxq->msgs,
+                                     rxq->nbufs);
+    }
+    else {
+      ret = recvmmsg (socket->sd, rxq->msgs, rxq->nbufs, MSG_DONTWAIT, NULL);
+    }
+    if (ret == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror ("RECEIVE ERROR");
+        return -1;
+      }
+      if (dontwait && errno != EINTR) {
+        return -1;
+      }
+      if (!dontwait && microtcp_poll_input (socket)) {
+        return -1;
+      }
+      continue;
+    }
+    rxq->count = ret;
+    microtcp_gro_parse (rxq);
+  }
+}
+
+/**
+ * Marks for retransmission the holes below the highest SACKed byte. The
+ * oldest segment is always one of them, it is what the duplicate ACKs ask
+ * for.
+ */
+static void
+microtcp_mark_holes (microtcp_sock_t *socket)
+{
+  uint32_t high = socket->snd_una + MICROTCP_MSS;
+
+  if (socket->sacked_count
+      && SEQ_GT(socket->sacked[socket->sacked_count - 1].end, high)) {
+    high = socket->sacked[socket->sacked_count - 1].end;
+  }
+  if (SEQ_GT(high, socket->seq_number)) {
+    high = socket->seq_number;
+  }
+  if (SEQ_LT(socket->rtx_high, high)) {
+    socket->rtx_high = high;
+  }
+}
+
+/**
+ * Enters fast recovery: the congestion control reduces the window and the
+ * missing segments are retransmitted at once instead of waiting for the
+ * RTO. With SACK the pipe accounting of RFC 6675 decides what goes out.
+ * Without it, the window is inflated by the segments that left the
+ * network, as in NewReno (RFC 6582).
+ */
+static void
+microtcp_enter_recovery (microtcp_sock_t *socket)
+{
+  socket->in_recovery = 1;
+  socket->recover = socket->seq_number;
+  socket->cc->on_loss (socket);
+  if (!(socket->opts & MICROTCP_OPT_SACK_PERMITTED)) {
+    socket->cwnd += 3 * MICROTCP_MSS;
+  }
+  socket->rtx_nxt = socket->snd_una;
+  microtcp_mark_holes (socket);
+}
+
+/**
+ * Processes the acknowledgment information of a segment, sliding the send
+ * window, running the loss recovery and taking RTT samples. The
+ * timestamp of the segment is kept for the echo if it does not come from
+ * beyond what we have acknowledged (RFC 7323).
+ */
+static void
+microtcp_process_ack (microtcp_sock_t *socket, const microtcp_header_t *header)
+{
+  const uint32_t words[MICROTCP_MAX_SACK_BLOCKS] =
+    { header->future_use0, header->future_use1, header->future_use2 };
+  size_t nwords = header->control & MICROTCP_TS ?
+      1 : MICROTCP_MAX_SACK_BLOCKS;
+  size_t old_win = socket->peer_win;
+  uint64_t now;
+  uint32_t rtt = 0;
+  uint32_t start;
+  uint32_t end;
+  uint32_t acked;
+  size_t i;
+
+  if ((header->control & MICROTCP_TS)
+      && SEQ_LEQ(header->seq_number, socket->ack_number)) {
+    socket->ts_recent = header->future_use1;
+  }
+  /* The window of a SYN is never scaled (RFC 7323) */
+  socket->peer_win = header->control & MICROTCP_SYN ? header->window
+      : (size_t) header->window << socket->snd_wscale;
+  if (!(header->control & MICROTCP_ACK)) {
+    return;
+  }
+  if (SEQ_GT(header->ack_number, socket->seq_number)
+      && SEQ_GT(header->ack_number, socket->snd_max)) {
+    return;
+  }
+
+  /* Update the scoreboard with the blocks the peer holds out of order */
+  if ((header->control & MICROTCP_SACK)
+      && (socket->opts & MICROTCP_OPT_SACK_PERMITTED)) {
+    for (i = 0; i < nwords; i++) {
+      start = header->ack_number + ((words[i] >> 16) << socket->snd_wscale);
+      end = start + ((words[i] & 0xffff) << socket->snd_wscale);
+      if (start == end || SEQ_LEQ(end, socket->snd_una)
+          || SEQ_GT(end, socket->seq_number)) {
+        continue;
+      }
+      if (SEQ_LT(start, socket->snd_una)) {
+        start = socket->snd_una;
+      }
+      microtcp_blocks_insert (socket->sacked, &socket->sacked_count,
+                              start, end);
+    }
+  }
+
+  if (SEQ_LEQ(header->ack_number, socket->snd_una)) {
+    /* A duplicate ACK, as defined in RFC 5681 */
+    if (header->ack_number == socket->snd_una && header->data_len == 0
+        && !(header->control & (MICROTCP_SYN | MICROTCP_FIN))
+        && socket->peer_win == old_win
+        && socket->seq_number != socket->snd_una) {
+      socket->dupacks++;
+      if (socket->in_recovery) {
+        if (socket->opts & MICROTCP_OPT_SACK_PERMITTED) {
+          microtcp_mark_holes (socket);
+        }
+        else {
+          socket->cwnd += MICROTCP_MSS;
+        }
+      }
+      /* With SACK, 3 segments held by the peer count as 3 duplicates */
+      else if (socket->dupacks >= 3
+          || microtcp_blocks_covered (socket->sacked, socket->sacked_count,
+                                      socket->snd_una, socket->seq_number)
+              >= 3 * MICROTCP_MSS) {
+        microtcp_enter_recovery (socket);
+      }
+    }
+    return;
+  }
+
+  acked = header->ack_number - socket->snd_una;
+  socket->snd_una = header->ack_number;
+  /* The peer already holds what go-back-N was about to resend */
+  if (SEQ_GT(socket->snd_una, socket->seq_number)) {
+    socket->seq_number = socket->snd_una;
+  }
+  microtcp_blocks_trim (socket->sacked, &socket->sacked_count,
+                        socket->snd_una);
+  if (SEQ_LT(socket->rtx_nxt, socket->snd_una)) {
+    socket->rtx_nxt = socket->snd_una;
+  }
+  if (SEQ_LT(socket->rtx_high, socket->snd_una)) {
+    socket->rtx_high = socket->snd_una;
+  }
+
+  /* New data were acknowledged, so the RTO restarts (RFC 6298, 5.3) */
+  now = microtcp_now_us ();
+  if ((header->control & MICROTCP_TS) && header->future_use2) {
+    rtt = (uint32_t) now - header->future_use2;
+  }
+  else if (socket->rtt_timing && SEQ_GT(socket->snd_una, socket->rtt_seq)) {
+    rtt = now - socket->rtt_start;
+  }
+  if (rtt) {
+    microtcp_rtt_sample (socket, rtt);
+  }
+  if (socket->rtt_timing && SEQ_GT(socket->snd_una, socket->rtt_seq)) {
+    socket->rtt_timing = 0;
+  }
+  if (socket->snd_una == socket->seq_number) {
+    microtcp_timer_stop (socket, &socket->rto_timer, MICROTCP_EV_RTO);
+  }
+  else {
+    microtcp_rto_start (socket);
+  }
+
+  socket->dupacks = 0;
+  if (socket->in_recovery) {
+    if (SEQ_GEQ(socket->snd_una, socket->recover)) {
+      socket->in_recovery = 0;
+      socket->cwnd = socket->ssthresh;
+    }
+    else {
+      /* Partial ACK: the segment at snd_una is lost as well */
+      if (!(socket->opts & MICROTCP_OPT_SACK_PERMITTED)) {
+        socket->cwnd -= acked < socket->cwnd ? acked : socket->cwnd;
+        socket->cwnd += MICROTCP_MSS;
+      }
+      microtcp_mark_holes (socket);
+    }
+  }
+  socket->cc->on_ack (socket, acked, rtt);
+}
+
+/**
+ * Processes the payload and the FIN of a segment. Any part of the payload
+ * that falls in the receive window is stored at its final position in the
+ * receive buffer. Out-of-order data are tracked in ooo_blocks until the
+ * holes before them are filled. Every data segment is acknowledged.
+ */
+static void
+microtcp_process_data (microtcp_sock_t *socket, const microtcp_header_t *header,
+                       const uint8_t *payload)
+{
+  uint32_t rcv_nxt = socket->ack_number;
+  uint32_t win_end = rcv_nxt + socket->recvbuf_len - socket->buf_fill_level;
+  uint32_t seq = header->seq_number;
+  uint32_t end = seq + header->data_len;
+  int need_ack = 0;
+  int delay_ack = 0;
+
+  /*
+   * The peer retransmits its fast open SYN until our SYN-ACK gets through.
+   * It has acknowledged nothing yet, so the SYN-ACK is just before snd_una.
+   */
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK)) == MICROTCP_SYN
+      && (socket->opts & MICROTCP_OPT_FASTOPEN)) {
+    microtcp_send_synack (socket, socket->snd_una - 1);
+    return;
+  }
+
+  /*
+   * Old duplicates and window probes get our current state. So does data
+   * outside of the window, and anything out of order right away, as the
+   * sender counts the duplicate ACKs.
+   */
+  if (header->data_len || SEQ_LT(seq, rcv_nxt)) {
+    need_ack = 1;
+  }
+  if (header->data_len) {
+    if (SEQ_LT(seq, rcv_nxt)) {
+      payload += rcv_nxt - seq;
+      seq = rcv_nxt;
+    }
+    if (SEQ_GT(end, win_end)) {
+      end = win_end;
+    }
+  }
+
+  if (header->data_len && SEQ_LT(seq, end)) {
+    /* Unless the checksum verification has already put it there */
+    if (payload != socket->rx_inplace) {
+      microtcp_ring_write (socket, socket->buf_fill_level + (seq - rcv_nxt),
+                           payload, end - seq);
+    }
+    socket->packets_received++;
+    socket->bytes_received += end - seq;
+
+    if (header->seq_number == rcv_nxt && !socket->ooo_count) {
+      /*
+       * Data in order, ACK every second full segment. The sender of the
+       * last segment of a write waits for its ACK, so it goes out at once.
+       */
+      socket->ack_pending += end - seq;
+      if (socket->ack_pending < 2 * MICROTCP_MSS
+          && !(header->control & MICROTCP_PSH)) {
+        need_ack = 0;
+        delay_ack = 1;
+      }
+    }
+    if (seq == rcv_nxt) {
+      /* Deliver the segment and every block it made contiguous */
+      while (socket->ooo_count
+          && SEQ_LEQ(socket->ooo_blocks[0].start, end)) {
+        if (SEQ_GT(socket->ooo_blocks[0].end, end)) {
+          end = socket->ooo_blocks[0].end;
+        }
+        microtcp_blocks_trim (socket->ooo_blocks, &socket->ooo_count,
+                              socket->ooo_blocks[0].end);
+      }
+      socket->buf_fill_level += end - rcv_nxt;
+      socket->ack_number = end;
+    }
+    else if (microtcp_blocks_insert (socket->ooo_blocks, &socket->ooo_count,
+                                     seq, end) == 0) {
+      socket->ooo_recent = seq;
+    }
+  }
+
+  if (header->control & MICROTCP_FIN) {
+    need_ack = 1;
+    if (header->seq_number + header->data_len == (uint32_t) socket->ack_number
+        && (socket->state == ESTABLISHED || socket->state == CLOSING_BY_HOST)) {
+      socket->ack_number++;
+      socket->state = CLOSING_BY_PEER;
+    }
+  }
+
+  /* The peer missed our handshake ACK and retransmitted its SYN-ACK */
+  if ((header->control & MICROTCP_SYN) && (header->control & MICROTCP_ACK)) {
+    need_ack = 1;
+  }
+
+  if (need_ack) {
+    microtcp_send_ack (socket);
+  }
+  else if (delay_ack && !microtcp_timer_armed (&socket->dack_timer)) {
+    microtcp_timer_start (socket, &socket->dack_timer, 0,
+                          MICROTCP_DACK_TIMEOUT_US);
+  }
+}
+
+/**
+ * Builds a socket on top of a UDP socket.
+ *
+ * @param rxq the receive batch of another socket to share, NULL to
+ * allocate one
+ */
+static microtcp_sock_t
+microtcp_socket_from (int sock, struct microtcp_batch *rxq)
 {
   microtcp_sock_t this_sock;
-  int sock;
-  if ((sock = socket ( domain , type , protocol )) == -1) {
-    perror ( " SOCKET COULD NOT BE OPENED " );
-    exit ( EXIT_FAILURE );  
+
+  if (!microtcp_thread_wheel) {
+    microtcp_thread_wheel = malloc (sizeof(microtcp_timer_wheel_t));
+    if (!microtcp_thread_wheel) {
+      perror ("ALLOCATE TIMER WHEEL");
+      exit (EXIT_FAILURE);
+    }
+    microtcp_timer_wheel_init (microtcp_thread_wheel, microtcp_now_us ());
   }
+
+  memset (&this_sock, 0, sizeof(microtcp_sock_t));
   this_sock.sd = sock;
   this_sock.state = CLOSED;
   this_sock.init_win_size = MICROTCP_WIN_SIZE;
   this_sock.curr_win_size = MICROTCP_WIN_SIZE;
   this_sock.recvbuf = malloc(MICROTCP_RECVBUF_LEN);
+  this_sock.recvbuf_len = MICROTCP_RECVBUF_LEN;
+  this_sock.recvbuf_head = 0;
+  this_sock.txq = microtcp_batch_new (MICROTCP_BATCH_LEN,
+                                      sizeof(microtcp_header_t));
+  this_sock.rxq = rxq ? rxq : microtcp_batch_new (MICROTCP_BATCH_LEN,
+                                                  MICROTCP_MAX_SEGMENT);
+  this_sock.cork_buf = malloc (MICROTCP_MSS);
+  this_sock.cork_len = 0;
+  this_sock.cork_seq = 0;
+  this_sock.cork = 0;
+  this_sock.nonblock = 0;
+  this_sock.sndbuf = NULL;
+  this_sock.sndbuf_len = MICROTCP_SNDBUF_LEN;
+  this_sock.snd_end = 0;
+  this_sock.snd_hold = 0;
+  this_sock.closing = 0;
+  this_sock.csum_mode = MICROTCP_CSUM_FULL;
+  if (!this_sock.recvbuf || !this_sock.txq || !this_sock.rxq
+      || !this_sock.cork_buf) {
+    perror ("ALLOCATE SOCKET BUFFERS");
+    exit (EXIT_FAILURE);
+  }
   this_sock.buf_fill_level = 0;
   this_sock.cwnd = MICROTCP_INIT_CWND;
   this_sock.ssthresh = MICROTCP_INIT_SSTHRESH;
+  this_sock.cc = microtcp_cc_get (MICROTCP_CC_RENO);
+  this_sock.cc->init (&this_sock);
+  this_sock.peer_win = MICROTCP_WIN_SIZE;
   this_sock.seq_number = 0;
   this_sock.ack_number = 0;
+  this_sock.snd_una = 0;
+  this_sock.rtx_nxt = 0;
+  this_sock.rtx_high = 0;
+  this_sock.snd_max = 0;
+  this_sock.dupacks = 0;
+  this_sock.in_recovery = 0;
+  this_sock.recover = 0;
+  this_sock.opts = MICROTCP_OPT_SACK_PERMITTED | MICROTCP_OPT_WSCALE
+      | MICROTCP_OPT_TIMESTAMPS;
+  this_sock.rcv_wscale = microtcp_wscale (MICROTCP_RECVBUF_LEN);
+  this_sock.snd_wscale = 0;
+  this_sock.srtt_us = 0;
+  this_sock.rttvar_us = 0;
+  this_sock.rto_us = MICROTCP_ACK_TIMEOUT_US;
+  this_sock.ts_recent = 0;
+  this_sock.rtt_timing = 0;
+  this_sock.wheel = microtcp_thread_wheel;
+  /* The callbacks get the socket when a timer is started */
+  microtcp_timer_init (&this_sock.rto_timer, microtcp_rto_fired, NULL);
+  microtcp_timer_init (&this_sock.dack_timer, microtcp_dack_fired, NULL);
+  this_sock.ack_pending = 0;
+  microtcp_timer_init (&this_sock.fin_timer, microtcp_fin_fired, NULL);
+  microtcp_timer_init (&this_sock.pace_timer, microtcp_pace_fired, NULL);
+  microtcp_timer_init (&this_sock.cork_timer, microtcp_cork_fired, NULL);
+  this_sock.timer_events = 0;
+  this_sock.pacing = MICROTCP_PACING_OFF;
+  this_sock.pace_tokens = 0;
+  this_sock.pace_stamp = 0;
+  this_sock.pace_kernel_rate = 0;
+  this_sock.gso_enabled = 0;
+  this_sock.gro_enabled = 0;
+  this_sock.demux = NULL;
+  this_sock.listener = NULL;
+  this_sock.accept_queue = NULL;
+  this_sock.accept_head = 0;
+  this_sock.accept_count = 0;
+  this_sock.syn_count = 0;
+  this_sock.backlog = 0;
+  this_sock.syn_retries = 0;
+  this_sock.syn_cookies = 0;
+  this_sock.fastopen_cookie = 0;
+  this_sock.poller = NULL;
+  this_sock.poll_events = 0;
+  this_sock.poll_data = NULL;
+  this_sock.poll_prev = NULL;
+  this_sock.poll_next = NULL;
+  this_sock.poll_queued = 0;
+  this_sock.poll_users = 0;
+  this_sock.uring = NULL;
+  this_sock.uring_id = 0;
+  this_sock.send_head = NULL;
+  this_sock.send_tail = NULL;
+  this_sock.recv_head = NULL;
+  this_sock.recv_tail = NULL;
   this_sock.packets_send = 0;
   this_sock.packets_received = 0;
   this_sock.packets_lost = 0;
   this_sock.bytes_received = 0;
   this_sock.bytes_lost = 0;
   this_sock.bytes_send = 0;
+  this_sock.packets_lost_rto = 0;
+  this_sock.bytes_lost_rto = 0;
+  this_sock.packets_lost_dupack = 0;
+  this_sock.bytes_lost_dupack = 0;
   return this_sock;
 
-}
+}
+
+microtcp_sock_t
+microtcp_socket (int domain, int type, int protocol)
+{
+  int sock;
+  /* microTCP always runs on top of UDP, in place of TCP */
+  if ((type != 0 && type != SOCK_STREAM && type != SOCK_DGRAM)
+      || (protocol != 0 && protocol != IPPROTO_TCP
+          && protocol != IPPROTO_UDP)) {
+    errno = EPROTONOSUPPORT;
+    perror ( " SOCKET COULD NOT BE OPENED " );
+    exit ( EXIT_FAILURE );
+  }
+  if ((sock = socket ( domain , SOCK_DGRAM , IPPROTO_UDP )) == -1) {
+    perror ( " SOCKET COULD NOT BE OPENED " );
+    exit ( EXIT_FAILURE );
+  }
+  return microtcp_socket_from (sock, NULL);
+}
+
+int
+microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
+               socklen_t address_len)
+{
+  if ( bind ( socket->sd , address , address_len ) == -1 ) {
+    perror ( " BINDING FAILED " );
+    return -1;
+  }
+  return 0;
+}
+
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int option, const void *value,
+                     socklen_t len)
+{
+  struct microtcp_batch *rxq;
+  uint8_t *recvbuf;
+  size_t size;
+  int gso_size = 0;
+  int on;
+
+  if (len != sizeof(int)) {
+    errno = EINVAL;
+    return -1;
+  }
+  on = *(const int *) value;
+
+  switch (option)
+    {
+    case MICROTCP_SO_RCVBUF:
+      if (socket->state != CLOSED) {
+        errno = EISCONN;
+        return -1;
+      }
+      if (on < MICROTCP_MSS || on > MICROTCP_MAX_RECVBUF_LEN) {
+        errno = EINVAL;
+        return -1;
+      }
+      /* The ring needs a power of two size */
+      for (size = 1; size < (size_t) on; size <<= 1) {
+      }
+      recvbuf = malloc (size);
+      if (!recvbuf) {
+        return -1;
+      }
+      free (socket->recvbuf);
+      socket->recvbuf = recvbuf;
+      socket->recvbuf_len = size;
+      socket->recvbuf_head = 0;
+      socket->rcv_wscale = microtcp_wscale (size);
+      return 0;
+    case MICROTCP_SO_CONGESTION:
+      if (!microtcp_cc_get (on)) {
+        errno = EINVAL;
+        return -1;
+      }
+      socket->cc = microtcp_cc_get (on);
+      socket->cc->init (socket);
+      return 0;
+    case MICROTCP_SO_CHECKSUM:
+      if (socket->state != CLOSED) {
+        errno = EISCONN;
+        return -1;
+      }
+      if (on < MICROTCP_CSUM_FULL || on > MICROTCP_CSUM_NONE) {
+        errno = EINVAL;
+        return -1;
+      }
+      socket->csum_mode = on;
+      return 0;
+    case MICROTCP_SO_CORK:
+      socket->cork = on != 0;
+      return 0;
+    case MICROTCP_SO_NONBLOCK:
+      /* The blocking calls know nothing of the send buffer */
+      if (socket->state != CLOSED && socket->state != LISTEN) {
+        errno = EISCONN;
+        return -1;
+      }
+      socket->nonblock = on != 0;
+      return 0;
+    case MICROTCP_SO_SNDBUF:
+      if (socket->state != CLOSED && socket->state != LISTEN) {
+        errno = EISCONN;
+        return -1;
+      }
+      if (on < MICROTCP_MSS || on > MICROTCP_MAX_SNDBUF_LEN) {
+        errno = EINVAL;
+        return -1;
+      }
+      /* The buffer itself is allocated by the first write */
+      for (size = 1; size < (size_t) on; size <<= 1) {
+      }
+      socket->sndbuf_len = size;
+      return 0;
+    case MICROTCP_SO_REUSEPORT:
+#ifdef SO_REUSEPORT
+      return setsockopt (socket->sd, SOL_SOCKET, SO_REUSEPORT, &on,
+                         sizeof(int));
+#else
+      errno = ENOPROTOOPT;
+      return -1;
+#endif
+    case MICROTCP_SO_SYN_COOKIES:
+      if (socket->state != CLOSED && socket->state != LISTEN) {
+        errno = EISCONN;
+        return -1;
+      }
+      if (on && !socket->syn_cookies
+          && !(socket->opts & MICROTCP_OPT_FASTOPEN)
+          && getrandom (socket->cookie_key, sizeof(socket->cookie_key), 0)
+              != sizeof(socket->cookie_key)) {
+        return -1;
+      }
+      socket->syn_cookies = on != 0;
+      return 0;
+    case MICROTCP_SO_FASTOPEN:
+      if (socket->state != CLOSED && socket->state != LISTEN) {
+        errno = EISCONN;
+        return -1;
+      }
+      /* The cookies of both kinds share the secret */
+      if (on && !socket->syn_cookies
+          && !(socket->opts & MICROTCP_OPT_FASTOPEN)
+          && getrandom (socket->cookie_key, sizeof(socket->cookie_key), 0)
+              != sizeof(socket->cookie_key)) {
+        return -1;
+      }
+      if (on) {
+        socket->opts |= MICROTCP_OPT_FASTOPEN;
+      }
+      else {
+        socket->opts &= ~MICROTCP_OPT_FASTOPEN;
+      }
+      return 0;
+    case MICROTCP_SO_PACING:
+      if (on < MICROTCP_PACING_OFF || on > MICROTCP_PACING_KERNEL) {
+        errno = EINVAL;
+        return -1;
+      }
+      socket->pacing = on;
+      socket->pace_tokens = 0;
+      socket->pace_stamp = microtcp_now_us ();
+      socket->pace_kernel_rate = 0;
+      return 0;
+    case MICROTCP_SO_GSO:
+#ifdef UDP_SEGMENT
+      if (on) {
+        gso_size = MICROTCP_MAX_SEGMENT;
+      }
+      if (setsockopt (socket->sd, SOL_UDP, UDP_SEGMENT, &gso_size,
+                      sizeof(int)) == -1) {
+        socket->gso_enabled = 0;
+        return -1;
+      }
+      socket->gso_enabled = on != 0;
+      return 0;
+#else
+      errno = ENOPROTOOPT;
+      return -1;
+#endif
+    case MICROTCP_SO_GRO:
+#ifdef UDP_GRO
+      /* The receive buffers are resized, so no datagram may be pending */
+      if (socket->state != CLOSED) {
+        errno = EISCONN;
+        return -1;
+      }
+      if (setsockopt (socket->sd, SOL_UDP, UDP_GRO, &on, sizeof(int)) == -1) {
+        return -1;
+      }
+      if (on) {
+        rxq = microtcp_batch_new (MICROTCP_GRO_BATCH_LEN, MICROTCP_GRO_BUF_LEN);
+      }
+      else {
+        rxq = microtcp_batch_new (MICROTCP_BATCH_LEN, MICROTCP_MAX_SEGMENT);
+      }
+      if (!rxq) {
+        return -1;
+      }
+      free (socket->rxq);
+      socket->rxq = rxq;
+      socket->gro_enabled = on != 0;
+      return 0;
+#else
+      errno = ENOPROTOOPT;
+      return -1;
+#endif
+    default:
+      errno = ENOPROTOOPT;
+      return -1;
+    }
+}
+
+/**
+ * @param epoch the MICROTCP_COOKIE_EPOCH_US period the cookie is made in
+ * @param params the low bits of the cookie
+ * @return the SYN cookie for a peer
+ */
+static uint32_t
+microtcp_cookie_make (const microtcp_sock_t *listener,
+                      const struct microtcp_demux_key *peer, uint32_t peer_isn,
+                      uint64_t epoch, uint32_t params)
+{
+  struct
+  {
+    struct microtcp_demux_key peer;
+    uint64_t epoch;
+    uint32_t peer_isn;
+    uint32_t params;
+  } in;
+  uint64_t mac;
+
+  memset (&in, 0, sizeof(in));
+  in.peer = *peer;
+  in.epoch = epoch;
+  in.peer_isn = peer_isn;
+  in.params = params;
+  mac = siphash24 (listener->cookie_key, (const uint8_t *) &in, sizeof(in));
+  return (uint32_t) (mac >> (32 + MICROTCP_COOKIE_MAC_SHIFT))
+      << MICROTCP_COOKIE_MAC_SHIFT
+      | (uint32_t) (epoch & 0x3) << MICROTCP_COOKIE_EPOCH_SHIFT | params;
+}
+
+/**
+ * Answers a SYN with a SYN-ACK whose ISN is a cookie, keeping no state
+ * about the peer. The fields of the listener that describe a connection
+ * only serve to build the segment.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_cookie_reply (microtcp_sock_t *listener,
+                       const microtcp_header_t *header,
+                       const struct sockaddr_storage *from, socklen_t from_len)
+{
+  struct microtcp_batch *txq = listener->txq;
+  struct microtcp_demux_key peer;
+  uint32_t opts = listener->opts;
+  int csum_mode = listener->csum_mode;
+  uint32_t params;
+  uint32_t cookie;
+  int ret;
+
+  if (microtcp_demux_make_key (&peer, (const struct sockaddr *) from,
+                               from_len)) {
+    return 0;
+  }
+  listener->rcv_wscale = microtcp_wscale (listener->recvbuf_len);
+  /* Fast open needs the state that the cookie saves us */
+  listener->opts &= ~MICROTCP_OPT_FASTOPEN;
+  microtcp_negotiate (listener, header->future_use0);
+  params = (listener->opts & MICROTCP_COOKIE_FLAGS)
+      | (uint32_t) listener->snd_wscale << MICROTCP_COOKIE_WSCALE_SHIFT
+      | (uint32_t) listener->csum_mode << MICROTCP_COOKIE_CSUM_SHIFT;
+  cookie = microtcp_cookie_make (listener, &peer, header->seq_number,
+                                 microtcp_now_us () / MICROTCP_COOKIE_EPOCH_US,
+                                 params);
+
+  memcpy (&listener->peer_addr, from, from_len);
+  listener->peer_addr_len = from_len;
+  listener->ack_number = header->seq_number + 1;
+  listener->ts_recent = header->control & MICROTCP_TS ?
+      header->future_use1 : 0;
+  ret = microtcp_send_segment (listener, cookie, MICROTCP_SYN | MICROTCP_ACK,
+                               NULL, 0, 0);
+  if (ret == 0) {
+    /* The next SYN reuses peer_addr before the batch goes out */
+    memcpy (&txq->addrs[txq->count - 1], from, from_len);
+    txq->msgs[txq->count - 1].msg_hdr.msg_name = &txq->addrs[txq->count - 1];
+  }
+  listener->opts = opts;
+  listener->csum_mode = csum_mode;
+  return ret;
+}
+
+/**
+ * Checks whether a segment of an unknown peer completes a handshake that
+ * a cookie answered, in the current epoch or the one before.
+ *
+ * @param params set to the low bits of the cookie
+ * @return 0 if it does, -1 otherwise
+ */
+static int
+microtcp_cookie_check (const microtcp_sock_t *listener,
+                       const microtcp_header_t *header,
+                       const struct sockaddr_storage *from, socklen_t from_len,
+                       uint32_t *params)
+{
+  struct microtcp_demux_key peer;
+  uint32_t cookie = header->ack_number - 1;
+  uint64_t epoch = microtcp_now_us () / MICROTCP_COOKIE_EPOCH_US;
+
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK)) != MICROTCP_ACK
+      || microtcp_demux_make_key (&peer, (const struct sockaddr *) from,
+                                  from_len)) {
+    return -1;
+  }
+  if (((cookie >> MICROTCP_COOKIE_EPOCH_SHIFT) & 0x3) != (epoch & 0x3)) {
+    epoch--;
+  }
+  *params = cookie & ((1 << MICROTCP_COOKIE_EPOCH_SHIFT) - 1);
+  if (((cookie >> MICROTCP_COOKIE_EPOCH_SHIFT) & 0x3) != (epoch & 0x3)
+      || microtcp_cookie_make (listener, &peer, header->seq_number - 1, epoch,
+                               *params) != cookie) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @return the fast open cookie of a peer, which holds for any of its ports
+ */
+static uint64_t
+microtcp_fastopen_make (const microtcp_sock_t *socket,
+                        const struct sockaddr_storage *from,
+                        socklen_t from_len)
+{
+  struct microtcp_demux_key peer;
+
+  if (microtcp_demux_make_key (&peer, (const struct sockaddr *) from,
+                               from_len)) {
+    return 0;
+  }
+  peer.port = 0;
+  return siphash24 (socket->cookie_key, (const uint8_t *) &peer,
+                    sizeof(peer));
+}
+
+/**
+ * Looks up the fast open cookie of the peer of the socket in the cache of
+ * the thread.
+ *
+ * @return 0 if the socket now has it, -1 if there is none
+ */
+static int
+microtcp_fastopen_lookup (microtcp_sock_t *socket)
+{
+  struct microtcp_demux_key server;
+  size_t i;
+
+  if (microtcp_demux_make_key (&server,
+                               (const struct sockaddr *) &socket->peer_addr,
+                               socket->peer_addr_len)) {
+    return -1;
+  }
+  for (i = 0; i < MICROTCP_FASTOPEN_CACHE_LEN; i++) {
+    if (memcmp (&microtcp_fastopen_cache[i].server, &server,
+                sizeof(server)) == 0) {
+      socket->fastopen_cookie = microtcp_fastopen_cache[i].cookie;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Remembers the cookie that the SYN-ACK of the peer may carry.
+ */
+static void
+microtcp_fastopen_learn (microtcp_sock_t *socket, const uint8_t *pkt)
+{
+  const microtcp_header_t *header = (const microtcp_header_t *) pkt;
+  struct microtcp_demux_key server;
+  size_t i;
+
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK))
+      != (MICROTCP_SYN | MICROTCP_ACK)
+      || !(socket->opts & header->future_use0 & MICROTCP_OPT_FASTOPEN)
+      || header->data_len != MICROTCP_FASTOPEN_COOKIE_LEN
+      || microtcp_demux_make_key (&server,
+                                  (const struct sockaddr *) &socket->peer_addr,
+                                  socket->peer_addr_len)) {
+    return;
+  }
+  for (i = 0; i < MICROTCP_FASTOPEN_CACHE_LEN; i++) {
+    if (memcmp (&microtcp_fastopen_cache[i].server, &server,
+                sizeof(server)) == 0) {
+      break;
+    }
+  }
+  if (i == MICROTCP_FASTOPEN_CACHE_LEN) {
+    i = microtcp_fastopen_next++ % MICROTCP_FASTOPEN_CACHE_LEN;
+    microtcp_fastopen_cache[i].server = server;
+  }
+  memcpy (&microtcp_fastopen_cache[i].cookie,
+          pkt + sizeof(microtcp_header_t), MICROTCP_FASTOPEN_COOKIE_LEN);
+}
+
+/**
+ * Prepares a connection to share the UDP socket of a listener, with the
+ * options set on the listener.
+ */
+static void
+microtcp_conn_init (microtcp_sock_t *listener, microtcp_sock_t *conn)
+{
+  int size = listener->recvbuf_len;
+
+  *conn = microtcp_socket_from (listener->sd, listener->rxq);
+  conn->listener = listener;
+  conn->opts = listener->opts;
+  conn->csum_mode = listener->csum_mode;
+  conn->cork = listener->cork;
+  conn->nonblock = listener->nonblock;
+  conn->sndbuf_len = listener->sndbuf_len;
+  conn->gso_enabled = listener->gso_enabled;
+  conn->gro_enabled = listener->gro_enabled;
+  conn->cc = listener->cc;
+  conn->cc->init (conn);
+  memcpy (conn->cookie_key, listener->cookie_key, sizeof(conn->cookie_key));
+  microtcp_setsockopt (conn, MICROTCP_SO_PACING, &listener->pacing,
+                       sizeof(int));
+  if (listener->recvbuf_len != conn->recvbuf_len) {
+    microtcp_setsockopt (conn, MICROTCP_SO_RCVBUF, &size, sizeof(int));
+  }
+}
+
+/**
+ * Takes the state of a connection from the SYN of the peer.
+ */
+static void
+microtcp_passive_open (microtcp_sock_t *socket,
+                       const microtcp_header_t *header,
+                       const struct sockaddr_storage *from, socklen_t from_len)
+{
+  memcpy (&socket->peer_addr, from, from_len);
+  socket->peer_addr_len = from_len;
+  socket->state = HANDSHAKE;
+  socket->seq_number = rand();                 // make the state up to date
+  socket->ack_number = header->seq_number + 1;
+  socket->init_win_size = header->window;
+  socket->peer_win = header->window;
+  socket->rcv_wscale = microtcp_wscale (socket->recvbuf_len);
+  microtcp_negotiate (socket, header->future_use0);
+  microtcp_init_ssthresh (socket);
+  socket->ts_recent = header->control & MICROTCP_TS ?
+      header->future_use1 : 0;
+  socket->srtt_us = 0;
+  socket->rto_us = MICROTCP_ACK_TIMEOUT_US;
+  if (socket->opts & MICROTCP_OPT_FASTOPEN) {
+    socket->fastopen_cookie = microtcp_fastopen_make (socket, from, from_len);
+  }
+}
+
+/**
+ * @return whether the SYN the connection was opened with carries data and
+ * the valid fast open cookie of the peer
+ */
+static int
+microtcp_fastopen_ok (const microtcp_sock_t *socket, const uint8_t *pkt)
+{
+  const microtcp_header_t *header = (const microtcp_header_t *) pkt;
+
+  return (socket->opts & MICROTCP_OPT_FASTOPEN)
+      && header->data_len > MICROTCP_FASTOPEN_COOKIE_LEN
+      && memcmp (pkt + sizeof(microtcp_header_t), &socket->fastopen_cookie,
+                 MICROTCP_FASTOPEN_COOKIE_LEN) == 0;
+}
+
+/**
+ * Takes the data of a fast open SYN and establishes the connection before
+ * the peer acknowledges our SYN-ACK, so the reply may go out right after
+ * it. What does not fit in the receive buffer is left unacknowledged for
+ * the peer to retransmit. The caller sends the SYN-ACK, just before
+ * snd_una.
+ */
+static void
+microtcp_fastopen_established (microtcp_sock_t *socket, const uint8_t *pkt)
+{
+  const microtcp_header_t *header = (const microtcp_header_t *) pkt;
+  size_t len = header->data_len - MICROTCP_FASTOPEN_COOKIE_LEN;
+
+  if (len > socket->recvbuf_len - socket->buf_fill_level) {
+    len = socket->recvbuf_len - socket->buf_fill_level;
+  }
+
+  microtcp_ring_write (socket, socket->buf_fill_level,
+                       pkt + sizeof(microtcp_header_t)
+                           + MICROTCP_FASTOPEN_COOKIE_LEN, len);
+  socket->buf_fill_level += len;
+  socket->ack_number += len;
+  socket->packets_received++;
+  socket->bytes_received += len;
+
+  socket->seq_number++;
+  socket->snd_una = socket->seq_number;
+  socket->rtx_nxt = socket->rtx_high = socket->snd_una;
+  socket->snd_max = socket->snd_una;
+  socket->state = ESTABLISHED;
+  socket->cc->init (socket);
+}
+
+/**
+ * Completes the handshake with the segment that acknowledged our SYN-ACK,
+ * which may carry data as well.
+ *
+ * @param sent when the first copy of our SYN-ACK was sent
+ * @param retries the retransmissions of the SYN-ACK
+ */
+static void
+microtcp_passive_established (microtcp_sock_t *socket, uint8_t *pkt,
+                              uint64_t sent, int retries)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+
+  socket->seq_number++;
+  socket->snd_una = socket->seq_number;
+  socket->rtx_nxt = socket->rtx_high = socket->snd_una;
+  socket->snd_max = socket->snd_una;
+  socket->state = ESTABLISHED;
+  microtcp_handshake_rtt (socket, header, sent, retries);
+  socket->cc->init (socket);
+  microtcp_process_ack (socket, header);
+  microtcp_process_data (socket, header, pkt + sizeof(microtcp_header_t));
+}
+
+/**
+ * Sets up a connection from a segment that returned a valid cookie, see
+ * microtcp_cookie_check().
+ */
+static void
+microtcp_cookie_established (microtcp_sock_t *socket, uint8_t *pkt,
+                             const struct sockaddr_storage *from,
+                             socklen_t from_len, uint32_t params)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+
+  memcpy (&socket->peer_addr, from, from_len);
+  socket->peer_addr_len = from_len;
+  socket->opts = params & MICROTCP_COOKIE_FLAGS;
+  socket->snd_wscale = (params >> MICROTCP_COOKIE_WSCALE_SHIFT) & 0xf;
+  socket->rcv_wscale = socket->opts & MICROTCP_OPT_WSCALE ?
+      microtcp_wscale (socket->recvbuf_len) : 0;
+  socket->csum_mode = (params >> MICROTCP_COOKIE_CSUM_SHIFT) & 0x3;
+  socket->seq_number = header->ack_number - 1;
+  socket->ack_number = header->seq_number;
+  socket->init_win_size = (size_t) header->window << socket->snd_wscale;
+  socket->peer_win = socket->init_win_size;
+  socket->ts_recent = header->control & MICROTCP_TS ?
+      header->future_use1 : 0;
+  socket->srtt_us = 0;
+  socket->rto_us = MICROTCP_ACK_TIMEOUT_US;
+  microtcp_init_ssthresh (socket);
+  /* Only an echoed timestamp tells when the SYN-ACK left */
+  microtcp_passive_established (socket, pkt, 0, 1);
+}
+
+/**
+ * Frees a connection that the listener allocated and nobody accepted.
+ */
+static void
+microtcp_conn_free (microtcp_sock_t *conn)
+{
+  microtcp_timer_cancel (conn->wheel, &conn->rto_timer);
+  microtcp_timer_cancel (conn->wheel, &conn->dack_timer);
+  microtcp_timer_cancel (conn->wheel, &conn->fin_timer);
+  microtcp_timer_cancel (conn->wheel, &conn->pace_timer);
+  microtcp_timer_cancel (conn->wheel, &conn->cork_timer);
+  free (conn->recvbuf);
+  free (conn->txq);
+  free (conn->cork_buf);
+  free (conn->sndbuf);
+  free (conn);
+}
+
+/**
+ * Retransmits the SYN-ACK of a connection in the SYN queue, or gives up on
+ * it. Nobody waits on such a connection, so the timer acts on its own.
+ */
+static void
+microtcp_synack_fired (microtcp_timer_t *timer, void *arg)
+{
+  microtcp_sock_t *conn = arg;
+  microtcp_sock_t *listener = conn->listener;
+
+  if (++conn->syn_retries == MICROTCP_MAX_RETRIES
+      || microtcp_send_synack (conn, conn->seq_number)
+      || microtcp_flush (conn)) {
+    microtcp_demux_remove (listener->demux,
+                           (struct sockaddr *) &conn->peer_addr,
+                           conn->peer_addr_len);
+    listener->syn_count--;
+    microtcp_conn_free (conn);
+    return;
+  }
+  microtcp_rto_backoff (conn);
+  microtcp_rto_start (conn);
+}
+
+static void
+microtcp_accept_enqueue (microtcp_sock_t *listener, microtcp_sock_t *conn)
+{
+  listener->accept_queue[(listener->accept_head + listener->accept_count)
+      % listener->backlog] = conn;
+  listener->accept_count++;
+  microtcp_poller_touch (listener);
+}
+
+/**
+ * Handles a segment of a peer without a connection on a listener: a SYN
+ * starts a handshake, or gets a cookie, and a returned cookie sets up a
+ * connection. So does a fast open SYN right away.
+ */
+static void
+microtcp_listen_input (microtcp_sock_t *listener, uint8_t *pkt,
+                       const struct sockaddr_storage *from, socklen_t from_len)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+  microtcp_sock_t *conn;
+  uint32_t params;
+  int syn = (header->control & (MICROTCP_SYN | MICROTCP_ACK)) == MICROTCP_SYN;
+
+  if (syn && listener->syn_cookies) {
+    microtcp_cookie_reply (listener, header, from, from_len);
+    return;
+  }
+  if (syn ? listener->syn_count == listener->backlog :
+      !listener->syn_cookies || listener->accept_count == listener->backlog
+      || microtcp_cookie_check (listener, header, from, from_len, &params)) {
+    return;
+  }
+
+  conn = malloc (sizeof(microtcp_sock_t));
+  if (!conn) {
+    return;
+  }
+  microtcp_conn_init (listener, conn);
+  if (microtcp_demux_insert (listener->demux, (struct sockaddr *) from,
+                             from_len, conn)) {
+    microtcp_conn_free (conn);
+    return;
+  }
+  if (!syn) {
+    microtcp_cookie_established (conn, pkt, from, from_len, params);
+    microtcp_flush (conn);
+    microtcp_accept_enqueue (listener, conn);
+    return;
+  }
+
+  microtcp_passive_open (conn, header, from, from_len);
+  if (microtcp_fastopen_ok (conn, pkt)
+      && listener->accept_count < listener->backlog) {
+    microtcp_fastopen_established (conn, pkt);
+    if (microtcp_send_synack (conn, conn->snd_una - 1)
+        || microtcp_flush (conn)) {
+      microtcp_demux_remove (listener->demux, (struct sockaddr *) from,
+                             from_len);
+      microtcp_conn_free (conn);
+      return;
+    }
+    microtcp_accept_enqueue (listener, conn);
+    return;
+  }
+  microtcp_timer_init (&conn->rto_timer, microtcp_synack_fired, NULL);
+  conn->syn_retries = 0;
+  /* Nothing else is timed during the handshake */
+  conn->rtt_start = microtcp_now_us ();
+  listener->syn_count++;
+  if (microtcp_send_synack (conn, conn->seq_number)
+      || microtcp_flush (conn)) {
+    microtcp_demux_remove (listener->demux, (struct sockaddr *) from,
+                           from_len);
+    listener->syn_count--;
+    microtcp_conn_free (conn);
+    return;
+  }
+  microtcp_rto_start (conn);
+}
+
+/**
+ * Handles a segment of a peer whose connection is in the SYN queue. The
+ * connection moves to the accept queue once the peer acknowledges our
+ * SYN-ACK, unless the accept queue is full.
+ */
+static void
+microtcp_handshake_input (microtcp_sock_t *conn, uint8_t *pkt)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+  microtcp_sock_t *listener = conn->listener;
+
+  /* Our SYN-ACK was lost */
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK)) == MICROTCP_SYN) {
+    if (microtcp_send_synack (conn, conn->seq_number) == 0) {
+      microtcp_flush (conn);
+    }
+    return;
+  }
+  if (!(header->control & MICROTCP_ACK) || (header->control & MICROTCP_SYN)
+      || header->ack_number != conn->seq_number + 1
+      || listener->accept_count == listener->backlog) {
+    return;
+  }
+
+  microtcp_timer_cancel (conn->wheel, &conn->rto_timer);
+  microtcp_timer_init (&conn->rto_timer, microtcp_rto_fired, NULL);
+  listener->syn_count--;
+  microtcp_passive_established (conn, pkt, conn->rtt_start, conn->syn_retries);
+  microtcp_flush (conn);
+  microtcp_accept_enqueue (listener, conn);
+}
+
+/**
+ * Handles a segment for a non-blocking socket whose connect is under way:
+ * the SYN-ACK of the peer establishes it. It may acknowledge the start of
+ * the send buffer as well, which a fast open SYN carried.
+ */
+static void
+microtcp_connect_input (microtcp_sock_t *socket, uint8_t *pkt)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+  uint32_t syn_end = socket->sndbuf ?
+      socket->snd_end : (uint32_t) socket->seq_number + 1;
+
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK))
+      != (MICROTCP_SYN | MICROTCP_ACK)
+      || SEQ_LEQ(header->ack_number, socket->seq_number)
+      || SEQ_GT(header->ack_number, syn_end)) {
+    return;
+  }
+  microtcp_fastopen_learn (socket, pkt);
+  microtcp_timer_stop (socket, &socket->rto_timer, MICROTCP_EV_RTO);
+  microtcp_active_established (socket, header, socket->rtt_start,
+                               socket->syn_retries);
+  /* The rest of the send buffer */
+  if (socket->sndbuf) {
+    microtcp_output (socket);
+    return;
+  }
+  microtcp_poller_touch (socket);
+}
+
+/**
+ * Processes a segment that arrived for another socket of the same UDP
+ * socket than the one waiting for input. Segments for a listener that is
+ * not listening or for a connection that is closed are dropped.
+ */
+static void
+microtcp_deliver (microtcp_sock_t *owner, uint8_t *pkt,
+                  const struct sockaddr_storage *from, socklen_t from_len)
+{
+  if (owner->accept_queue) {
+    microtcp_listen_input (owner, pkt, from, from_len);
+    return;
+  }
+  if (owner->state == HANDSHAKE && owner->listener) {
+    microtcp_handshake_input (owner, pkt);
+    return;
+  }
+  if (owner->state == HANDSHAKE && owner->nonblock) {
+    microtcp_connect_input (owner, pkt);
+    return;
+  }
+  if (owner->state != ESTABLISHED && owner->state != CLOSING_BY_PEER
+      && owner->state != CLOSING_BY_HOST) {
+    return;
+  }
+  microtcp_process_ack (owner, (microtcp_header_t *) pkt);
+  microtcp_process_data (owner, (microtcp_header_t *) pkt,
+                         pkt + sizeof(microtcp_header_t));
+  /* The ACK may have made room for more of the send buffer */
+  if (owner->nonblock) {
+    microtcp_output (owner);
+    return;
+  }
+  microtcp_flush (owner);
+  microtcp_poller_touch (owner);
+}
+
+int
+microtcp_drain (microtcp_sock_t *socket)
+{
+  uint8_t *pkt;
+  struct sockaddr_storage *from;
+  socklen_t from_len;
+  microtcp_sock_t *owner;
+
+  while (microtcp_recv_segment (socket, &pkt, &from, &from_len, &owner, 1)
+      > 0) {
+    /* Only a listener takes segments from peers it does not know */
+    if (owner == socket && !socket->demux
+        && (from_len != socket->peer_addr_len
+            || !microtcp_same_peer (from, &socket->peer_addr, from_len))) {
+      continue;
+    }
+    microtcp_deliver (owner, pkt, from, from_len);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK) {
+    return -1;
+  }
+  return microtcp_flush (socket);
+}
+
+/**
+ * Waits for a segment of the peer and processes it.
+ *
+ * @param header if not NULL, the header of the processed segment is
+ * stored here
+ * @return 1 if a segment was processed, 0 if a timer of the socket fired,
+ * -1 on error
+ */
+static int
+microtcp_wait_input (microtcp_sock_t *socket, microtcp_header_t *header)
+{
+  uint8_t *pkt;
+  struct sockaddr_storage *from;
+  socklen_t from_len;
+  microtcp_sock_t *owner;
+  ssize_t ret;
+
+  while (1) {
+    ret = microtcp_recv_segment (socket, &pkt, &from, &from_len, &owner, 0);
+    if (ret <= 0) {
+      return ret;
+    }
+    if (owner != socket) {
+      microtcp_deliver (owner, pkt, from, from_len);
+    }
+    else if (from_len == socket->peer_addr_len
+        && microtcp_same_peer (from, &socket->peer_addr, from_len)) {
+      break;
+    }
+  }
+
+  if (header) {
+    memcpy (header, pkt, sizeof(microtcp_header_t));
+  }
+  /* During the handshake the caller inspects the segment on its own */
+  if (socket->state == HANDSHAKE) {
+    microtcp_fastopen_learn (socket, pkt);
+    return 1;
+  }
+  microtcp_process_ack (socket, (microtcp_header_t *) pkt);
+  microtcp_process_data (socket, (microtcp_header_t *) pkt,
+                         pkt + sizeof(microtcp_header_t));
+  return 1;
+}
+
+/**
+ * The 3-way handshake of microtcp_connect(). With fast open data, the SYN
+ * carries the cookie of the peer and as much of the data as fits, or
+ * only asks for a cookie if we have none. Its retransmissions carry
+ * nothing, the data goes after the handshake then.
+ *
+ * @param isn our initial sequence number
+ * @param iov the data, which starts at isn + 1, NULL for none
+ * @return the number of bytes of the data that the SYN-ACK acknowledged,
+ * or -1 on failure. A non-blocking socket returns -1 with errno
+ * EINPROGRESS once the SYN is sent.
+ */
+static ssize_t
+microtcp_active_open (microtcp_sock_t *socket, const struct sockaddr *address,
+                      socklen_t address_len, uint32_t isn,
+                      const struct iovec *iov, int iovcnt, size_t length)
+{
+  microtcp_header_t recv_header;
+  struct microtcp_source src;
+  struct iovec syn[MICROTCP_SEG_IOV_LEN - 1];
+  size_t syn_len = 0;
+  size_t payload_len = 0;
+  uint64_t sent = 0;
+  int cnt = 0;
+  int retries;
+  int ret;
+
+  if(socket->state != CLOSED) {
+    return -1; //socket already used
+  }
+  if (address_len > sizeof(struct sockaddr_storage)) {
+    return -1;
+  }
+  memset (&socket->peer_addr, 0, sizeof(struct sockaddr_storage));
+  memcpy (&socket->peer_addr, address, address_len);
+  socket->peer_addr_len = address_len;
+
+  socket->seq_number = isn;
+  socket->ack_number = 0;
+  socket->state = HANDSHAKE;
+
+  if (iov) {
+    socket->opts |= MICROTCP_OPT_FASTOPEN;
+  }
+  if (iov && microtcp_fastopen_lookup (socket) == 0) {
+    src.iov = iov;
+    src.iovcnt = iovcnt;
+    src.length = length;
+    src.base = isn + 1;
+    src.hold = 0;
+    syn[0].iov_base = &socket->fastopen_cookie;
+    syn[0].iov_len = MICROTCP_FASTOPEN_COOKIE_LEN;
+    syn_len = MICROTCP_MSS - MICROTCP_FASTOPEN_COOKIE_LEN;
+    if (syn_len > length) {
+      syn_len = length;
+    }
+    syn_len = microtcp_source_slice (&src, 0, syn_len, &syn[1],
+                                     MICROTCP_SEG_IOV_LEN - 2, &cnt);
+    payload_len = MICROTCP_FASTOPEN_COOKIE_LEN + syn_len;
+    cnt++;
+  }
+
+  if (socket->nonblock) {
+    /* The SYN-ACK completes the handshake in microtcp_deliver() */
+    socket->rtt_start = microtcp_now_us ();
+    socket->syn_retries = 0;
+    if (microtcp_send_segment (socket, isn, MICROTCP_SYN, syn, cnt,
+                               payload_len)
+        || microtcp_flush (socket)) {
+      socket->state = CLOSED;
+      return -1;
+    }
+    microtcp_rto_start (socket);
+    errno = EINPROGRESS;
+    return -1;
+  }
 
-int
-microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
-               socklen_t address_len)
-{
-  if ( bind ( socket->sd , address , address_len ) == -1 ) {
-    perror ( " BINDING FAILED " );
-    exit ( EXIT_FAILURE );
+  for (retries = 0; retries < MICROTCP_MAX_RETRIES; retries++) {
+    if (retries == 0) {
+      sent = microtcp_now_us ();
+      ret = microtcp_send_segment (socket, isn, MICROTCP_SYN, syn, cnt,
+                                   payload_len);
+    }
+    else {
+      ret = microtcp_send_segment (socket, isn, MICROTCP_SYN, NULL, 0, 0);
+    }
+    if (ret) {
+      ret = -1;
+      break;
+    }
+    microtcp_rto_start (socket);
+
+    /* Wait for the SYN-ACK, retransmitting the SYN on timeout */
+    while ((ret = microtcp_wait_input (socket, &recv_header)) > 0) {
+      if ((recv_header.control & (MICROTCP_SYN | MICROTCP_ACK))
+          == (MICROTCP_SYN | MICROTCP_ACK)
+          && SEQ_GT(recv_header.ack_number, isn)
+          && SEQ_LEQ(recv_header.ack_number, isn + 1 + syn_len)) {
+        break;
+      }
+    }
+    if (ret != 0) {
+      break;
+    }
+    microtcp_rto_backoff (socket);
+  }
+  microtcp_timer_stop (socket, &socket->rto_timer, MICROTCP_EV_RTO);
+  if (ret < 0 || retries == MICROTCP_MAX_RETRIES) {
+    socket->state = CLOSED;
+    return -1;
+  }
+  if (microtcp_active_established (socket, &recv_header, sent, retries)) {
+    return -1;
   }
+  return (uint32_t) (socket->seq_number - (isn + 1));
 }
 
 int
@@ -68,289 +3081,837 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
                   socklen_t address_len) //called by client, given the client's socket, and the destination
                   //(server) address (IP + port)
 {
-  if(socket->state != CLOSED) {
-    return -1; //socket already used
+  return microtcp_active_open (socket, address, address_len, rand (), NULL, 0,
+                               0) == -1 ? -1 : 0;
+}
+
+/**
+ * Like microtcp_accept_on(), but SYNs are answered with cookies and the
+ * socket is only set up when a valid cookie comes back.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_accept_cookie (microtcp_sock_t *socket, struct sockaddr *address,
+                        socklen_t address_len)
+{
+  microtcp_sock_t *owner;
+  uint8_t *pkt;
+  microtcp_header_t *headerReceived;
+  struct sockaddr_storage *from;
+  socklen_t from_len;
+  ssize_t bytesReceived;
+  uint32_t params = 0;
+
+  while (1) {
+    bytesReceived = microtcp_recv_segment (socket, &pkt, &from, &from_len,
+                                           &owner, 0);
+    if (bytesReceived == -1) {
+      return -1;
+    }
+    if (bytesReceived == 0) {
+      socket->timer_events = 0;
+      continue;
+    }
+    headerReceived = (microtcp_header_t *) pkt;
+    if ((headerReceived->control & (MICROTCP_SYN | MICROTCP_ACK))
+        == MICROTCP_SYN) {
+      if (microtcp_cookie_reply (socket, headerReceived, from, from_len)) {
+        return -1;
+      }
+      continue;
+    }
+    if (microtcp_cookie_check (socket, headerReceived, from, from_len,
+                               &params) == 0) {
+      break;
+    }
   }
-  uint32_t my_seq = rand();
-  socket->seq_number = my_seq;
 
-  microtcp_header_t header;
-  memset(&header, 0, sizeof(header));
+  microtcp_cookie_established (socket, pkt, from, from_len, params);
+  if (address) {
+    memcpy (address, &socket->peer_addr,
+            address_len < socket->peer_addr_len ?
+                address_len : socket->peer_addr_len);
+  }
+  return microtcp_flush (socket);
+}
+
+/**
+ * Waits for a SYN and completes the handshake on the socket itself.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_accept_on (microtcp_sock_t *socket, struct sockaddr *address,
+                    socklen_t address_len)
+{
+  microtcp_sock_t *owner;
+  uint8_t *pkt;
+  microtcp_header_t *headerReceived;
+  struct sockaddr_storage *from;
+  socklen_t from_len;
+  ssize_t bytesReceived;
+  uint32_t offered = socket->opts;
+  uint64_t sent = 0;
+  int retries;
 
-  header.seq_num = my_seq;
-  header.ack_num = 0;
-  header.data_len = 0;
-  header.window = MICROTCP_WIN_SIZE; 
+  while (1) {                           // wait for incoming SYN
+    bytesReceived = microtcp_recv_segment (socket, &pkt, &from, &from_len,
+                                           &owner, 0);
+    if (bytesReceived == -1) {
+      return -1;
+    }
+    if (bytesReceived == 0) {           // no timer is ours to handle here
+      socket->timer_events = 0;
+      continue;
+    }
+    headerReceived = (microtcp_header_t *) pkt;
+    if ((headerReceived->control & (MICROTCP_SYN | MICROTCP_ACK))
+        != MICROTCP_SYN) {
+      continue;
+    }
 
-  // Setting syn=1, Bit 14
-  header.control = (1 << 14 );
+    socket->opts = offered;
+    microtcp_passive_open (socket, headerReceived, from, from_len);
+    if (microtcp_fastopen_ok (socket, pkt)) {
+      microtcp_fastopen_established (socket, pkt);
+      if (microtcp_send_synack (socket, socket->snd_una - 1)) {
+        socket->state = CLOSED;
+        return -1;
+      }
+      break;
+    }
 
-  // Calculate checksum on the raw bytes as they sit in memory
-  header.checksum = crc32((const uint8_t *)&header, sizeof(header));
+    for (retries = 0; retries < MICROTCP_MAX_RETRIES; retries++) {
+      if (retries == 0) {
+        sent = microtcp_now_us ();
+      }
+      if (microtcp_send_synack (socket, socket->seq_number)) {
+        microtcp_timer_stop (socket, &socket->rto_timer, MICROTCP_EV_RTO);
+        socket->state = CLOSED;
+        return -1;
+      }
+      microtcp_rto_start (socket);
+      /*
+       * Wait for the ACK that completes the handshake. Data segments from
+       * a client whose ACK was lost complete the handshake as well. A
+       * retransmitted SYN means that our SYN-ACK was lost.
+       */
+      while ((bytesReceived = microtcp_recv_segment (socket, &pkt, &from,
+                                                     &from_len, &owner, 0))
+          > 0
+          && (from_len != socket->peer_addr_len
+              || !microtcp_same_peer (from, &socket->peer_addr, from_len))) {
+      }
+      if (bytesReceived <= 0) {
+        microtcp_rto_backoff (socket);
+        continue;
+      }
+      headerReceived = (microtcp_header_t *) pkt;
+      if ((headerReceived->control & MICROTCP_ACK)
+          && !(headerReceived->control & MICROTCP_SYN)
+          && headerReceived->ack_number == socket->seq_number + 1) {
+        break;
+      }
+    }
+    microtcp_timer_stop (socket, &socket->rto_timer, MICROTCP_EV_RTO);
+    if (retries == MICROTCP_MAX_RETRIES) {
+      socket->state = CLOSED;
+      continue;
+    }
+    microtcp_passive_established (socket, pkt, sent, retries);
+    break;
+  }
 
-  ssize_t bytes_sent = sendto(socket->sd, &header, sizeof(header), 0, address, address_len);
+  if (address) {
+    memcpy (address, &socket->peer_addr,
+            address_len < socket->peer_addr_len ?
+                address_len : socket->peer_addr_len);
+  }
+  return microtcp_flush (socket);
+}
 
-  if (bytes_sent == -1) {
-      return -1;
+int
+microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
+                 socklen_t address_len)
+{
+  int ret;
+
+  if (socket->state != CLOSED) {
+    return -1;
+  }
+  if (!socket->syn_cookies) {
+    return microtcp_accept_on (socket, address, address_len);
+  }
+  /* Tells microtcp_checksum_ok() to look for cookies */
+  socket->state = LISTEN;
+  ret = microtcp_accept_cookie (socket, address, address_len);
+  if (socket->state == LISTEN) {
+    socket->state = CLOSED;
+  }
+  return ret;
+}
+
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog)
+{
+  if (socket->state != CLOSED) {
+    errno = EISCONN;
+    return -1;
   }
+  if (backlog < 1) {
+    backlog = 1;
+  }
+  if (backlog > MICROTCP_MAX_BACKLOG) {
+    backlog = MICROTCP_MAX_BACKLOG;
+  }
+  socket->demux = malloc (sizeof(microtcp_demux_t));
+  socket->accept_queue = malloc (backlog * sizeof(microtcp_sock_t *));
+  if (!socket->demux || !socket->accept_queue
+      || microtcp_demux_init (socket->demux, 2 * backlog)) {
+    perror ("ALLOCATE LISTEN QUEUES");
+    free (socket->demux);
+    free (socket->accept_queue);
+    socket->demux = NULL;
+    socket->accept_queue = NULL;
+    return -1;
+  }
+  socket->backlog = backlog;
+  socket->accept_head = 0;
+  socket->accept_count = 0;
+  socket->syn_count = 0;
+  socket->state = LISTEN;
+  return 0;
+}
 
-  socket->state = SYN_SENT;
+/**
+ * Moves an armed timer to another socket, or just sets it up there.
+ */
+static void
+microtcp_timer_move (microtcp_sock_t *dst, microtcp_timer_t *to,
+                     microtcp_timer_t *from)
+{
+  uint64_t expires = from->expires;
+  int armed = microtcp_timer_armed (from);
 
-  microtcp_header_t recv_header;
-  struct sockaddr_in sender_addr;
-  socklen_t sender_len = sizeof(sender_addr);
+  microtcp_timer_cancel (dst->wheel, from);
+  microtcp_timer_init (to, from->cb, dst);
+  if (armed) {
+    microtcp_timer_arm (dst->wheel, to, expires * MICROTCP_TIMER_TICK_US);
+  }
+}
 
-  while (1) {
-      ssize_t bytes = recvfrom(socket->sd, &recv_header, sizeof(recv_header), 0,
-      (struct sockaddr *)&sender_addr, &sender_len);
+int
+microtcp_accept_conn (microtcp_sock_t *listener, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len)
+{
+  microtcp_sock_t *owner;
+  microtcp_sock_t *queued;
+  uint8_t *pkt;
+  struct sockaddr_storage *from;
+  socklen_t from_len;
+  ssize_t ret;
 
-      if (bytes < sizeof(microtcp_header_t)) continue;
-      uint32_t received_csum = recv_header.checksum;
-      recv_header.checksum = 0; // we have to make the check sum field zero, before comparing
-      //since it was zeroed out before checksum was added to the header.
-      if (crc32((const uint8_t *)&recv_header, sizeof(recv_header)) != received_csum) continue;
+  if (listener->state == CLOSED
+      && microtcp_listen (listener, MICROTCP_LISTEN_BACKLOG)) {
+    return -1;
+  }
+  if (!listener->accept_queue) {
+    return -1;
+  }
 
-      uint16_t expected_flags = (1 << 14) | (1 << 12); // SYN + ACK
-      if ((recv_header.control & expected_flags) != expected_flags) continue;
+  if (listener->nonblock) {
+    if (microtcp_drain (listener)) {
+      return -1;
+    }
+    if (listener->accept_count == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  while (listener->accept_count == 0) {
+    ret = microtcp_recv_segment (listener, &pkt, &from, &from_len, &owner, 0);
+    if (ret == -1) {
+      return -1;
+    }
+    if (ret == 0) {
+      listener->timer_events = 0;
+      continue;
+    }
+    microtcp_deliver (owner, pkt, from, from_len);
+  }
+  queued = listener->accept_queue[listener->accept_head];
+  listener->accept_head = (listener->accept_head + 1) % listener->backlog;
+  listener->accept_count--;
 
-      if (recv_header.ack_num != my_seq + 1) continue;
+  /*
+   * Everything that points to the connection must follow it. The entry of
+   * the peer is updated in place, so nothing can fail half way.
+   */
+  *conn = *queued;
+  microtcp_timer_move (conn, &conn->rto_timer, &queued->rto_timer);
+  microtcp_timer_move (conn, &conn->dack_timer, &queued->dack_timer);
+  microtcp_timer_move (conn, &conn->fin_timer, &queued->fin_timer);
+  microtcp_timer_move (conn, &conn->pace_timer, &queued->pace_timer);
+  microtcp_timer_move (conn, &conn->cork_timer, &queued->cork_timer);
+  microtcp_demux_replace (listener->demux,
+                          (struct sockaddr *) &conn->peer_addr,
+                          conn->peer_addr_len, conn);
+  free (queued);
 
-      break; //If all checks are passed, we reached this point, we leave the loop
+  if (address) {
+    memcpy (address, &conn->peer_addr,
+            address_len < conn->peer_addr_len ?
+                address_len : conn->peer_addr_len);
   }
+  return 0;
+}
 
-  // Here we update seq,ack variables of the socket
-  // and send the last packet, (3rd of the handshake)
-  socket->ack_number = recv_header.seq_num + 1; //ACK = server.seq + 1
-  socket->seq_number = my_seq + 1; 
+/**
+ * Sends our FIN and waits until the peer acknowledges it. The RTO timer
+ * drives the retransmissions.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_send_fin (microtcp_sock_t *socket)
+{
+  microtcp_header_t headerReceived;
+  uint32_t fin_seq = socket->seq_number;
+  int retries;
+  int ret;
+
+  socket->seq_number++;
+  for (retries = 0; retries < MICROTCP_MAX_RETRIES; retries++) {
+    if (microtcp_send_segment (socket, fin_seq, MICROTCP_FIN | MICROTCP_ACK,
+                               NULL, 0, 0)) {
+      return -1;
+    }
+    microtcp_rto_start (socket);
+    /* The ACK of the FIN stops the RTO timer */
+    while ((ret = microtcp_wait_input (socket, &headerReceived)) > 0
+        && socket->snd_una != socket->seq_number) {
+    }
+    if (ret < 0) {
+      return -1;
+    }
+    if (socket->snd_una == socket->seq_number) {
+      return 0;
+    }
+    microtcp_rto_backoff (socket);
+  }
+  return -1;
+}
 
-  memset(&header, 0, sizeof(header));
-  header.seq_num = socket->seq_number;
-  header.ack_num = socket->ack_number;
-  header.data_len = 0;
-  header.window = MICROTCP_WIN_SIZE;
-  header.control = (1 << 12); // Set ACK flag (Bit 12)
+/**
+ * Active close: sends our FIN, waits for its ACK and then for the FIN of
+ * the peer.
+ */
+static int
+microtcp_client_finish (microtcp_sock_t *socket)
+{
+  microtcp_header_t headerReceived;
+  int ret;
 
-  header.checksum = crc32((const uint8_t *)&header, sizeof(header));
+  if (microtcp_send_fin (socket)) {
+    return -1;
+  }
+  if (socket->state == ESTABLISHED) {
+    socket->state = CLOSING_BY_HOST;
+  }
 
-  if (sendto(socket->sd, &header, sizeof(header), 0, address, address_len) == -1) {
+  /* Wait for the FIN of the peer. The ACK is sent by the input path */
+  microtcp_timer_start (socket, &socket->fin_timer, MICROTCP_EV_FIN,
+                        (uint64_t) MICROTCP_MAX_RETRIES * socket->rto_us);
+  while (socket->state != CLOSING_BY_PEER
+      && !(socket->timer_events & MICROTCP_EV_FIN)) {
+    if (microtcp_wait_input (socket, &headerReceived) < 0) {
       return -1;
+    }
+  }
+  if (socket->state != CLOSING_BY_PEER) {
+    return -1;
   }
 
-  socket->state = ESTABLISHED;
+  /*
+   * Linger until the peer stays silent for a while, in case our last ACK
+   * is lost and the FIN comes again. The peer backs off its RTO on every
+   * retransmission, so a single RTO is too short.
+   */
+  do {
+    microtcp_timer_start (socket, &socket->fin_timer, MICROTCP_EV_FIN,
+                          MICROTCP_LINGER_RTOS * socket->rto_us);
+  } while ((ret = microtcp_wait_input (socket, &headerReceived)) > 0);
+  if (ret < 0) {
+    return -1;
+  }
+  socket->state = CLOSED;
   return 0;
 }
 
-int
-microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
-                 socklen_t address_len)
+/**
+ * Passive close: the peer has already sent its FIN, so we only have to
+ * send ours and wait for the ACK.
+ */
+static int
+microtcp_server_finish (microtcp_sock_t *socket)
 {
-  microtcp_header_t headerReceived;
-  microtcp_header_t headerSent;
-  microtcp_sock_t connection_socket;
-  uint32_t received_checksum;
-  ssize_t bytesReceived;
-  
-  while (1) {                           // wait for incoming SYN
-    bytesReceived = recvfrom(socket->sd, socket->recvbuf, MICROTCP_RECVBUF_LEN, 0,
-                             address, &address_len);
-    if (bytesReceived > 0) {
-      memcpy(&headerReceived, socket->recvbuf, sizeof(microtcp_header_t));
-      if (!(headerReceived.control & MICROTCP_SYN)) {       // error when the packet sent is not a SYN
-        perror("CONTROL ERROR");
-        continue;
-      }
-      microtcp_header_t *hdr = (microtcp_header_t *)socket->recvbuf;
-      received_checksum = headerReceived.checksum;
-      headerReceived.checksum = 0;                         // set checksum  to 0 before calculating it
-      if (crc32((const uint8_t *)&headerReceived, sizeof(headerReceived)) != received_checksum) {
-        perror("CHECKSUM ERROR");
-        continue;
-      }
-      if (bytesReceived < sizeof(microtcp_header_t)) {      // error when packet size is smaller than header size
-        perror("SIZE ERROR");
-        continue;
-      }
+  if (microtcp_send_fin (socket)) {
+    return -1;
+  }
+  socket->state = CLOSED;
+  return 0;
+}
+
+/**
+ * Sends the first length bytes of the stream in iov and blocks until the
+ * peer has acknowledged them.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_push (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+               size_t length)
+{
+  struct microtcp_source src;
+  int ret;
+
+  src.iov = iov;
+  src.iovcnt = iovcnt;
+  src.length = length;
+  src.base = socket->snd_una;
+  src.hold = 0;
+
+  while ((uint32_t) (socket->snd_una - src.base) < src.length) {
+    if (microtcp_transmit (socket, &src)) {
+      return -1;
+    }
+    /* Nothing could be sent, so the window is closed. Probe it on RTO. */
+    if (socket->seq_number == socket->snd_una
+        && !microtcp_timer_armed (&socket->rto_timer)
+        && !microtcp_timer_armed (&socket->pace_timer)) {
+      microtcp_rto_start (socket);
+    }
 
-      break;                            // break when first packet without errors is received
+    ret = microtcp_wait_input (socket, NULL);
+    if (ret < 0) {
+      return -1;
     }
-    else if (bytesReceived == -1) {     // error when recvfrom returns -1
-      perror("RECEIVE ERROR");
-      exit(EXIT_FAILURE);
+    /* The bucket has refilled, the loop transmits again */
+    socket->timer_events &= ~MICROTCP_EV_PACE;
+    if (ret > 0 || !(socket->timer_events & MICROTCP_EV_RTO)) {
+      continue;
     }
+    socket->timer_events &= ~MICROTCP_EV_RTO;
+    microtcp_rto_recover (socket);
   }
+  /* A late refill must not wake up the loops of the other calls */
+  microtcp_timer_stop (socket, &socket->pace_timer, MICROTCP_EV_PACE);
+  return microtcp_flush (socket);
+}
 
-  connection_socket = microtcp_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);    // create new server socket for the connection
-  connection_socket.state = HANDSHAKE;
-  connection_socket.seq_number = rand();                 // make the state up to date
-  connection_socket.ack_number = headerReceived.seq_number + 1;
+/**
+ * Copies the data of iov after its first skip bytes to the cork buffer
+ */
+static void
+microtcp_cork_append (microtcp_sock_t *socket, const struct iovec *iov,
+                      int iovcnt, size_t skip)
+{
+  size_t n;
+  int i;
 
-  memset(&headerSent, 0, sizeof(headerSent));
-  headerSent.seq_number = connection_socket.seq_number;
-  headerSent.ack_number = headerReceived.seq_number + 1;
-  headerSent.data_len = 0;
-  headerSent.window = MICROTCP_WIN_SIZE;
-  headerSent.control = MICROTCP_SYN | MICROTCP_ACK;                        // set SYN and ACK flags
-  headerSent.future_use0 = 0;                                              // must set checksum and unused fields to 0
-  headerSent.future_use1 = 0;
-  headerSent.future_use2 = 0; 
-  headerSent.checksum = 0;
-  headerSent.checksum = crc32((const uint8_t *)&headerSent, sizeof(headerSent));
-  if (sendto(connection_socket.sd, &headerSent, sizeof(headerSent), 0, address, address_len) == -1) {
-    perror("SEND ERROR");
-    exit(EXIT_FAILURE);
+  for (i = 0; i < iovcnt; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    n = iov[i].iov_len - skip;
+    memcpy (socket->cork_buf + socket->cork_len,
+            (const uint8_t *) iov[i].iov_base + skip, n);
+    socket->cork_len += n;
+    skip = 0;
   }
-  return connection_socket.sd;
 }
 
-int
-microtcp_shutdown (microtcp_sock_t *socket, int how)
+/**
+ * Sends the data held in the cork buffer, if any
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_cork_flush (microtcp_sock_t *socket)
 {
+  struct iovec iov = { socket->cork_buf, socket->cork_len };
 
-  microtcp_header_t headerReceived;
-  microtcp_header_t headerSent;
-  uint32_t received_checksum;
+  microtcp_timer_stop (socket, &socket->cork_timer, 0);
+  /* A non-blocking socket holds the data in its send buffer */
+  if (socket->nonblock) {
+    socket->snd_hold = 0;
+    return microtcp_output (socket);
+  }
+  microtcp_cork_trim (socket);
+  if (socket->cork_len == 0) {
+    return 0;
+  }
+  iov.iov_len = socket->cork_len;
+  if (microtcp_push (socket, &iov, 1, socket->cork_len)) {
+    return -1;
+  }
+  socket->cork_len = 0;
+  return 0;
+}
+
+/**
+ * microtcp_sendv() on a non-blocking socket: copies what fits of the data
+ * to the send buffer and sends what the windows allow. As with the cork, a
+ * partial segment at the end may wait for more data.
+ *
+ * @return the number of bytes taken, -1 on failure
+ */
+static ssize_t
+microtcp_queue (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags)
+{
+  size_t mask;
+  size_t room;
+  size_t taken = 0;
+  size_t length = 0;
+  size_t off;
+  size_t n;
+  size_t first;
+  int hold;
+  int i;
 
-  if (socket->state == ESTABLISHED) {                 // check for the correct state
-    memset(&headerSent, 0, sizeof(headerSent));
-    headerSent.seq_number = rand();
-    headerSent.control    = MICROTCP_FIN | MICROTCP_ACK;
-    headerSent.window     = socket->curr_win_size;
+  if (socket->closing) {
+    errno = EPIPE;
+    return -1;
+  }
+  if (!socket->sndbuf) {
+    socket->sndbuf = malloc (socket->sndbuf_len);
+    if (!socket->sndbuf) {
+      return -1;
+    }
+    socket->snd_end = socket->seq_number;
+  }
+  mask = socket->sndbuf_len - 1;
+  room = socket->sndbuf_len - (uint32_t) (socket->snd_end - socket->snd_una);
 
-    headerSent.checksum = 0;
-    headerSent.checksum = crc32((const uint8_t *)&headerSent, sizeof(headerSent));
+  for (i = 0; i < iovcnt && taken < room; i++) {
+    length += iov[i].iov_len;
+    n = iov[i].iov_len < room - taken ? iov[i].iov_len : room - taken;
+    off = (socket->snd_end + taken) & mask;
+    first = n < socket->sndbuf_len - off ? n : socket->sndbuf_len - off;
+    memcpy (socket->sndbuf + off, iov[i].iov_base, first);
+    memcpy (socket->sndbuf, (const uint8_t *) iov[i].iov_base + first,
+            n - first);
+    taken += n;
+  }
+  for (; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  if (taken == 0 && length) {
+    errno = EAGAIN;
+    return -1;
+  }
+  socket->snd_end += taken;
 
-    sendto(socket->sd, &headerSent, sizeof(headerSent), 0, peer, peer_len);           // send ACK for FIN
-    socket->ack_number = headerReceived->seq_number + 1;                              // update the state of the socket
-    socket->state = CLOSING_BY_PEER;
+  hold = ((flags & MSG_MORE) || socket->cork)
+      && !(socket->snd_hold && microtcp_now_us () >= socket->cork_deadline);
+  if (hold && !socket->snd_hold) {
+    socket->cork_deadline = microtcp_now_us () + MICROTCP_CORK_DEADLINE_US;
+    microtcp_timer_start (socket, &socket->cork_timer, 0,
+                          MICROTCP_CORK_DEADLINE_US);
+  }
+  else if (!hold) {
+    microtcp_timer_stop (socket, &socket->cork_timer, 0);
   }
-  microtcp_server_finish(peer, &headerReceived, socket, socket_len);                    
-  micro_tcp_client_finish(socket, &headerReceived, peer, peer_len);
-  microtcp_server_finish(peer, &headerReceived, socket, socket_len);
-  
+  socket->snd_hold = hold;
+  if (microtcp_output (socket)) {
+    return -1;
+  }
+  return taken;
 }
 
 ssize_t
-microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
-               int flags)
+microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags)
 {
-  if(socket->state != ESTABLISHED) {
+  struct iovec *stream;
+  size_t length = 0;
+  size_t total;
+  size_t push;
+  int hold;
+  int ret;
+  int i;
+
+  if(socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER) {
     return -1; //connection not established
   }
+  if (socket->nonblock) {
+    return microtcp_queue (socket, iov, iovcnt, flags);
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  /* What the cork timer sent may be acknowledged by now */
+  microtcp_cork_trim (socket);
+  total = socket->cork_len + length;
+
+  /*
+   * While corked, only whole segments go out and the partial one at the
+   * end waits for more data, unless the oldest held byte is overdue
+   */
+  hold = ((flags & MSG_MORE) || socket->cork)
+      && !(socket->cork_len && microtcp_now_us () >= socket->cork_deadline);
+  push = hold ? total / MICROTCP_MSS * MICROTCP_MSS : total;
 
-  microtcp_header_t header;
-  memset(&header, 0, sizeof(header));
-  header.data_len = length;
-  header.window = socket->curr_win_size;
-  header.seq_number = socket->seq_number;
-  header.ack_number = socket->ack_number;
-  
-  header.control = (1 << 12); // Setting ACK=1, Bit 12
-  //because this function is not called for handshaking packets, so ACK = 1
-  header.checksum = crc32((const uint8_t *)&header, sizeof(header));
+  if (push && socket->cork_len) {
+    /* The held data goes first, in the same segments as the new data */
+    microtcp_timer_stop (socket, &socket->cork_timer, 0);
+    stream = malloc ((iovcnt + 1) * sizeof(struct iovec));
+    if (!stream) {
+      return -1;
+    }
+    stream[0].iov_base = socket->cork_buf;
+    stream[0].iov_len = socket->cork_len;
+    memcpy (&stream[1], iov, iovcnt * sizeof(struct iovec));
+    ret = microtcp_push (socket, stream, iovcnt + 1, push);
+    free (stream);
+    if (ret) {
+      return -1;
+    }
+    socket->cork_len = 0;
+  }
+  else if (push && microtcp_push (socket, iov, iovcnt, push)) {
+    return -1;
+  }
 
-  /* Your code here */
+  /* Less than a segment is left, all of it from the new data */
+  if (total > push) {
+    if (socket->cork_len == 0) {
+      socket->cork_seq = socket->seq_number;
+      socket->cork_deadline = microtcp_now_us () + MICROTCP_CORK_DEADLINE_US;
+      microtcp_timer_start (socket, &socket->cork_timer, 0,
+                            MICROTCP_CORK_DEADLINE_US);
+    }
+    microtcp_cork_append (socket, iov, iovcnt, length - (total - push));
+  }
+  return length;
 }
 
 ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
+               int flags)
 {
-  /* Your code here */
+  struct iovec iov = { (void *) buffer, length };
+
+  return microtcp_sendv (socket, &iov, 1, flags);
 }
 
-void micro_tcp_client_finish(microtcp_sock_t *socket,
-                            microtcp_header_t *headerReceived,
-                            struct sockaddr *peer,
-                            socklen_t peer_len)
+ssize_t
+microtcp_sendto (microtcp_sock_t *socket, const void *buffer, size_t length,
+                 int flags, const struct sockaddr *address,
+                 socklen_t address_len)
 {
-  microtcp_header_t headerSent;
-  uint32_t received_checksum;
-  ssize_t bytesReceived;
-  
-  if (headerReceived != NULL) {
-
-    if ((headerReceived->control & MICROTCP_FIN) &&
-      (headerReceived->control & MICROTCP_ACK)) {         // if client received FIN + ACK
+  struct iovec iov = { (void *) buffer, length };
+  struct iovec ring[2];
+  uint32_t isn = rand ();
+  int fastopen = flags & MSG_FASTOPEN;
+  ssize_t taken;
+  ssize_t acked;
 
-      if (socket->state == ESTABLISHED) {                 // check for the correct state
+  flags &= ~MSG_FASTOPEN;
+  if (socket->state != CLOSED) {
+    return microtcp_send (socket, buffer, length, flags);
+  }
+  if (!address) {
+    errno = EDESTADDRREQ;
+    return -1;
+  }
 
-        memset(&headerSent, 0, sizeof(headerSent));
-        headerSent.seq_number = socket->seq_number;
-        headerSent.ack_number = headerReceived->seq_number + 1;
-        headerSent.control    = MICROTCP_ACK;
-        headerSent.window     = socket->curr_win_size;
+  if (socket->nonblock) {
+    /* The send buffer starts after our SYN, which may carry its start */
+    socket->sndbuf = malloc (socket->sndbuf_len);
+    if (!socket->sndbuf) {
+      return -1;
+    }
+    socket->snd_una = socket->snd_end = isn + 1;
+    taken = microtcp_queue (socket, &iov, 1, flags);
+    if (taken == -1
+        || (microtcp_active_open (socket, address, address_len, isn,
+                                  fastopen ? ring : NULL,
+                                  microtcp_sndbuf_iov (socket, ring), taken)
+                == -1
+            && errno != EINPROGRESS)) {
+      free (socket->sndbuf);
+      socket->sndbuf = NULL;
+      return -1;
+    }
+    return taken;
+  }
 
-        headerSent.checksum = 0;
-        headerSent.checksum = crc32((const uint8_t *)&headerSent, sizeof(headerSent));
+  acked = microtcp_active_open (socket, address, address_len, isn,
+                                fastopen ? &iov : NULL, 1, length);
+  if (acked == -1) {
+    return -1;
+  }
+  if ((size_t) acked < length) {
+    iov.iov_base = (uint8_t *) buffer + acked;
+    iov.iov_len = length - acked;
+    if (microtcp_sendv (socket, &iov, 1, flags) == -1) {
+      return -1;
+    }
+  }
+  return length;
+}
 
-        sendto(socket->sd, &headerSent, sizeof(headerSent), 0, peer, peer_len);           // send ACK for FIN
+int
+microtcp_shutdown (microtcp_sock_t *socket, int how)
+{
+  size_t i;
+  int ret;
 
-        socket->ack_number = headerReceived->seq_number + 1;                              // update the state of the socket
-        socket->state = CLOSED;
-        return;
-      }
+  if (socket->nonblock && !socket->closing
+      && (socket->state == ESTABLISHED || socket->state == CLOSING_BY_PEER)) {
+    socket->closing = socket->state == ESTABLISHED ?
+        MICROTCP_CLOSE_ACTIVE : MICROTCP_CLOSE_PASSIVE;
+    if (!socket->sndbuf) {
+      socket->snd_end = socket->seq_number;
     }
-    else if (headerReceived->control & MICROTCP_ACK) {    // if server received ACK
+    socket->snd_hold = 0;
+    microtcp_output (socket);
+  }
 
-      if (socket->state == ESTABLISHED) {
-        socket->state = CLOSING_BY_HOST;
-        return;
+  if (socket->closing) {
+    /* The input and the timers take the close handshake to its end */
+    ret = socket->state == CLOSED ? 0 : microtcp_drain (socket);
+    if (ret == 0 && socket->state != CLOSED) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (socket->closing == MICROTCP_CLOSE_FAILED) {
+      errno = ETIMEDOUT;
+      ret = -1;
+    }
+  }
+  else if ((socket->state == ESTABLISHED || socket->state == CLOSING_BY_PEER)
+      && microtcp_cork_flush (socket)) {
+    ret = -1;
+  }
+  else if (socket->state == ESTABLISHED) {
+    ret = microtcp_client_finish (socket);
+  }
+  else if (socket->state == CLOSING_BY_PEER) {
+    ret = microtcp_server_finish (socket);
+  }
+  else if (socket->state == LISTEN && socket->accept_queue) {
+    /*
+     * The accepted connections are gone, they share the receive batch.
+     * Those left in the table are queued or in their handshake.
+     */
+    for (i = 0; i < socket->demux->capacity; i++) {
+      if (socket->demux->slots[i].value) {
+        microtcp_conn_free (socket->demux->slots[i].value);
       }
     }
+    microtcp_demux_destroy (socket->demux);
+    free (socket->demux);
+    free (socket->accept_queue);
+    socket->demux = NULL;
+    socket->accept_queue = NULL;
+    socket->accept_count = 0;
+    socket->syn_count = 0;
+    ret = 0;
+  }
+  else {
+    return -1;
+  }
+  if (microtcp_flush (socket)) {
+    ret = -1;
   }
-}
-
-void microtcp_server_finish(microtcp_sock_t *socket,
-                            microtcp_header_t *headerReceived,
-                            struct sockaddr *peer,
-                            socklen_t peer_len)
-{
-  microtcp_header_t headerSent;
-  microtcp_header_t headerSent2;
-  uint32_t received_checksum;
-  ssize_t bytesReceived;
-  
-  if (headerReceived != NULL) {
 
-    if ((headerReceived->control & MICROTCP_FIN) &&
-      (headerReceived->control & MICROTCP_ACK)) {         // if server received FIN + ACK
+  /* The wheel must not reach the socket once it is gone */
+  microtcp_timer_cancel (socket->wheel, &socket->rto_timer);
+  microtcp_timer_cancel (socket->wheel, &socket->dack_timer);
+  microtcp_timer_cancel (socket->wheel, &socket->fin_timer);
+  microtcp_timer_cancel (socket->wheel, &socket->pace_timer);
+  microtcp_timer_cancel (socket->wheel, &socket->cork_timer);
+  socket->timer_events = 0;
+  if (socket->poller) {
+    microtcp_poller_del (socket->poller, socket);
+  }
 
-      if (socket->state == ESTABLISHED) {                 // check for the correct state
+  socket->state = CLOSED;
+  socket->closing = 0;
+  if (socket->listener) {
+    microtcp_demux_remove (socket->listener->demux,
+                           (struct sockaddr *) &socket->peer_addr,
+                           socket->peer_addr_len);
+  }
+  else {
+    free (socket->rxq);
+  }
+  free (socket->recvbuf);
+  free (socket->txq);
+  free (socket->cork_buf);
+  free (socket->sndbuf);
+  socket->recvbuf = NULL;
+  socket->txq = NULL;
+  socket->rxq = NULL;
+  socket->cork_buf = NULL;
+  socket->sndbuf = NULL;
+  socket->cork_len = 0;
+  socket->buf_fill_level = 0;
+  return ret;
+}
 
-        memset(&headerSent, 0, sizeof(headerSent));
-        headerSent.seq_number = socket->seq_number;
-        headerSent.ack_number = headerReceived->seq_number + 1;
-        headerSent.control    = MICROTCP_ACK;
-        headerSent.window     = socket->curr_win_size;
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+  size_t old_win;
+  size_t n;
 
-        headerSent.checksum = 0;
-        headerSent.checksum = crc32((const uint8_t *)&headerSent, sizeof(headerSent));
+  if (socket->state != ESTABLISHED && socket->state != CLOSING_BY_PEER
+      && socket->state != CLOSING_BY_HOST) {
+    return -1;
+  }
 
-        sendto(socket->sd, &headerSent, sizeof(headerSent), 0, peer, peer_len);           // send ACK for FIN
+  /* The peer may be waiting for what we hold back before it answers */
+  if (microtcp_cork_flush (socket)) {
+    return -1;
+  }
 
-        socket->ack_number = headerReceived->seq_number + 1;                              // update the state of the socket
-        socket->state = CLOSING_BY_PEER;
-      }
+  if (socket->nonblock && socket->buf_fill_level == 0) {
+    if (microtcp_drain (socket)) {
+      return -1;
     }
-    else if (headerReceived->control & MICROTCP_ACK) {    // if server received ACK
-
-      if (socket->state == CLOSING_BY_PEER) {
-        socket->state = CLOSED;
-        return;
-      }
+    if (socket->buf_fill_level == 0 && socket->state != CLOSING_BY_PEER) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  while (socket->buf_fill_level == 0) {
+    if (socket->state == CLOSING_BY_PEER) {
+      return 0;
+    }
+    if (microtcp_wait_input (socket, NULL) < 0) {
+      return -1;
     }
   }
-  if (socket->state == CLOSING_BY_PEER) {             // send FIN + ACK
-    memset(&headerSent2, 0, sizeof(headerSent2));
-    headerSent2.seq_number = socket->seq_number;
-    headerSent2.ack_number = socket->ack_number;
-    headerSent2.control    = MICROTCP_FIN | MICROTCP_ACK;
-    headerSent2.window     = socket->curr_win_size;
 
-    headerSent2.checksum = 0;
-    headerSent2.checksum = crc32((const uint8_t *)&headerSent2, sizeof(headerSent2));
-    
-    sendto(socket->sd, &headerSent2, sizeof(headerSent2), 0, peer, peer_len);
-    socket->seq_number = rand();
-    return;
+  /* What the peer saw of the window, after scaling */
+  old_win = socket->curr_win_size >> socket->rcv_wscale << socket->rcv_wscale;
+  n = length < socket->buf_fill_level ? length : socket->buf_fill_level;
+  microtcp_ring_read (socket, buffer, n);
+  socket->buf_fill_level -= n;
+
+  /* Let a sender blocked on a full window know that there is space */
+  if (old_win < MICROTCP_MSS) {
+    microtcp_send_ack (socket);
   }
-}
\ No newline at end of file
+  if (microtcp_flush (socket)) {
+    return -1;
+  }
+  return n;
+}
@@ -23,22 +23,158 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <stdint.h>
+#include "timer_wheel.h"
 
 /*
  * Several useful constants
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000
+#define MICROTCP_ACK_TIMEOUT_US 200000  /* The RTO before any RTT sample */
+#define MICROTCP_MIN_RTO_US 10000
+#define MICROTCP_DACK_TIMEOUT_US 4000   /* Well below MICROTCP_MIN_RTO_US */
+#define MICROTCP_CORK_DEADLINE_US 200000 /* Longest a corked byte waits */
+#define MICROTCP_MAX_RTO_US 60000000
+/* Backlog of a listener that microtcp_listen() did not set up */
+#define MICROTCP_LISTEN_BACKLOG 128
+#define MICROTCP_MAX_BACKLOG 65535
+#define MICROTCP_MAX_RETRIES 10
 #define MICROTCP_MSS 1400
 #define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_MAX_RECVBUF_LEN (1 << 30)
+/* Send buffer of a non-blocking socket */
+#define MICROTCP_SNDBUF_LEN 65536
+#define MICROTCP_MAX_SNDBUF_LEN (1 << 30)
+/* Largest window scale shift, as in TCP (RFC 7323) */
+#define MICROTCP_MAX_WSCALE 14
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
 #define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+/* Datagrams moved per sendmmsg()/recvmmsg() call */
+#define MICROTCP_BATCH_LEN 32
 
 #define MICROTCP_ACK  0x0001
 #define MICROTCP_RST  0x0002 
 #define MICROTCP_SYN  0x0004 
 #define MICROTCP_FIN  0x0008 
+#define MICROTCP_SACK 0x0010  /**< future_use0..2 carry SACK blocks */
+#define MICROTCP_TS   0x0020  /**< future_use1 carries the timestamp of the
+                                   sender and future_use2 echoes the last
+                                   timestamp of the peer. Only future_use0
+                                   is left for a SACK block */
+#define MICROTCP_PSH  0x0040  /**< The last segment of a write, whose
+                                   sender waits for the ACK */
+
+/*
+ * Options offered in the future_use0 field of the SYN. The SYN-ACK echoes
+ * the subset that the server accepted.
+ */
+#define MICROTCP_OPT_SACK_PERMITTED 0x00000001
+#define MICROTCP_OPT_WSCALE         0x00000002  /**< Windows and SACK blocks
+                                                     are in units of
+                                                     1 << shift bytes */
+#define MICROTCP_OPT_TIMESTAMPS     0x00000004
+#define MICROTCP_OPT_FASTOPEN       0x00000008  /**< The payload of the SYN
+                                                     starts with a fast open
+                                                     cookie, that of the
+                                                     SYN-ACK may be a new
+                                                     one, see
+                                                     MICROTCP_SO_FASTOPEN */
+#define MICROTCP_OPT_FLAGS          0x000000ff
+/* The window scale shift of the sender of the SYN */
+#define MICROTCP_OPT_WSCALE_MASK    0x00000f00
+#define MICROTCP_OPT_WSCALE_OFFSET  8
+/* The checksum mode (MICROTCP_CSUM_*) the sender of the SYN accepts */
+#define MICROTCP_OPT_CSUM_MASK      0x00003000
+#define MICROTCP_OPT_CSUM_OFFSET    12
+
+/*
+ * Socket options for microtcp_setsockopt(). All of them take an int.
+ */
+#define MICROTCP_SO_GSO 1     /**< Send full-sized segments in UDP_SEGMENT
+                                   superbuffers */
+#define MICROTCP_SO_GRO 2     /**< Accept datagrams coalesced by UDP_GRO.
+                                   Must be set before the connection is
+                                   established */
+#define MICROTCP_SO_RCVBUF 3  /**< Size of the receive buffer in bytes,
+                                   rounded up to a power of two. Must be
+                                   set before the connection is
+                                   established */
+#define MICROTCP_SO_CONGESTION 4 /**< Congestion control, MICROTCP_CC_* */
+#define MICROTCP_SO_PACING 5  /**< Pacing of the transmissions,
+                                   MICROTCP_PACING_* */
+#define MICROTCP_SO_CORK 6    /**< Hold back partial segments, as
+                                   MSG_MORE does for a single call.
+                                   Clearing it sends the held data with
+                                   the next call */
+#define MICROTCP_SO_CHECKSUM 7 /**< The least checksum coverage to accept,
+                                    MICROTCP_CSUM_*. The connection uses
+                                    the stricter mode of the two peers.
+                                    Must be set before the connection is
+                                    established */
+#define MICROTCP_SO_SYN_COOKIES 8 /**< Answer SYNs without keeping any
+                                    state, the SYN-ACK carries it in its
+                                    sequence number. The connection is
+                                    set up by the ACK that completes the
+                                    handshake. For listening sockets */
+#define MICROTCP_SO_REUSEPORT 9 /**< SO_REUSEPORT of the UDP socket, so
+                                    that several sockets may bind the same
+                                    port and the kernel spreads the peers
+                                    among them. Must be set before the bind */
+#define MICROTCP_SO_NONBLOCK 10 /**< Calls return -1 with errno EAGAIN
+                                    instead of blocking, see the calls for
+                                    details. Must be set before the
+                                    connection is established, the
+                                    connections of a listener inherit it */
+#define MICROTCP_SO_SNDBUF 11 /**< Size of the send buffer of a
+                                    non-blocking socket in bytes, rounded up
+                                    to a power of two. Must be set before the
+                                    connection is established */
+#define MICROTCP_SO_FASTOPEN 12 /**< Take the data that a SYN with a valid
+                                    cookie carries and establish the
+                                    connection at once, so the reply does
+                                    not wait for the end of the handshake.
+                                    SYNs without one get a cookie for the
+                                    next time. For listening sockets, and
+                                    sockets that microtcp_accept(). Ignored
+                                    along with MICROTCP_SO_SYN_COOKIES. A
+                                    client that sets it asks for a cookie
+                                    in microtcp_connect() */
+
+/* Congestion control algorithms */
+#define MICROTCP_CC_RENO  0   /**< The default */
+#define MICROTCP_CC_CUBIC 1
+#define MICROTCP_CC_BBR   2
+
+/* Checksum modes, from the strictest */
+#define MICROTCP_CSUM_FULL   0  /**< CRC-32 of header and payload, the
+                                     default */
+#define MICROTCP_CSUM_HEADER 1  /**< CRC-32 of the header only */
+#define MICROTCP_CSUM_NONE   2  /**< No checksum, for paths where the UDP
+                                     checksum is enough, e.g. loopback */
+
+/* Pacing modes */
+#define MICROTCP_PACING_OFF    0 /**< Send the window in bursts, the default */
+#define MICROTCP_PACING_BUCKET 1 /**< Token bucket in the library */
+#define MICROTCP_PACING_KERNEL 2 /**< SO_MAX_PACING_RATE of the UDP socket,
+                                      which only the fq qdisc enforces.
+                                      Falls back to the token bucket */
+
+/* Readiness events of microtcp_poll() */
+#define MICROTCP_POLLIN     0x1 /**< Data to receive, or the peer has
+                                     closed the connection */
+#define MICROTCP_POLLOUT    0x2 /**< Room in the send buffer. Also tells
+                                     that a non-blocking connect completed */
+#define MICROTCP_POLLACCEPT 0x4 /**< A connection waits for
+                                     microtcp_accept_conn() */
+#define MICROTCP_POLLHUP    0x8 /**< The peer has closed the connection,
+                                     or the socket is not connected, e.g.
+                                     its connect failed. Always reported */
+
+/* Maximum number of out-of-order or SACKed ranges tracked per socket */
+#define MICROTCP_MAX_SEQ_BLOCKS 32
+/* Maximum number of SACK blocks that fit in a header */
+#define MICROTCP_MAX_SACK_BLOCKS 3
 
 /**
  * Possible states of the microTCP socket
@@ -58,13 +194,35 @@ typedef enum
 } mircotcp_state_t;
 
 
+/**
+ * A range [start, end) of sequence numbers
+ */
+typedef struct
+{
+  uint32_t start;
+  uint32_t end;
+} microtcp_seq_block_t;
+
+/* Batch of datagram buffers for sendmmsg()/recvmmsg(), see microtcp.c */
+struct microtcp_batch;
+/* Congestion control module, see congestion.h */
+struct microtcp_cc_ops;
+/* Connections of a listening socket by peer address, see demux.h */
+struct microtcp_demux;
+/* Readiness of many sockets, see microtcp_poll() */
+struct microtcp_poller;
+/* Datagram I/O through io_uring, see uring.h */
+struct microtcp_uring;
+/* A request of microtcp_send_async() or microtcp_recv_async() */
+struct microtcp_async;
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
  *
  * NOTE: Fill free to insert additional fields.
  */
-typedef struct
+typedef struct microtcp_sock
 {
   int sd;                       /**< The underline UDP socket descriptor */
   mircotcp_state_t state;       /**< The state of the microTCP socket */
@@ -74,23 +232,223 @@ typedef struct
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
+                                     to retrieve the data from the network.
+                                     It is a ring of recvbuf_len bytes. */
+  size_t recvbuf_len;           /**< Size of recvbuf, a power of two */
+  size_t recvbuf_head;          /**< Offset of the first unread byte */
   size_t buf_fill_level;        /**< Amount of data in the buffer */
+  microtcp_seq_block_t ooo_blocks[MICROTCP_MAX_SEQ_BLOCKS]; /**< Out-of-order
+                                     data held in the receive buffer beyond
+                                     buf_fill_level, sorted by sequence */
+  size_t ooo_count;             /**< Number of out-of-order blocks */
+  uint32_t ooo_recent;          /**< Start of the most recent out-of-order
+                                     segment, reported first in the SACK */
 
-  size_t cwnd;
-  size_t ssthresh;
+  size_t cwnd;                  /**< Congestion window in bytes */
+  size_t ssthresh;              /**< Slow start threshold in bytes */
+  size_t peer_win;              /**< Last window advertised by the peer */
+  const struct microtcp_cc_ops *cc; /**< Updates cwnd and ssthresh */
+  uint64_t cc_priv[16];         /**< State of the congestion control */
 
-  size_t seq_number;            /**< Keep the state of the sequence number */
+  size_t seq_number;            /**< Keep the state of the sequence number.
+                                     This is the next sequence number to be
+                                     transmitted */
   size_t ack_number;            /**< Keep the state of the ack number */
+  uint32_t snd_una;             /**< Oldest unacknowledged sequence number */
+  microtcp_seq_block_t sacked[MICROTCP_MAX_SEQ_BLOCKS]; /**< Ranges above
+                                     snd_una that the peer has SACKed */
+  size_t sacked_count;          /**< Number of SACKed ranges */
+  uint32_t rtx_nxt;             /**< Next byte to check for retransmission */
+  uint32_t rtx_high;            /**< Highest byte outstanding when the loss
+                                     was detected. Holes below it and above
+                                     rtx_nxt are retransmitted */
+  uint32_t snd_max;             /**< Highest sequence number sent before
+                                     seq_number went back to snd_una on a
+                                     timeout without SACK */
+  size_t dupacks;               /**< Consecutive duplicate ACKs */
+  int in_recovery;              /**< In fast recovery after duplicate ACKs */
+  uint32_t recover;             /**< snd_nxt when fast recovery started. An
+                                     ACK beyond it ends the recovery */
+  uint32_t opts;                /**< Options offered, or negotiated after
+                                     the handshake (MICROTCP_OPT_*) */
+  uint8_t rcv_wscale;           /**< Shift of the windows we advertise */
+  uint8_t snd_wscale;           /**< Shift of the windows of the peer */
+
+  uint32_t srtt_us;             /**< Smoothed RTT, 0 before the first
+                                     sample */
+  uint32_t rttvar_us;           /**< RTT variation */
+  uint32_t rto_us;              /**< Retransmission timeout, including any
+                                     backoff */
+  uint32_t ts_recent;           /**< Timestamp of the peer to echo */
+  int rtt_timing;               /**< Without timestamps, a segment starting
+                                     at rtt_seq is being timed */
+  uint32_t rtt_seq;
+  uint64_t rtt_start;
+
+  microtcp_timer_wheel_t *wheel; /**< Shared by the sockets of the thread
+                                     that created this one, which is the
+                                     only thread that may use it */
+  microtcp_timer_t rto_timer;   /**< Retransmission and zero window probe */
+  microtcp_timer_t dack_timer;  /**< Sends a deferred ACK */
+  size_t ack_pending;           /**< In-order bytes received since the last
+                                     ACK was sent */
+  microtcp_timer_t fin_timer;   /**< Waiting for the FIN of the peer and
+                                     lingering after the close */
+  microtcp_timer_t pace_timer;  /**< The token bucket has refilled */
+  unsigned int timer_events;    /**< Timers that fired and wait to be
+                                     handled (MICROTCP_EV_* in microtcp.c) */
+
+  int pacing;                   /**< MICROTCP_PACING_* */
+  int64_t pace_tokens;          /**< Level of the token bucket in bytes,
+                                     scaled by 1e6. May go negative */
+  uint64_t pace_stamp;          /**< Last refill of the bucket */
+  uint64_t pace_kernel_rate;    /**< Last SO_MAX_PACING_RATE set */
+
+  struct microtcp_batch *txq;   /**< Segments waiting for the next
+                                     sendmmsg() */
+  struct microtcp_batch *rxq;   /**< Datagrams of the last recvmmsg() */
+  int csum_mode;                /**< MICROTCP_CSUM_*, negotiated in the
+                                     handshake */
+  const uint8_t *rx_inplace;    /**< Payload of the last received segment,
+                                     if its checksum verification already
+                                     copied it to the receive buffer */
+  int nonblock;                 /**< MICROTCP_SO_NONBLOCK */
+  uint8_t *sndbuf;              /**< Data written to a non-blocking socket
+                                     and not acknowledged yet. It is a ring
+                                     that holds sequence number seq at
+                                     seq & (sndbuf_len - 1), allocated by
+                                     the first write */
+  size_t sndbuf_len;            /**< Size of sndbuf, a power of two */
+  uint32_t snd_end;             /**< Sequence number after the last byte
+                                     in sndbuf */
+  int snd_hold;                 /**< A partial segment at the end of sndbuf
+                                     waits for more data, see
+                                     MICROTCP_SO_CORK */
+  int closing;                  /**< How a non-blocking microtcp_shutdown()
+                                     is closing the connection,
+                                     MICROTCP_CLOSE_* in microtcp.c */
+  int cork;                     /**< MICROTCP_SO_CORK */
+  uint8_t *cork_buf;            /**< Written but unsent data, less than a
+                                     segment */
+  size_t cork_len;
+  uint32_t cork_seq;            /**< Sequence number of cork_buf[0] */
+  uint64_t cork_deadline;       /**< When the held data must go out */
+  microtcp_timer_t cork_timer;  /**< Sends the held data at cork_deadline */
+  int gso_enabled;              /**< Transmit with UDP_SEGMENT */
+  int gro_enabled;              /**< Receive with UDP_GRO */
+
+  struct microtcp_demux *demux; /**< Connections accepted on the UDP socket
+                                     of this one, see microtcp_accept_conn() */
+  struct microtcp_sock *listener; /**< The socket whose UDP socket and
+                                     receive batch this connection shares,
+                                     NULL if it has its own */
+  struct microtcp_sock **accept_queue; /**< Ring of the established
+                                     connections that wait for
+                                     microtcp_accept_conn() */
+  size_t accept_head;
+  size_t accept_count;
+  size_t syn_count;             /**< Connections of this listener still in
+                                     their handshake */
+  size_t backlog;               /**< Bound of both queues */
+  unsigned int syn_retries;     /**< SYN-ACKs retransmitted during the
+                                     handshake, or the SYN or the FIN of a
+                                     non-blocking socket */
+  int syn_cookies;              /**< MICROTCP_SO_SYN_COOKIES */
+  uint64_t cookie_key[2];       /**< Secret that authenticates the cookies */
+  uint64_t fastopen_cookie;     /**< Cookie that our fast open SYN carries,
+                                     or that our SYN-ACK gives the peer */
+
+  struct microtcp_poller *poller; /**< Watches this socket, NULL if none */
+  unsigned int poll_events;     /**< MICROTCP_POLL* the poller watches for */
+  void *poll_data;              /**< Returned with the events */
+  struct microtcp_sock *poll_prev; /**< Links of the ready list of the
+                                     poller, see microtcp_poll() */
+  struct microtcp_sock *poll_next;
+  int poll_queued;              /**< In the ready list */
+  size_t poll_users;            /**< Watched sockets that read from the
+                                     UDP socket of this one */
+  struct microtcp_uring *uring; /**< Receives the datagrams of the UDP
+                                     socket, NULL if recvmmsg() does */
+  unsigned int uring_id;        /**< Entry of the socket in uring */
+  struct microtcp_async *send_head; /**< microtcp_send_async() requests, in
+                                     order */
+  struct microtcp_async *send_tail;
+  struct microtcp_async *recv_head; /**< microtcp_recv_async() requests, in
+                                     order */
+  struct microtcp_async *recv_tail;
+
+  struct sockaddr_storage peer_addr; /**< Address of the remote peer */
+  socklen_t peer_addr_len;      /**< Length of the peer address */
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+  /* The losses above, split by the way they were detected */
+  uint64_t packets_lost_rto;
+  uint64_t bytes_lost_rto;
+  uint64_t packets_lost_dupack;
+  uint64_t bytes_lost_dupack;
 } microtcp_sock_t;
 
 
+/**
+ * Configuration of microtcp_serve()
+ */
+typedef struct
+{
+  int workers;                  /**< Number of worker threads, 0 for one
+                                     per CPU the process may run on */
+  int backlog;                  /**< Backlog of each listener, see
+                                     microtcp_listen() */
+  int pin;                      /**< Pin each worker to a CPU of its own,
+                                     as far as there are enough */
+  /**
+   * If not NULL, sets up the socket of a worker before it is bound, e.g.
+   * with microtcp_setsockopt(). Returns 0 on success, -1 to give up.
+   */
+  int (*setup) (microtcp_sock_t *socket, int worker, void *arg);
+  /**
+   * The accept loop of a worker. The listener and every connection accepted
+   * on it belong to the worker thread. The listener is shut down once this
+   * returns.
+   */
+  void (*serve) (microtcp_sock_t *listener, int worker, void *arg);
+  void *arg;                    /**< Passed to setup and serve */
+} microtcp_serve_conf_t;
+
+
+/**
+ * A socket with events from microtcp_poll()
+ */
+typedef struct
+{
+  microtcp_sock_t *socket;
+  unsigned int events;          /**< MICROTCP_POLL* */
+  void *data;                   /**< As given to microtcp_poller_add() */
+} microtcp_poll_event_t;
+
+typedef struct microtcp_poller microtcp_poller_t;
+
+/* Operations of the completions */
+#define MICROTCP_OP_SEND 1      /**< microtcp_send_async() */
+#define MICROTCP_OP_RECV 2      /**< microtcp_recv_async() */
+
+/**
+ * The outcome of an asynchronous request, see microtcp_wait_completions()
+ */
+typedef struct
+{
+  microtcp_sock_t *socket;
+  void *user_data;              /**< As given with the request */
+  int op;                       /**< MICROTCP_OP_* */
+  ssize_t res;                  /**< Bytes sent or received, 0 if the peer
+                                     has closed the connection, or a
+                                     negative errno */
+} microtcp_completion_t;
+
+
 /**
  * microTCP header structure
  * NOTE: DO NOT CHANGE!
@@ -109,6 +467,13 @@ typedef struct
 } microtcp_header_t;
 
 
+/**
+ * Creates a microTCP socket of the domain, on top of a UDP socket. The
+ * type may be SOCK_STREAM, for the stream microTCP provides, SOCK_DGRAM,
+ * for the UDP socket underneath, or 0, and the protocol IPPROTO_TCP,
+ * IPPROTO_UDP or 0, all with the same result. Any other type or protocol
+ * fails with EPROTONOSUPPORT. As on any failure, the process exits.
+ */
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
 
@@ -116,16 +481,68 @@ int
 microtcp_bind (microtcp_sock_t *socket, const struct sockaddr *address,
                socklen_t address_len);
 
+/**
+ * Sets a microTCP socket option (MICROTCP_SO_*).
+ *
+ * @return 0 on success, -1 on failure with errno set. If the kernel
+ * refuses GSO or GRO the socket keeps using the per-segment path.
+ */
+int
+microtcp_setsockopt (microtcp_sock_t *socket, int option, const void *value,
+                     socklen_t len);
+
+/**
+ * Connects to a listening peer with the 3-way handshake.
+ *
+ * A non-blocking socket sends the SYN and returns -1 with errno
+ * EINPROGRESS. The handshake completes as input is processed, see
+ * microtcp_poll(): MICROTCP_POLLOUT tells that the socket is established,
+ * MICROTCP_POLLHUP that the peer never answered.
+ *
+ * @return 0 on success or -1 on failure
+ */
 int
 microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
                   socklen_t address_len);
 
+/**
+ * Makes the socket accept connections with microtcp_accept_conn(). From
+ * now on, whenever a socket of the thread waits for input, the SYNs the
+ * listener receives start handshakes and the connections that complete
+ * them are queued, even while nobody accepts.
+ *
+ * @param backlog the most connections that may be in their handshake, and
+ * separately the most that may wait to be accepted. Beyond that SYNs and
+ * handshake ACKs are dropped and the peers retransmit them.
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Serves a port from several worker threads, each with a listener of its
+ * own on an SO_REUSEPORT UDP socket. The kernel hashes every peer to one of
+ * the sockets, so each worker handles its peers from the handshake on and
+ * shares no state with the others.
+ *
+ * @param address the address to bind. With port 0 the first worker picks
+ * the port for all.
+ * @return 0 once every worker has returned, -1 if any of them could not
+ * be set up, in which case none of them serves
+ */
+int
+microtcp_serve (const struct sockaddr *address, socklen_t address_len,
+                const microtcp_serve_conf_t *conf);
+
 /**
  * Blocks waiting for a new connection from a remote peer.
  *
  * @param socket the socket structure
  * @param address pointer to store the address information of the connected peer
  * @param address_len the length of the address structure.
+ * The socket becomes the connection, so it must not be listening, see
+ * microtcp_accept_conn() for more connections per socket.
+ *
  * @return ATTENTION despite the original accept() this function returns
  * 0 on success or -1 on failure
  */
@@ -133,15 +550,216 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Takes the oldest connection that completed its handshake, blocking
+ * until there is one. The listening socket stays open for more. The
+ * connection shares the UDP socket of the listener and the segments are
+ * dispatched by the address of the peer, so any number of connections
+ * costs a single port and file descriptor.
+ *
+ * Every socket involved must be used by the thread that created the
+ * listener. Segments that arrive for any connection, while another one or
+ * the listener is blocked, are processed on the spot.
+ *
+ * @param listener a socket set up by microtcp_listen(). A bound socket
+ * that is not connected listens with a backlog of MICROTCP_LISTEN_BACKLOG
+ * @param conn set to the new connection. Its address must not change until
+ * microtcp_shutdown(), which must be called on every connection before
+ * the listener.
+ * @param address pointer to store the address information of the connected peer
+ * @param address_len the length of the address structure.
+ * @return 0 on success or -1 on failure. A non-blocking listener processes
+ * the input that is already there and fails with EAGAIN if still no
+ * connection waits.
+ */
+int
+microtcp_accept_conn (microtcp_sock_t *listener, microtcp_sock_t *conn,
+                      struct sockaddr *address, socklen_t address_len);
+
+/**
+ * Closes the connection, or stops a listener, and frees the socket. The
+ * socket leaves its poller.
+ *
+ * A non-blocking socket sends what is left in its send buffer and then its
+ * FIN, and fails with EAGAIN for as long as the close handshake lasts,
+ * which MICROTCP_POLLHUP reports the end of. The next call frees it.
+ *
+ * @return 0 on success or -1 on failure
+ */
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
+/**
+ * Sends the buffer to the peer. The buffer is cut into MICROTCP_MSS
+ * segments and up to min(cwnd, peer window) bytes are kept in flight.
+ * The call blocks until all the data have been acknowledged.
+ *
+ * With MSG_MORE in flags, or while MICROTCP_SO_CORK is set, a partial
+ * segment at the end is held back and merged with the data of the next
+ * call. It is sent anyway MICROTCP_CORK_DEADLINE_US after it was written,
+ * by a timer that runs while any call on a socket of the thread runs, and
+ * by microtcp_recv() and microtcp_shutdown(). A blocking socket does not
+ * wait for the ACK of what its timer sends, the next call does.
+ *
+ * A non-blocking socket copies what fits to its send buffer instead, and
+ * sends as much of it as the windows allow. The rest goes out as the
+ * peer acknowledges, whenever the socket processes input.
+ *
+ * @return the number of bytes sent, or taken by the send buffer, or -1 on
+ * failure. A non-blocking socket fails with EAGAIN if the send buffer is
+ * full.
+ */
 ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Scatter/gather version of microtcp_send(). The data of the iovcnt
+ * buffers are sent as a single stream. The segments point straight into
+ * the buffers of the caller, so the payload is never copied.
+ *
+ * @return the number of bytes sent or -1 on failure
+ */
+ssize_t
+microtcp_sendv (microtcp_sock_t *socket, const struct iovec *iov, int iovcnt,
+                int flags);
+
+/**
+ * Connects a socket that is not connected yet to the peer at address and
+ * sends the buffer, as microtcp_connect() and microtcp_send() would. With
+ * MSG_FASTOPEN in flags the SYN carries the first segment of the data, if
+ * the thread holds a fast open cookie of the peer from an earlier
+ * connection, and asks for one otherwise. The peer passes the data to its
+ * application right away, see MICROTCP_SO_FASTOPEN, and what the peer did
+ * not take in the handshake is sent after it.
+ *
+ * A connected socket ignores the address and sends as microtcp_send().
+ *
+ * A non-blocking socket copies what fits to its send buffer and returns,
+ * the handshake completes as for microtcp_connect().
+ *
+ * @return the number of bytes sent, or taken by the send buffer, or -1 on
+ * failure
+ */
+ssize_t
+microtcp_sendto (microtcp_sock_t *socket, const void *buffer, size_t length,
+                 int flags, const struct sockaddr *address,
+                 socklen_t address_len);
+
+/**
+ * Receives data from the peer, blocking until at least one byte is
+ * available.
+ *
+ * @return the number of bytes received, 0 if the peer has closed the
+ * connection or -1 on failure. A non-blocking socket processes the input
+ * that is already there and fails with EAGAIN if still nothing is
+ * available.
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
 
+/**
+ * Creates a poller, which reports the readiness of many sockets with
+ * epoll on their UDP sockets. The connections that share the UDP socket
+ * of a listener cost a single epoll registration. Meant for non-blocking
+ * sockets, all of them created by the thread that uses the poller.
+ *
+ * Where the kernel supports it, the poller moves the datagrams of its
+ * non-blocking sockets through io_uring instead, see uring.h, and falls
+ * back to epoll otherwise. The datagrams that the sockets send then leave
+ * with the next microtcp_poll() or microtcp_wait_completions().
+ *
+ * @return the poller, NULL on failure
+ */
+microtcp_poller_t *
+microtcp_poller_create (void);
+
+/**
+ * Frees a poller that no longer watches any socket.
+ */
+void
+microtcp_poller_destroy (microtcp_poller_t *poller);
+
+/**
+ * Starts watching a socket. Its address must not change until it leaves
+ * the poller, with microtcp_poller_del() or microtcp_shutdown().
+ *
+ * @param events the MICROTCP_POLL* to report
+ * @param data returned with the events of the socket
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_poller_add (microtcp_poller_t *poller, microtcp_sock_t *socket,
+                     unsigned int events, void *data);
+
+/**
+ * Changes the events that are reported for a watched socket.
+ *
+ * @return 0 on success, -1 if the poller does not watch the socket
+ */
+int
+microtcp_poller_mod (microtcp_poller_t *poller, microtcp_sock_t *socket,
+                     unsigned int events, void *data);
+
+/**
+ * @return 0 on success, -1 if the poller does not watch the socket
+ */
+int
+microtcp_poller_del (microtcp_poller_t *poller, microtcp_sock_t *socket);
+
+/**
+ * Waits until some of the watched sockets are ready. The input of their
+ * UDP sockets is processed on the way, and so are the timers of the
+ * thread, so a single thread drives every connection. Readiness is level
+ * triggered: a socket is reported on every call for as long as it stays
+ * ready.
+ *
+ * @param events set to the ready sockets
+ * @param timeout_ms the longest to wait, -1 for no limit
+ * @return the number of ready sockets, 0 on timeout, -1 on failure
+ */
+int
+microtcp_poll (microtcp_poller_t *poller, microtcp_poll_event_t *events,
+               int maxevents, int timeout_ms);
+
+/**
+ * Requests to send a whole buffer on a socket watched by a poller. The
+ * buffer must stay valid until the completion, which comes once the send
+ * buffer of the socket has taken all of it. The requests of a socket
+ * complete in order.
+ *
+ * @param flags as for microtcp_send()
+ * @param user_data returned with the completion
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_send_async (microtcp_sock_t *socket, const void *buffer,
+                     size_t length, int flags, void *user_data);
+
+/**
+ * Requests to receive on a socket watched by a poller. The completion
+ * comes with the first data, as microtcp_recv() would return it.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_recv_async (microtcp_sock_t *socket, void *buffer, size_t length,
+                     int flags, void *user_data);
+
+/**
+ * Waits until some asynchronous requests on the sockets of a poller
+ * complete, doing what microtcp_poll() does meanwhile. The requests of a
+ * socket that leaves its poller complete with -ECANCELED.
+ *
+ * @param completions set to the completed requests
+ * @param timeout_ms the longest to wait, -1 for no limit
+ * @return the number of completions, 0 on timeout, -1 on failure
+ */
+int
+microtcp_wait_completions (microtcp_poller_t *poller,
+                           microtcp_completion_t *completions, int max,
+                           int timeout_ms);
+
+
 #endif /* LIB_MICROTCP_H_ */
@@ -0,0 +1,1046 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A C++20 coroutine front-end of microTCP. An executor drives the
+ * non-blocking sockets of its thread through a poller, see microtcp_poll(),
+ * and resumes the coroutines that wait on them, so every session of a
+ * server can be a coroutine of its own instead of a thread:
+ *
+ *   microtcp::task<>
+ *   echo (microtcp::socket conn)
+ *   {
+ *     char buf[4096];
+ *     size_t n;
+ *
+ *     while ((n = co_await conn.recv (buf, sizeof(buf)))) {
+ *       co_await conn.send (buf, n);
+ *     }
+ *     co_await conn.close ();
+ *   }
+ *
+ * Failures throw std::system_error. As with the C API, everything belongs
+ * to the thread that created the executor.
+ */
+
+#ifndef LIB_MICROTCP_HPP_
+#define LIB_MICROTCP_HPP_
+
+#if __cplusplus < 202002L
+#error "microtcp.hpp needs C++20"
+#endif
+
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <ranges>
+#include <system_error>
+#include <utility>
+
+extern "C" {
+#include "microtcp.h"
+}
+
+namespace microtcp
+{
+
+class executor;
+class socket;
+
+namespace detail
+{
+
+[[noreturn]] inline void
+throw_errno (int error, const char *what)
+{
+  throw std::system_error (error, std::generic_category (), what);
+}
+
+/**
+ * An operation on a socket that completes once the socket is ready. The
+ * executor retries it whenever the socket reports one of its events, and
+ * resumes the waiting coroutine once it is over.
+ */
+struct operation
+{
+  std::coroutine_handle<> waiter; /**< Empty for the close of a socket
+                                       object that is gone */
+  unsigned int events = 0;      /**< MICROTCP_POLL* to retry on, besides
+                                     MICROTCP_POLLHUP */
+  int error = 0;                /**< errno of the failure, 0 if none */
+
+  virtual ~operation () = default;
+
+  /** @return false while the operation would block */
+  virtual bool
+  attempt () = 0;
+};
+
+/**
+ * What a socket object owns. The engine keeps pointers to the microTCP
+ * socket, so it never moves, and it outlives the object while it closes.
+ */
+struct endpoint
+{
+  microtcp_sock_t sock{};
+  executor *ex = nullptr;
+  operation *in = nullptr;      /**< A recv(), accept() or close() */
+  operation *out = nullptr;     /**< A send() or connect() */
+  endpoint *listener = nullptr; /**< Accepted this connection */
+  size_t conns = 0;             /**< Connections accepted and not closed,
+                                     which the listener must outlive */
+};
+
+template <operation *endpoint::*Slot>
+struct waiting;
+struct accept_op;
+struct close_op;
+
+/** A spawned task returned, maybe with an exception */
+inline void
+task_done (executor *ex, std::exception_ptr error) noexcept;
+
+struct promise_base
+{
+  std::coroutine_handle<> continuation; /**< Awaits the task */
+  executor *owner = nullptr;    /**< Runs the task, see executor::spawn() */
+  std::exception_ptr error;
+
+  struct final_awaiter
+  {
+    bool
+    await_ready () noexcept
+    {
+      return false;
+    }
+
+    template <typename Promise>
+    std::coroutine_handle<>
+    await_suspend (std::coroutine_handle<Promise> h) noexcept
+    {
+      promise_base &p = h.promise ();
+      executor *ex = p.owner;
+      std::exception_ptr error;
+
+      if (p.continuation) {
+        return p.continuation;
+      }
+      if (ex) {
+        error = std::move (p.error);
+        h.destroy ();
+        task_done (ex, std::move (error));
+      }
+      return std::noop_coroutine ();
+    }
+
+    void
+    await_resume () noexcept
+    {
+    }
+  };
+
+  std::suspend_always
+  initial_suspend () noexcept
+  {
+    return {};
+  }
+
+  final_awaiter
+  final_suspend () noexcept
+  {
+    return {};
+  }
+
+  void
+  unhandled_exception () noexcept
+  {
+    error = std::current_exception ();
+  }
+};
+
+template <typename T>
+struct promise_result
+{
+  std::optional<T> value;
+
+  template <typename U>
+  void
+  return_value (U &&v)
+  {
+    value.emplace (std::forward<U> (v));
+  }
+
+  T
+  take ()
+  {
+    return std::move (*value);
+  }
+};
+
+template <>
+struct promise_result<void>
+{
+  void
+  return_void () noexcept
+  {
+  }
+
+  void
+  take () noexcept
+  {
+  }
+};
+
+} /* namespace detail */
+
+/**
+ * A coroutine that starts when it is awaited, or when the executor it is
+ * spawned on runs it, and returns a T.
+ */
+template <typename T = void>
+class task
+{
+public:
+  struct promise_type : detail::promise_base, detail::promise_result<T>
+  {
+    task
+    get_return_object () noexcept
+    {
+      return task (std::coroutine_handle<promise_type>::from_promise (*this));
+    }
+  };
+
+  task (task &&other) noexcept : h_ (std::exchange (other.h_, nullptr))
+  {
+  }
+
+  task &
+  operator= (task &&other) noexcept
+  {
+    if (this != &other) {
+      if (h_) {
+        h_.destroy ();
+      }
+      h_ = std::exchange (other.h_, nullptr);
+    }
+    return *this;
+  }
+
+  ~task ()
+  {
+    if (h_) {
+      h_.destroy ();
+    }
+  }
+
+  auto
+  operator co_await () && noexcept
+  {
+    struct awaiter
+    {
+      std::coroutine_handle<promise_type> h;
+
+      bool
+      await_ready () noexcept
+      {
+        return false;
+      }
+
+      std::coroutine_handle<>
+      await_suspend (std::coroutine_handle<> caller) noexcept
+      {
+        h.promise ().continuation = caller;
+        return h;
+      }
+
+      T
+      await_resume ()
+      {
+        if (h.promise ().error) {
+          std::rethrow_exception (h.promise ().error);
+        }
+        return h.promise ().take ();
+      }
+    };
+    return awaiter{h_};
+  }
+
+private:
+  friend class executor;
+
+  explicit task (std::coroutine_handle<promise_type> h) noexcept : h_ (h)
+  {
+  }
+
+  std::coroutine_handle<promise_type> h_;
+};
+
+/**
+ * Runs coroutines on a single thread. Their sockets are non-blocking and
+ * watched by the poller of the executor, which resumes a coroutine once
+ * the socket it waits on is ready.
+ */
+class executor
+{
+public:
+  executor () : poller_ (microtcp_poller_create ())
+  {
+    if (!poller_) {
+      detail::throw_errno (errno, "microtcp_poller_create");
+    }
+  }
+
+  executor (const executor &) = delete;
+  executor &
+  operator= (const executor &) = delete;
+
+  /**
+   * Closes what is left of the sockets that were dropped while open. The
+   * sockets of the coroutines that never returned must be closed before.
+   */
+  ~executor ();
+
+  /**
+   * Runs a coroutine from the next run() on. It may spawn more.
+   */
+  void
+  spawn (task<> t)
+  {
+    std::coroutine_handle<task<>::promise_type> h =
+        std::exchange (t.h_, nullptr);
+
+    h.promise ().owner = this;
+    tasks_++;
+    ready_.push_back (h);
+  }
+
+  /**
+   * Resumes the coroutines as their sockets become ready, until every
+   * spawned one has returned and the sockets that they dropped have
+   * closed. Rethrows the first exception that escapes a spawned coroutine,
+   * a later run() goes on with the others.
+   */
+  void
+  run ();
+
+  microtcp_poller_t *
+  poller () const noexcept
+  {
+    return poller_;
+  }
+
+private:
+  friend class socket;
+  template <detail::operation *detail::endpoint::*Slot>
+  friend struct detail::waiting;
+  friend struct detail::accept_op;
+  friend struct detail::close_op;
+  friend void
+  detail::task_done (executor *ex, std::exception_ptr error) noexcept;
+
+  /** @return 0 on success, -1 on failure */
+  int
+  poll ();
+
+  /** @return 0 on success, -1 on failure */
+  int
+  add (detail::endpoint *ep);
+
+  void
+  watch (detail::endpoint *ep);
+
+  void
+  wait (detail::endpoint *ep, detail::operation **slot,
+        detail::operation *op, std::coroutine_handle<> h);
+
+  void
+  dispatch (detail::endpoint *ep, unsigned int events);
+
+  void
+  release (detail::endpoint *ep);
+
+  void
+  abandon (detail::endpoint *ep);
+
+  microtcp_poller_t *poller_;
+  std::deque<std::coroutine_handle<>> ready_; /**< To resume, in order */
+  size_t tasks_ = 0;            /**< Spawned and not returned */
+  size_t orphans_ = 0;          /**< Endpoints closing without a socket */
+  std::exception_ptr error_;    /**< Escaped a spawned task */
+};
+
+namespace detail
+{
+struct connect_op;
+struct recv_op;
+struct send_op;
+} /* namespace detail */
+
+/**
+ * A microTCP connection or listener, non-blocking and watched by the
+ * poller of its executor. A socket that is dropped while open is closed
+ * by the executor, which waits for the connections of a listener to close
+ * before it closes the listener.
+ *
+ * At most one coroutine may wait to receive, accept or close a socket,
+ * and one more to send or connect. As MICROTCP_POLLHUP is level triggered,
+ * a connection that the peer has closed keeps the executor busy until it
+ * is received from to the end, or closed.
+ */
+class socket
+{
+public:
+  socket () noexcept = default;
+
+  socket (socket &&other) noexcept = default;
+
+  socket &
+  operator= (socket &&other) noexcept
+  {
+    if (this != &other) {
+      reset ();
+      ep_ = std::move (other.ep_);
+    }
+    return *this;
+  }
+
+  ~socket ()
+  {
+    reset ();
+  }
+
+  /**
+   * Listens on an address, see microtcp_listen().
+   */
+  static socket
+  listen (executor &ex, const struct sockaddr *address,
+          socklen_t address_len, int backlog = MICROTCP_LISTEN_BACKLOG);
+
+  /**
+   * Starts the handshake with a listening peer. Awaiting the result gives
+   * the connected socket.
+   */
+  static detail::connect_op
+  connect (executor &ex, const struct sockaddr *address,
+           socklen_t address_len);
+
+  /**
+   * Awaiting the result gives the next connection of a listener.
+   */
+  detail::accept_op
+  accept (struct sockaddr *address = nullptr, socklen_t address_len = 0);
+
+  /**
+   * Awaiting the result gives the number of bytes received, 0 once the
+   * peer has closed the connection.
+   */
+  detail::recv_op
+  recv (void *buffer, size_t length, int flags = 0);
+
+  template <std::ranges::contiguous_range Buffer>
+  detail::recv_op
+  recv (Buffer &buffer);
+
+  /**
+   * Awaiting the result gives the length, once the send buffer has taken
+   * all of it. The buffer may be reused then.
+   */
+  detail::send_op
+  send (const void *buffer, size_t length, int flags = 0);
+
+  template <std::ranges::contiguous_range Buffer>
+  detail::send_op
+  send (const Buffer &buffer);
+
+  /**
+   * Awaiting the result closes the connection, see microtcp_shutdown(),
+   * or the listener once its connections are closed. The socket is empty
+   * afterwards, even if the close failed.
+   */
+  detail::close_op
+  close ();
+
+  explicit
+  operator bool () const noexcept
+  {
+    return ep_ != nullptr;
+  }
+
+  microtcp_sock_t *
+  native_handle () const noexcept
+  {
+    return ep_ ? &ep_->sock : nullptr;
+  }
+
+private:
+  friend struct detail::connect_op;
+  friend struct detail::accept_op;
+  friend struct detail::close_op;
+
+  socket (executor &ex, int domain) : ep_ (new detail::endpoint)
+  {
+    ep_->ex = &ex;
+    ep_->sock = microtcp_socket (domain, SOCK_DGRAM, IPPROTO_UDP);
+  }
+
+  explicit socket (std::unique_ptr<detail::endpoint> ep) noexcept
+      : ep_ (std::move (ep))
+  {
+  }
+
+  detail::endpoint *
+  get (const char *what) const
+  {
+    if (!ep_) {
+      detail::throw_errno (EBADF, what);
+    }
+    return ep_.get ();
+  }
+
+  void
+  reset () noexcept
+  {
+    if (ep_) {
+      ep_->ex->abandon (ep_.release ());
+    }
+  }
+
+  std::unique_ptr<detail::endpoint> ep_;
+};
+
+namespace detail
+{
+
+/**
+ * The awaitable side of an operation that waits in one of the two slots
+ * of its endpoint. The executor keeps a pointer to it while it waits, so
+ * it must not move.
+ */
+template <operation *endpoint::*Slot>
+struct waiting : operation
+{
+  endpoint *ep;
+
+  explicit waiting (endpoint *ep) noexcept : ep (ep)
+  {
+  }
+
+  waiting (const waiting &) = delete;
+
+  bool
+  await_ready ()
+  {
+    if (ep->*Slot) {
+      throw_errno (EBUSY, "microtcp socket");
+    }
+    return attempt ();
+  }
+
+  void
+  await_suspend (std::coroutine_handle<> h)
+  {
+    ep->ex->wait (ep, &(ep->*Slot), this, h);
+  }
+};
+
+struct connect_op : waiting<&endpoint::out>
+{
+  socket sock;
+
+  explicit connect_op (socket &&s) noexcept
+      : waiting (s.ep_.get ()), sock (std::move (s))
+  {
+    events = MICROTCP_POLLOUT;
+  }
+
+  bool
+  attempt () override
+  {
+    switch (ep->sock.state)
+      {
+      case HANDSHAKE:
+        return false;
+      case ESTABLISHED:
+      case CLOSING_BY_PEER:
+        return true;
+      default:
+        /* The peer never answered */
+        error = ETIMEDOUT;
+        return true;
+      }
+  }
+
+  socket
+  await_resume ()
+  {
+    if (error) {
+      throw_errno (error, "microtcp_connect");
+    }
+    return std::move (sock);
+  }
+};
+
+struct accept_op : waiting<&endpoint::in>
+{
+  std::unique_ptr<endpoint> conn;
+  struct sockaddr *address;
+  socklen_t address_len;
+
+  accept_op (endpoint *ep, struct sockaddr *address, socklen_t address_len)
+      : waiting (ep), conn (new endpoint), address (address),
+        address_len (address_len)
+  {
+    events = MICROTCP_POLLACCEPT;
+  }
+
+  bool
+  attempt () override
+  {
+    if (microtcp_accept_conn (&ep->sock, &conn->sock, address,
+                              address_len) == 0) {
+      conn->ex = ep->ex;
+      conn->listener = ep;
+      ep->conns++;
+      if (ep->ex->add (conn.get ())) {
+        error = errno;
+      }
+      return true;
+    }
+    if (errno == EAGAIN) {
+      return false;
+    }
+    error = errno;
+    return true;
+  }
+
+  socket
+  await_resume ()
+  {
+    socket s;
+
+    /* A connection that failed to join the poller closes with s */
+    if (conn->ex) {
+      s = socket (std::move (conn));
+    }
+    if (error) {
+      throw_errno (error, "microtcp_accept_conn");
+    }
+    return s;
+  }
+};
+
+struct recv_op : waiting<&endpoint::in>
+{
+  void *buffer;
+  size_t length;
+  int flags;
+  size_t result = 0;
+
+  recv_op (endpoint *ep, void *buffer, size_t length, int flags) noexcept
+      : waiting (ep), buffer (buffer), length (length), flags (flags)
+  {
+    events = MICROTCP_POLLIN;
+  }
+
+  bool
+  attempt () override
+  {
+    ssize_t ret;
+
+    /* A socket that is not connected fails without telling why */
+    errno = ENOTCONN;
+    ret = microtcp_recv (&ep->sock, buffer, length, flags);
+    if (ret >= 0) {
+      result = ret;
+      return true;
+    }
+    if (errno == EAGAIN) {
+      return false;
+    }
+    error = errno;
+    return true;
+  }
+
+  size_t
+  await_resume ()
+  {
+    if (error) {
+      throw_errno (error, "microtcp_recv");
+    }
+    return result;
+  }
+};
+
+struct send_op : waiting<&endpoint::out>
+{
+  const uint8_t *buffer;
+  size_t length;
+  int flags;
+  size_t done = 0;
+
+  send_op (endpoint *ep, const void *buffer, size_t length,
+           int flags) noexcept
+      : waiting (ep), buffer (static_cast<const uint8_t *> (buffer)),
+        length (length), flags (flags)
+  {
+    events = MICROTCP_POLLOUT;
+  }
+
+  bool
+  attempt () override
+  {
+    ssize_t ret;
+
+    while (done < length) {
+      errno = EPIPE;
+      ret = microtcp_send (&ep->sock, buffer + done, length - done, flags);
+      if (ret > 0) {
+        done += ret;
+        continue;
+      }
+      if (ret == -1 && errno == EAGAIN) {
+        return false;
+      }
+      error = ret == -1 ? errno : EPIPE;
+      return true;
+    }
+    return true;
+  }
+
+  size_t
+  await_resume ()
+  {
+    if (error) {
+      throw_errno (error, "microtcp_send");
+    }
+    return done;
+  }
+};
+
+struct close_op : waiting<&endpoint::in>
+{
+  socket *owner;                /**< NULL once the socket object is gone */
+
+  close_op (endpoint *ep, socket *owner) noexcept
+      : waiting (ep), owner (owner)
+  {
+  }
+
+  bool
+  attempt () override
+  {
+    /* The last connection to close retries */
+    if (ep->conns) {
+      events = 0;
+      return false;
+    }
+    /* The handshake timers must be over before the socket is freed */
+    if (ep->sock.state == HANDSHAKE) {
+      events = MICROTCP_POLLOUT;
+      return false;
+    }
+    if (ep->sock.state == CLOSED && !ep->sock.closing) {
+      return true;
+    }
+    if (microtcp_shutdown (&ep->sock, 0) == 0) {
+      return true;
+    }
+    if (errno == EAGAIN) {
+      events = 0;
+      return false;
+    }
+    error = errno;
+    return true;
+  }
+
+  void
+  await_resume ()
+  {
+    executor *ex = ep->ex;
+
+    owner->ep_.release ();
+    ex->release (ep);
+    if (error) {
+      throw_errno (error, "microtcp_shutdown");
+    }
+  }
+};
+
+inline void
+task_done (executor *ex, std::exception_ptr error) noexcept
+{
+  ex->tasks_--;
+  if (error && !ex->error_) {
+    ex->error_ = std::move (error);
+  }
+}
+
+} /* namespace detail */
+
+inline
+executor::~executor ()
+{
+  while (orphans_ && poll () == 0) {
+  }
+  microtcp_poller_destroy (poller_);
+}
+
+inline void
+executor::run ()
+{
+  std::coroutine_handle<> h;
+
+  while (1) {
+    while (!ready_.empty ()) {
+      h = ready_.front ();
+      ready_.pop_front ();
+      h.resume ();
+    }
+    if (error_) {
+      std::rethrow_exception (std::exchange (error_, nullptr));
+    }
+    if (!tasks_ && !orphans_) {
+      return;
+    }
+    if (poll ()) {
+      detail::throw_errno (errno, "microtcp_poll");
+    }
+  }
+}
+
+inline int
+executor::poll ()
+{
+  microtcp_poll_event_t events[64];
+  int n;
+  int i;
+
+  n = microtcp_poll (poller_, events, 64, -1);
+  if (n == -1) {
+    return errno == EINTR ? 0 : -1;
+  }
+  for (i = 0; i < n; i++) {
+    dispatch (static_cast<detail::endpoint *> (events[i].data),
+              events[i].events);
+  }
+  return 0;
+}
+
+inline int
+executor::add (detail::endpoint *ep)
+{
+  return microtcp_poller_add (poller_, &ep->sock, 0, ep);
+}
+
+/**
+ * Watches the socket for what its operations wait for
+ */
+inline void
+executor::watch (detail::endpoint *ep)
+{
+  unsigned int events = 0;
+
+  if (ep->in) {
+    events |= ep->in->events;
+  }
+  if (ep->out) {
+    events |= ep->out->events;
+  }
+  if (ep->sock.poller && events != ep->sock.poll_events) {
+    microtcp_poller_mod (poller_, &ep->sock, events, ep);
+  }
+}
+
+inline void
+executor::wait (detail::endpoint *ep, detail::operation **slot,
+                detail::operation *op, std::coroutine_handle<> h)
+{
+  op->waiter = h;
+  *slot = op;
+  watch (ep);
+}
+
+/**
+ * Retries the operations of a socket that may complete with the events,
+ * ~0 for all of them
+ */
+inline void
+executor::dispatch (detail::endpoint *ep, unsigned int events)
+{
+  detail::operation **slots[] = { &ep->in, &ep->out };
+  detail::operation *op;
+
+  for (detail::operation **slot : slots) {
+    op = *slot;
+    if (!op || !(events & (op->events | MICROTCP_POLLHUP))
+        || !op->attempt ()) {
+      continue;
+    }
+    *slot = nullptr;
+    if (!op->waiter) {
+      /* The close of a socket that was dropped is over */
+      delete op;
+      orphans_--;
+      release (ep);
+      return;
+    }
+    ready_.push_back (op->waiter);
+  }
+  watch (ep);
+}
+
+/**
+ * Frees a socket that is closed, or was never connected
+ */
+inline void
+executor::release (detail::endpoint *ep)
+{
+  detail::endpoint *listener = ep->listener;
+
+  if (ep->sock.poller) {
+    microtcp_poller_del (poller_, &ep->sock);
+  }
+  /* The connections share the UDP socket of the listener */
+  if (!listener) {
+    ::close (ep->sock.sd);
+  }
+  delete ep;
+  if (listener && --listener->conns == 0 && listener->in) {
+    dispatch (listener, ~0u);
+  }
+}
+
+/**
+ * Takes over the close of a socket whose object is gone
+ */
+inline void
+executor::abandon (detail::endpoint *ep)
+{
+  detail::close_op *op = new detail::close_op (ep, nullptr);
+
+  /* The coroutines that waited on it are gone as well */
+  ep->in = nullptr;
+  ep->out = nullptr;
+  if (op->attempt ()) {
+    delete op;
+    release (ep);
+    return;
+  }
+  ep->in = op;
+  orphans_++;
+  watch (ep);
+}
+
+inline socket
+socket::listen (executor &ex, const struct sockaddr *address,
+                socklen_t address_len, int backlog)
+{
+  socket s (ex, address->sa_family);
+  int on = 1;
+
+  if (microtcp_setsockopt (&s.ep_->sock, MICROTCP_SO_NONBLOCK, &on,
+                           sizeof(on))) {
+    detail::throw_errno (errno, "microtcp_setsockopt");
+  }
+  if (microtcp_bind (&s.ep_->sock, address, address_len)) {
+    detail::throw_errno (errno, "microtcp_bind");
+  }
+  if (microtcp_listen (&s.ep_->sock, backlog)) {
+    detail::throw_errno (errno, "microtcp_listen");
+  }
+  if (ex.add (s.ep_.get ())) {
+    detail::throw_errno (errno, "microtcp_poller_add");
+  }
+  return s;
+}
+
+inline detail::connect_op
+socket::connect (executor &ex, const struct sockaddr *address,
+                 socklen_t address_len)
+{
+  socket s (ex, address->sa_family);
+  int on = 1;
+
+  if (microtcp_setsockopt (&s.ep_->sock, MICROTCP_SO_NONBLOCK, &on,
+                           sizeof(on))) {
+    detail::throw_errno (errno, "microtcp_setsockopt");
+  }
+  if (microtcp_connect (&s.ep_->sock, address, address_len)
+      && errno != EINPROGRESS) {
+    detail::throw_errno (errno, "microtcp_connect");
+  }
+  if (ex.add (s.ep_.get ())) {
+    detail::throw_errno (errno, "microtcp_poller_add");
+  }
+  return detail::connect_op (std::move (s));
+}
+
+inline detail::accept_op
+socket::accept (struct sockaddr *address, socklen_t address_len)
+{
+  return detail::accept_op (get ("microtcp_accept_conn"), address,
+                            address_len);
+}
+
+inline detail::recv_op
+socket::recv (void *buffer, size_t length, int flags)
+{
+  return detail::recv_op (get ("microtcp_recv"), buffer, length, flags);
+}
+
+template <std::ranges::contiguous_range Buffer>
+inline detail::recv_op
+socket::recv (Buffer &buffer)
+{
+  return recv (std::ranges::data (buffer),
+               std::ranges::size (buffer)
+                   * sizeof(std::ranges::range_value_t<Buffer>));
+}
+
+inline detail::send_op
+socket::send (const void *buffer, size_t length, int flags)
+{
+  return detail::send_op (get ("microtcp_send"), buffer, length, flags);
+}
+
+template <std::ranges::contiguous_range Buffer>
+inline detail::send_op
+socket::send (const Buffer &buffer)
+{
+  return send (std::ranges::data (buffer),
+               std::ranges::size (buffer)
+                   * sizeof(std::ranges::range_value_t<Buffer>));
+}
+
+inline detail::close_op
+socket::close ()
+{
+  return detail::close_op (get ("microtcp_shutdown"), this);
+}
+
+} /* namespace microtcp */
+
+#endif /* LIB_MICROTCP_HPP_ */
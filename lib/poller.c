@@ -0,0 +1,621 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * microtcp_poll(): the UDP sockets are registered with epoll, once for all
+ * the connections that share one, and each watched socket that may have
+ * become ready waits in an intrusive ready list. Only that list is
+ * scanned, so a call costs the ready sockets, not the watched ones.
+ *
+ * With io_uring, the UDP sockets of the non-blocking sockets go to the
+ * ring instead, and epoll keeps the others. The ring watches the epoll
+ * instance, so a wait is a single io_uring_enter() either way.
+ *
+ * The asynchronous requests wait in queues of their sockets, and they
+ * make progress when the ready list finds their socket ready.
+ */
+
+#include "poller.h"
+#include "uring.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* UDP sockets taken from epoll per epoll_wait() */
+#define MICROTCP_POLL_BATCH 64
+
+struct microtcp_poller
+{
+  int epfd;
+  int epoll_more;               /**< The last epoll_wait() was cut short */
+  struct microtcp_uring *uring; /**< NULL if the kernel has no io_uring */
+  microtcp_timer_wheel_t *wheel; /**< Of the thread, taken from the first
+                                     socket added */
+  microtcp_sock_t *ready_head;
+  microtcp_sock_t *ready_tail;
+  size_t ready_count;
+
+  microtcp_completion_t *cq;    /**< Ring of the completions not reaped */
+  size_t cq_len;
+  size_t cq_head;
+  size_t cq_count;
+};
+
+/**
+ * A request of microtcp_send_async() or microtcp_recv_async()
+ */
+struct microtcp_async
+{
+  struct microtcp_async *next;
+  uint8_t *buffer;
+  size_t length;
+  size_t done;                  /**< Bytes the send buffer has taken */
+  int flags;
+  void *user_data;
+};
+
+static uint64_t
+microtcp_poller_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * @return the socket that owns the UDP socket of this one
+ */
+static microtcp_sock_t *
+microtcp_poller_root (microtcp_sock_t *socket)
+{
+  return socket->listener ? socket->listener : socket;
+}
+
+static void
+microtcp_poller_unlink (microtcp_poller_t *poller, microtcp_sock_t *socket)
+{
+  if (socket->poll_prev) {
+    socket->poll_prev->poll_next = socket->poll_next;
+  }
+  else {
+    poller->ready_head = socket->poll_next;
+  }
+  if (socket->poll_next) {
+    socket->poll_next->poll_prev = socket->poll_prev;
+  }
+  else {
+    poller->ready_tail = socket->poll_prev;
+  }
+  socket->poll_prev = NULL;
+  socket->poll_next = NULL;
+  socket->poll_queued = 0;
+  poller->ready_count--;
+}
+
+void
+microtcp_poller_touch (microtcp_sock_t *socket)
+{
+  microtcp_poller_t *poller = socket->poller;
+
+  if (!poller || socket->poll_queued) {
+    return;
+  }
+  socket->poll_prev = poller->ready_tail;
+  socket->poll_next = NULL;
+  if (poller->ready_tail) {
+    poller->ready_tail->poll_next = socket;
+  }
+  else {
+    poller->ready_head = socket;
+  }
+  poller->ready_tail = socket;
+  socket->poll_queued = 1;
+  poller->ready_count++;
+}
+
+/**
+ * @return the MICROTCP_POLL* events the socket is ready for
+ */
+static unsigned int
+microtcp_poller_events (const microtcp_sock_t *socket)
+{
+  unsigned int events = 0;
+
+  /* A closing socket has nothing to offer until the close is over */
+  if (socket->closing && socket->state != CLOSED) {
+    return 0;
+  }
+  switch (socket->state)
+    {
+    case LISTEN:
+      if (socket->accept_count) {
+        events |= MICROTCP_POLLACCEPT;
+      }
+      break;
+    case ESTABLISHED:
+    case CLOSING_BY_PEER:
+      if (socket->state == CLOSING_BY_PEER) {
+        events |= MICROTCP_POLLIN | MICROTCP_POLLHUP;
+      }
+      if (!socket->sndbuf
+          || (uint32_t) (socket->snd_end - socket->snd_una)
+              < socket->sndbuf_len) {
+        events |= MICROTCP_POLLOUT;
+      }
+      if (socket->buf_fill_level) {
+        events |= MICROTCP_POLLIN;
+      }
+      break;
+    case CLOSING_BY_HOST:
+      if (socket->buf_fill_level) {
+        events |= MICROTCP_POLLIN;
+      }
+      break;
+    case HANDSHAKE:
+      break;
+    default:
+      events |= MICROTCP_POLLHUP;
+      break;
+    }
+  return events;
+}
+
+/**
+ * Completes a request and frees it
+ *
+ * @return 0 on success, -1 if the completion queue cannot grow
+ */
+static int
+microtcp_poller_complete (microtcp_poller_t *poller, microtcp_sock_t *socket,
+                          struct microtcp_async *req, int op, ssize_t res)
+{
+  microtcp_completion_t *cq;
+  size_t len;
+  size_t i;
+
+  if (poller->cq_count == poller->cq_len) {
+    len = poller->cq_len ? poller->cq_len * 2 : 64;
+    cq = malloc (len * sizeof(microtcp_completion_t));
+    if (!cq) {
+      return -1;
+    }
+    for (i = 0; i < poller->cq_count; i++) {
+      cq[i] = poller->cq[(poller->cq_head + i) % poller->cq_len];
+    }
+    free (poller->cq);
+    poller->cq = cq;
+    poller->cq_len = len;
+    poller->cq_head = 0;
+  }
+  cq = &poller->cq[(poller->cq_head + poller->cq_count) % poller->cq_len];
+  cq->socket = socket;
+  cq->user_data = req->user_data;
+  cq->op = op;
+  cq->res = res;
+  poller->cq_count++;
+  free (req);
+  return 0;
+}
+
+/**
+ * Moves the requests of a socket forward as far as it is ready
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_poller_progress (microtcp_poller_t *poller, microtcp_sock_t *socket)
+{
+  unsigned int ready = microtcp_poller_events (socket);
+  struct microtcp_async *req;
+  ssize_t ret;
+
+  while ((req = socket->recv_head)
+      && (ready & (MICROTCP_POLLIN | MICROTCP_POLLHUP))) {
+    /* A socket that is not connected fails without telling why */
+    errno = ENOTCONN;
+    ret = microtcp_recv (socket, req->buffer, req->length, req->flags);
+    if (ret == -1 && errno == EAGAIN) {
+      break;
+    }
+    socket->recv_head = req->next;
+    if (microtcp_poller_complete (poller, socket, req, MICROTCP_OP_RECV,
+                                  ret == -1 ? -errno : ret)) {
+      return -1;
+    }
+  }
+
+  while ((req = socket->send_head)
+      && (ready & (MICROTCP_POLLOUT | MICROTCP_POLLHUP))) {
+    errno = EPIPE;
+    ret = microtcp_send (socket, req->buffer + req->done,
+                         req->length - req->done, req->flags);
+    if (ret > 0) {
+      req->done += ret;
+      if (req->done < req->length) {
+        continue;
+      }
+      ret = req->done;
+    }
+    else if (ret == -1 && errno == EAGAIN) {
+      break;
+    }
+    socket->send_head = req->next;
+    if (microtcp_poller_complete (poller, socket, req, MICROTCP_OP_SEND,
+                                  ret == -1 ? -errno : ret)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Moves the sockets of the ready list that are ready to the events, and
+ * to the end of the list, where they are checked again by the next call.
+ * The others leave the list until they are touched again. The requests of
+ * the visited sockets make progress on the way.
+ *
+ * @param events NULL to only move the requests forward
+ * @return the number of events stored, -1 on failure
+ */
+static int
+microtcp_poller_collect (microtcp_poller_t *poller,
+                         microtcp_poll_event_t *events, int maxevents)
+{
+  microtcp_sock_t *socket;
+  size_t visit = poller->ready_count;
+  unsigned int ready;
+  int n = 0;
+
+  while (visit--) {
+    socket = poller->ready_head;
+    microtcp_poller_unlink (poller, socket);
+    if ((socket->send_head || socket->recv_head)
+        && microtcp_poller_progress (poller, socket)) {
+      return -1;
+    }
+    ready = microtcp_poller_events (socket)
+        & (socket->poll_events | MICROTCP_POLLHUP);
+    if (!ready) {
+      continue;
+    }
+    if (events && n < maxevents) {
+      events[n].socket = socket;
+      events[n].events = ready;
+      events[n].data = socket->poll_data;
+      n++;
+    }
+    microtcp_poller_touch (socket);
+  }
+  return n;
+}
+
+microtcp_poller_t *
+microtcp_poller_create (void)
+{
+  microtcp_poller_t *poller = calloc (1, sizeof(microtcp_poller_t));
+
+  if (!poller) {
+    return NULL;
+  }
+  poller->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (poller->epfd == -1) {
+    perror ("EPOLL CREATE");
+    free (poller);
+    return NULL;
+  }
+  poller->uring = microtcp_uring_create ();
+  if (poller->uring) {
+    microtcp_uring_watch (poller->uring, poller->epfd);
+  }
+  return poller;
+}
+
+void
+microtcp_poller_destroy (microtcp_poller_t *poller)
+{
+  if (poller->uring) {
+    microtcp_uring_destroy (poller->uring);
+  }
+  close (poller->epfd);
+  free (poller->cq);
+  free (poller);
+}
+
+int
+microtcp_poller_add (microtcp_poller_t *poller, microtcp_sock_t *socket,
+                     unsigned int events, void *data)
+{
+  microtcp_sock_t *root = microtcp_poller_root (socket);
+  struct epoll_event ev;
+
+  if (socket->poller) {
+    errno = EEXIST;
+    return -1;
+  }
+  /* A blocking call must find its input in the UDP socket */
+  if (root->poll_users == 0 && poller->uring && root->nonblock
+      && !root->gro_enabled) {
+    if (microtcp_uring_add (poller->uring, root)) {
+      return -1;
+    }
+  }
+  else if (root->poll_users == 0) {
+    ev.events = EPOLLIN;
+    ev.data.ptr = root;
+    if (epoll_ctl (poller->epfd, EPOLL_CTL_ADD, root->sd, &ev) == -1) {
+      perror ("EPOLL ADD");
+      return -1;
+    }
+  }
+  root->poll_users++;
+  poller->wheel = socket->wheel;
+  socket->poller = poller;
+  socket->poll_events = events;
+  socket->poll_data = data;
+  /* Whatever it is ready for already is reported by the next call */
+  microtcp_poller_touch (socket);
+  return 0;
+}
+
+int
+microtcp_poller_mod (microtcp_poller_t *poller, microtcp_sock_t *socket,
+                     unsigned int events, void *data)
+{
+  if (socket->poller != poller) {
+    errno = ENOENT;
+    return -1;
+  }
+  socket->poll_events = events;
+  socket->poll_data = data;
+  microtcp_poller_touch (socket);
+  return 0;
+}
+
+int
+microtcp_poller_del (microtcp_poller_t *poller, microtcp_sock_t *socket)
+{
+  microtcp_sock_t *root = microtcp_poller_root (socket);
+  struct microtcp_async *req;
+
+  if (socket->poller != poller) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (socket->poll_queued) {
+    microtcp_poller_unlink (poller, socket);
+  }
+  socket->poller = NULL;
+  while ((req = socket->recv_head)) {
+    socket->recv_head = req->next;
+    microtcp_poller_complete (poller, socket, req, MICROTCP_OP_RECV,
+                              -ECANCELED);
+  }
+  while ((req = socket->send_head)) {
+    socket->send_head = req->next;
+    microtcp_poller_complete (poller, socket, req, MICROTCP_OP_SEND,
+                              -ECANCELED);
+  }
+
+  if (--root->poll_users) {
+    return 0;
+  }
+  if (root->uring) {
+    microtcp_uring_del (root->uring, root);
+  }
+  else if (epoll_ctl (poller->epfd, EPOLL_CTL_DEL, root->sd, NULL) == -1) {
+    perror ("EPOLL DEL");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Processes the input that arrives within the timeout, and then the
+ * timers.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_poller_wait (microtcp_poller_t *poller, int timeout)
+{
+  struct epoll_event ready[MICROTCP_POLL_BATCH];
+  microtcp_sock_t *roots[MICROTCP_POLL_BATCH];
+  int watched = 1;
+  int n;
+  int i;
+
+  if (poller->uring) {
+    if (microtcp_uring_wait (poller->uring,
+                             poller->epoll_more ? 0 : timeout, &watched)) {
+      return -1;
+    }
+    while ((n = microtcp_uring_ready (poller->uring, roots,
+                                      MICROTCP_POLL_BATCH)) > 0) {
+      for (i = 0; i < n; i++) {
+        if (microtcp_drain (roots[i])) {
+          return -1;
+        }
+      }
+    }
+    timeout = 0;
+  }
+
+  /* Without a ring, or with some UDP socket of epoll readable */
+  if (watched || poller->epoll_more) {
+    n = epoll_wait (poller->epfd, ready, MICROTCP_POLL_BATCH, timeout);
+    if (n == -1 && errno != EINTR) {
+      perror ("EPOLL WAIT");
+      return -1;
+    }
+    poller->epoll_more = n == MICROTCP_POLL_BATCH;
+    for (i = 0; i < n; i++) {
+      if (microtcp_drain (ready[i].data.ptr)) {
+        return -1;
+      }
+    }
+  }
+  if (poller->wheel) {
+    microtcp_timer_wheel_advance (poller->wheel, microtcp_poller_now_us ());
+  }
+  return 0;
+}
+
+/**
+ * Processes input and timers until some socket is ready, or with events
+ * NULL until some request completes, or until the timeout.
+ *
+ * @return the number of events stored, -1 on failure
+ */
+static int
+microtcp_poller_run (microtcp_poller_t *poller, microtcp_poll_event_t *events,
+                     int maxevents, int timeout_ms)
+{
+  uint64_t deadline = UINT64_MAX;
+  uint64_t wake;
+  uint64_t now;
+  int timeout;
+  int n;
+
+  if (timeout_ms >= 0) {
+    deadline = microtcp_poller_now_us () + (uint64_t) timeout_ms * 1000;
+  }
+
+  /* The input that is there goes first, even if some sockets are ready */
+  timeout = 0;
+  while (1) {
+    if (microtcp_poller_wait (poller, timeout)) {
+      return -1;
+    }
+    n = microtcp_poller_collect (poller, events, maxevents);
+    now = microtcp_poller_now_us ();
+    if (n || (!events && poller->cq_count) || now >= deadline) {
+      break;
+    }
+
+    /* Wake up for the next timer as well, it may retransmit or give up */
+    wake = deadline;
+    if (poller->wheel
+        && microtcp_timer_wheel_next (poller->wheel) < wake) {
+      wake = microtcp_timer_wheel_next (poller->wheel);
+    }
+    timeout = -1;
+    if (wake != UINT64_MAX) {
+      timeout = wake > now ? (wake - now + 999) / 1000 : 0;
+    }
+  }
+
+  /* What the sockets queued on the way leaves now, not with the next call */
+  if (n != -1 && poller->uring && microtcp_uring_submit (poller->uring)) {
+    return -1;
+  }
+  return n;
+}
+
+int
+microtcp_poll (microtcp_poller_t *poller, microtcp_poll_event_t *events,
+               int maxevents, int timeout_ms)
+{
+  if (maxevents <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return microtcp_poller_run (poller, events, maxevents, timeout_ms);
+}
+
+/**
+ * Queues a request on a socket, whose poller takes it from there
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int
+microtcp_async_queue (microtcp_sock_t *socket, struct microtcp_async **head,
+                      struct microtcp_async **tail, const void *buffer,
+                      size_t length, int flags, void *user_data)
+{
+  struct microtcp_async *req;
+
+  if (!socket->poller) {
+    errno = EINVAL;
+    return -1;
+  }
+  req = malloc (sizeof(struct microtcp_async));
+  if (!req) {
+    return -1;
+  }
+  req->next = NULL;
+  req->buffer = (uint8_t *) buffer;
+  req->length = length;
+  req->done = 0;
+  req->flags = flags;
+  req->user_data = user_data;
+  if (*head) {
+    (*tail)->next = req;
+  }
+  else {
+    *head = req;
+  }
+  *tail = req;
+  microtcp_poller_touch (socket);
+  return 0;
+}
+
+int
+microtcp_send_async (microtcp_sock_t *socket, const void *buffer,
+                     size_t length, int flags, void *user_data)
+{
+  return microtcp_async_queue (socket, &socket->send_head, &socket->send_tail,
+                               buffer, length, flags, user_data);
+}
+
+int
+microtcp_recv_async (microtcp_sock_t *socket, void *buffer, size_t length,
+                     int flags, void *user_data)
+{
+  return microtcp_async_queue (socket, &socket->recv_head, &socket->recv_tail,
+                               buffer, length, flags, user_data);
+}
+
+int
+microtcp_wait_completions (microtcp_poller_t *poller,
+                           microtcp_completion_t *completions, int max,
+                           int timeout_ms)
+{
+  int n = 0;
+
+  if (max <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!poller->cq_count
+      && microtcp_poller_run (poller, NULL, 0, timeout_ms) == -1) {
+    return -1;
+  }
+  while (n < max && poller->cq_count) {
+    completions[n++] = poller->cq[poller->cq_head];
+    poller->cq_head = (poller->cq_head + 1) % poller->cq_len;
+    poller->cq_count--;
+  }
+  return n;
+}
@@ -0,0 +1,48 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_POLLER_H_
+#define LIB_POLLER_H_
+
+#include "microtcp.h"
+
+/*
+ * The glue between the sockets and microtcp_poll(). The sockets tell their
+ * poller whenever their readiness may have changed, and the poller has
+ * them process the input of the UDP sockets that epoll found readable.
+ */
+
+/**
+ * Queues a watched socket, so that the next microtcp_poll() checks its
+ * readiness. Does nothing for a socket without a poller.
+ */
+void
+microtcp_poller_touch (microtcp_sock_t *socket);
+
+/**
+ * Processes the segments queued on the UDP socket of a socket without
+ * blocking, each for the connection it belongs to. Defined in microtcp.c.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_drain (microtcp_sock_t *socket);
+
+#endif /* LIB_POLLER_H_ */
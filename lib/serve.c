@@ -0,0 +1,192 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * microtcp_serve(): a listener per worker thread on SO_REUSEPORT sockets.
+ * The timers of a socket live in the wheel of the thread that created it,
+ * so every worker creates its own. The workers start one at a time, so that
+ * an ephemeral port picked by the first one reaches the rest, and none of
+ * them serves before all are bound.
+ */
+
+#define _GNU_SOURCE
+#include "microtcp.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+
+struct microtcp_serve_worker
+{
+  pthread_t thread;
+  int index;
+  int cpu;                      /**< -1 to leave it unpinned */
+  struct microtcp_serve_shared *shared;
+};
+
+struct microtcp_serve_shared
+{
+  const microtcp_serve_conf_t *conf;
+  struct sockaddr_storage addr; /**< With the port of the first worker */
+  socklen_t addr_len;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int bound;                    /**< Workers that are listening */
+  int failed;                   /**< A worker could not be set up */
+  int go;                       /**< Every worker is bound, or failed */
+};
+
+/**
+ * @return 0 if the socket listens on the address, -1 otherwise
+ */
+static int
+microtcp_serve_bind (struct microtcp_serve_worker *w, microtcp_sock_t *sock)
+{
+  struct microtcp_serve_shared *shared = w->shared;
+  const microtcp_serve_conf_t *conf = shared->conf;
+  socklen_t len = shared->addr_len;
+  int on = 1;
+
+  if (microtcp_setsockopt (sock, MICROTCP_SO_REUSEPORT, &on, sizeof(int))) {
+    perror ("SO_REUSEPORT");
+    return -1;
+  }
+  if (conf->setup && conf->setup (sock, w->index, conf->arg)) {
+    return -1;
+  }
+  if (microtcp_bind (sock, (struct sockaddr *) &shared->addr, len)
+      || microtcp_listen (sock, conf->backlog)) {
+    return -1;
+  }
+  /* The others bind the port this one got */
+  return getsockname (sock->sd, (struct sockaddr *) &shared->addr, &len);
+}
+
+static void *
+microtcp_serve_run (void *arg)
+{
+  struct microtcp_serve_worker *w = arg;
+  struct microtcp_serve_shared *shared = w->shared;
+  microtcp_sock_t sock;
+  cpu_set_t set;
+  int ok;
+
+  if (w->cpu >= 0) {
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    /* Not fatal, the worker just runs wherever the scheduler puts it */
+    pthread_setaffinity_np (pthread_self (), sizeof(cpu_set_t), &set);
+  }
+
+  sock = microtcp_socket (shared->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+  ok = microtcp_serve_bind (w, &sock) == 0;
+
+  pthread_mutex_lock (&shared->lock);
+  if (ok) {
+    shared->bound++;
+  }
+  else {
+    shared->failed = 1;
+  }
+  pthread_cond_broadcast (&shared->cond);
+  while (!shared->go) {
+    pthread_cond_wait (&shared->cond, &shared->lock);
+  }
+  ok = ok && !shared->failed;
+  pthread_mutex_unlock (&shared->lock);
+
+  if (ok) {
+    shared->conf->serve (&sock, w->index, shared->conf->arg);
+  }
+  microtcp_shutdown (&sock, SHUT_RDWR);
+  close (sock.sd);
+  return NULL;
+}
+
+int
+microtcp_serve (const struct sockaddr *address, socklen_t address_len,
+                const microtcp_serve_conf_t *conf)
+{
+  struct microtcp_serve_shared shared;
+  struct microtcp_serve_worker *workers;
+  cpu_set_t allowed;
+  int cpus[CPU_SETSIZE];
+  int ncpus = 0;
+  int nworkers = conf->workers;
+  int started;
+  int i;
+
+  if (address_len > sizeof(struct sockaddr_storage) || !conf->serve) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (sched_getaffinity (0, sizeof(cpu_set_t), &allowed) == 0) {
+    for (i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &allowed)) {
+        cpus[ncpus++] = i;
+      }
+    }
+  }
+  if (nworkers <= 0) {
+    nworkers = ncpus > 0 ? ncpus : 1;
+  }
+  workers = calloc (nworkers, sizeof(struct microtcp_serve_worker));
+  if (!workers) {
+    return -1;
+  }
+
+  memset (&shared, 0, sizeof(shared));
+  shared.conf = conf;
+  memcpy (&shared.addr, address, address_len);
+  shared.addr_len = address_len;
+  pthread_mutex_init (&shared.lock, NULL);
+  pthread_cond_init (&shared.cond, NULL);
+
+  pthread_mutex_lock (&shared.lock);
+  for (started = 0; started < nworkers && !shared.failed; started++) {
+    workers[started].index = started;
+    workers[started].cpu = conf->pin && started < ncpus ? cpus[started] : -1;
+    workers[started].shared = &shared;
+    if (pthread_create (&workers[started].thread, NULL, microtcp_serve_run,
+                        &workers[started])) {
+      perror ("START WORKER");
+      shared.failed = 1;
+      break;
+    }
+    while (shared.bound + shared.failed == started) {
+      pthread_cond_wait (&shared.cond, &shared.lock);
+    }
+  }
+  shared.go = 1;
+  pthread_cond_broadcast (&shared.cond);
+  pthread_mutex_unlock (&shared.lock);
+
+  for (i = 0; i < started; i++) {
+    pthread_join (workers[i].thread, NULL);
+  }
+  pthread_cond_destroy (&shared.cond);
+  pthread_mutex_destroy (&shared.lock);
+  free (workers);
+  return shared.failed ? -1 : 0;
+}
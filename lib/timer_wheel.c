@@ -0,0 +1,189 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timer_wheel.h"
+#include <string.h>
+
+#define SLOT_MASK (MICROTCP_WHEEL_SLOTS - 1)
+
+static void
+slot_set (microtcp_timer_wheel_t *wheel, size_t slot)
+{
+  wheel->occupied[slot / 64] |= (uint64_t) 1 << (slot % 64);
+}
+
+static void
+slot_clear (microtcp_timer_wheel_t *wheel, size_t slot)
+{
+  wheel->occupied[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+}
+
+static int
+slot_busy (const microtcp_timer_wheel_t *wheel, size_t slot)
+{
+  return (wheel->occupied[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void
+unlink_timer (microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer)
+{
+  size_t slot = timer->expires & SLOT_MASK;
+
+  *timer->pprev = timer->next;
+  if (timer->next) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+  wheel->count--;
+  if (!wheel->slots[slot]) {
+    slot_clear (wheel, slot);
+  }
+}
+
+void
+microtcp_timer_wheel_init (microtcp_timer_wheel_t *wheel, uint64_t now_us)
+{
+  memset (wheel, 0, sizeof(microtcp_timer_wheel_t));
+  wheel->now = now_us / MICROTCP_TIMER_TICK_US;
+}
+
+void
+microtcp_timer_init (microtcp_timer_t *timer, microtcp_timer_cb_t cb,
+                     void *arg)
+{
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->cb = cb;
+  timer->arg = arg;
+}
+
+void
+microtcp_timer_arm (microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer,
+                    uint64_t expires_us)
+{
+  /* Round up, a timer must never fire early */
+  uint64_t expires = (expires_us + MICROTCP_TIMER_TICK_US - 1)
+      / MICROTCP_TIMER_TICK_US;
+  size_t slot;
+
+  if (timer->pprev) {
+    unlink_timer (wheel, timer);
+  }
+  if (expires <= wheel->now) {
+    expires = wheel->now + 1;
+  }
+  slot = expires & SLOT_MASK;
+  timer->expires = expires;
+  timer->next = wheel->slots[slot];
+  if (timer->next) {
+    timer->next->pprev = &timer->next;
+  }
+  timer->pprev = &wheel->slots[slot];
+  wheel->slots[slot] = timer;
+  wheel->count++;
+  slot_set (wheel, slot);
+}
+
+void
+microtcp_timer_cancel (microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer)
+{
+  if (timer->pprev) {
+    unlink_timer (wheel, timer);
+  }
+}
+
+size_t
+microtcp_timer_wheel_advance (microtcp_timer_wheel_t *wheel, uint64_t now_us)
+{
+  uint64_t now = now_us / MICROTCP_TIMER_TICK_US;
+  uint64_t start = wheel->now;
+  microtcp_timer_t *timer;
+  uint64_t ticks;
+  uint64_t t;
+  size_t fired = 0;
+  size_t slot;
+
+  if (now <= start) {
+    return 0;
+  }
+  ticks = now - start;
+  if (ticks > MICROTCP_WHEEL_SLOTS) {
+    ticks = MICROTCP_WHEEL_SLOTS;
+  }
+  /* Whatever the callbacks arm expires after now */
+  wheel->now = now;
+
+  /*
+   * Each due timer is unlinked right before its callback, which may arm or
+   * cancel any timer, so the slot is searched again from its head after
+   * every callback
+   */
+  for (t = 1; t <= ticks; t++) {
+    slot = (start + t) & SLOT_MASK;
+    if (!slot_busy (wheel, slot)) {
+      continue;
+    }
+    timer = wheel->slots[slot];
+    while (timer) {
+      if (timer->expires > now) {
+        timer = timer->next;
+        continue;
+      }
+      unlink_timer (wheel, timer);
+      fired++;
+      timer->cb (timer, timer->arg);
+      timer = wheel->slots[slot];
+    }
+  }
+  return fired;
+}
+
+uint64_t
+microtcp_timer_wheel_next (const microtcp_timer_wheel_t *wheel)
+{
+  size_t start = (wheel->now + 1) & SLOT_MASK;
+  size_t word;
+  size_t i;
+  uint64_t bits;
+
+  if (wheel->count == 0) {
+    return UINT64_MAX;
+  }
+
+  /* The first non-empty slot after the current tick, wrapping around */
+  for (i = 0; i <= MICROTCP_WHEEL_SLOTS / 64; i++) {
+    word = (start / 64 + i) % (MICROTCP_WHEEL_SLOTS / 64);
+    bits = wheel->occupied[word];
+    if (i == 0) {
+      bits &= ~(uint64_t) 0 << (start % 64);
+    }
+    else if (i == MICROTCP_WHEEL_SLOTS / 64) {
+      bits &= ~(~(uint64_t) 0 << (start % 64));
+    }
+    if (bits) {
+      return (wheel->now + 1
+          + ((word * 64 + __builtin_ctzll (bits) - start) & SLOT_MASK))
+          * MICROTCP_TIMER_TICK_US;
+    }
+  }
+  return UINT64_MAX;
+}
@@ -0,0 +1,111 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_TIMER_WHEEL_H_
+#define LIB_TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A hashed timing wheel (Varghese and Lauck, scheme 6). Each slot covers
+ * one tick and holds the timers whose expiration tick maps to it, whatever
+ * the number of revolutions until they are due. Arming and cancelling
+ * are O(1). Advancing the wheel only visits the slots of the elapsed
+ * ticks, skipping the empty ones through a bitmap.
+ */
+#define MICROTCP_TIMER_TICK_US 1000
+#define MICROTCP_WHEEL_SLOTS 4096   /* Must be a power of two */
+
+typedef struct microtcp_timer microtcp_timer_t;
+
+typedef void
+(*microtcp_timer_cb_t) (microtcp_timer_t *timer, void *arg);
+
+/**
+ * A timer embedded in the structure it belongs to, so arming it never
+ * allocates.
+ */
+struct microtcp_timer
+{
+  microtcp_timer_t *next;
+  microtcp_timer_t **pprev;     /**< NULL while the timer is not armed */
+  uint64_t expires;             /**< Expiration tick */
+  microtcp_timer_cb_t cb;
+  void *arg;
+};
+
+typedef struct
+{
+  uint64_t now;                 /**< Last tick processed */
+  size_t count;                 /**< Armed timers */
+  uint64_t occupied[MICROTCP_WHEEL_SLOTS / 64]; /**< Non-empty slots */
+  microtcp_timer_t *slots[MICROTCP_WHEEL_SLOTS];
+} microtcp_timer_wheel_t;
+
+/**
+ * @param now_us the current time in microseconds
+ */
+void
+microtcp_timer_wheel_init (microtcp_timer_wheel_t *wheel, uint64_t now_us);
+
+void
+microtcp_timer_init (microtcp_timer_t *timer, microtcp_timer_cb_t cb,
+                     void *arg);
+
+static inline int
+microtcp_timer_armed (const microtcp_timer_t *timer)
+{
+  return timer->pprev != NULL;
+}
+
+/**
+ * Arms the timer, or moves it if it is already armed. A timer that is
+ * already due fires at the next advance of the wheel.
+ *
+ * @param expires_us when the timer expires, in microseconds
+ */
+void
+microtcp_timer_arm (microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer,
+                    uint64_t expires_us);
+
+/**
+ * Disarms the timer. Cancelling a timer that is not armed is a no-op.
+ */
+void
+microtcp_timer_cancel (microtcp_timer_wheel_t *wheel, microtcp_timer_t *timer);
+
+/**
+ * Moves the wheel to the current time and calls the callbacks of the
+ * expired timers. Callbacks may arm or cancel any timer.
+ *
+ * @return the number of timers that fired
+ */
+size_t
+microtcp_timer_wheel_advance (microtcp_timer_wheel_t *wheel, uint64_t now_us);
+
+/**
+ * @return a lower bound of the next expiration in microseconds, or
+ * UINT64_MAX if no timer is armed
+ */
+uint64_t
+microtcp_timer_wheel_next (const microtcp_timer_wheel_t *wheel);
+
+#endif /* LIB_TIMER_WHEEL_H_ */
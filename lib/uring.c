@@ -0,0 +1,812 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "uring.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/* Multishot receives and EXT_ARG waits need Linux 6.0 */
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+
+#define MICROTCP_URING_ENTRIES 256
+#define MICROTCP_URING_CQ_ENTRIES 4096
+/* Receive buffers, a power of two */
+#define MICROTCP_URING_BUFS 512
+/* Sends in flight */
+#define MICROTCP_URING_SLOTS 256
+/* Holds a segment, GSO and GRO are left to the sockets outside the ring */
+#define MICROTCP_URING_BUF_LEN 2048
+#define MICROTCP_URING_BGID 0
+
+/* What a completion is for, in the top bits of its user_data */
+#define MICROTCP_URING_RECV 1
+#define MICROTCP_URING_SEND 2
+#define MICROTCP_URING_WATCH 3
+#define MICROTCP_URING_GEN_MASK 0x3fffffff
+#define MICROTCP_URING_TAG(type, gen, idx) \
+  (((uint64_t) (type) << 62) | ((uint64_t) (gen) << 32) | (idx))
+
+/**
+ * A socket whose datagrams the ring receives
+ */
+struct microtcp_uring_root
+{
+  microtcp_sock_t *socket;      /**< NULL if the entry is free */
+  uint32_t gen;                 /**< Tells the completions of the sockets
+                                     that had the entry before */
+  int armed;                    /**< The multishot receive runs */
+  int listed;                   /**< In the ready list */
+  int head;                     /**< Oldest datagram not taken, -1 if
+                                     none */
+  int tail;
+};
+
+/**
+ * A datagram being sent. The kernel may read it until the send completes.
+ */
+struct microtcp_uring_slot
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_storage addr;
+  int next;                     /**< Next free slot */
+  uint8_t buf[MICROTCP_URING_BUF_LEN];
+};
+
+struct microtcp_uring
+{
+  int fd;
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_flags;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sqe_tail;        /**< Prepared, published when submitted */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  struct io_uring_buf_ring *br;
+  size_t br_len;
+  unsigned short br_tail;
+  uint8_t *bufs;
+  int buf_next[MICROTCP_URING_BUFS]; /**< Links the datagrams of a root */
+  struct msghdr recv_msg;       /**< Shape of the received datagrams */
+
+  struct microtcp_uring_root *roots;
+  unsigned int nroots;
+  unsigned int *ready;          /**< Roots with datagrams to take */
+  unsigned int ready_count;
+  int rearm;                    /**< Some multishot receive stopped */
+
+  int watch_fd;
+  int watch_armed;
+  int watched;
+
+  struct microtcp_uring_slot *slots;
+  int free_slot;
+};
+
+static int
+microtcp_uring_enter (struct microtcp_uring *uring, unsigned int min_complete,
+                      int timeout_ms)
+{
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int flags = IORING_ENTER_EXT_ARG;
+  unsigned int submit;
+  int ret;
+
+  __atomic_store_n (uring->sq_tail, uring->sqe_tail, __ATOMIC_RELEASE);
+  submit = uring->sqe_tail - __atomic_load_n (uring->sq_head,
+                                              __ATOMIC_ACQUIRE);
+  memset (&arg, 0, sizeof(arg));
+  if (min_complete) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+  }
+  else if (submit == 0
+      && !(__atomic_load_n (uring->sq_flags, __ATOMIC_ACQUIRE)
+          & IORING_SQ_CQ_OVERFLOW)) {
+    return 0;
+  }
+  else {
+    /* Also moves the completions that overflowed to the ring */
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  ret = syscall (__NR_io_uring_enter, uring->fd, submit, min_complete, flags,
+                 &arg, sizeof(arg));
+  if (ret == -1 && errno != ETIME && errno != EINTR && errno != EBUSY
+      && errno != EAGAIN) {
+    perror ("IO_URING ENTER");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @return a cleared submission queue entry, NULL if the queue stays full
+ */
+static struct io_uring_sqe *
+microtcp_uring_sqe (struct microtcp_uring *uring)
+{
+  struct io_uring_sqe *sqe;
+
+  if (uring->sqe_tail - __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE)
+      == uring->sq_entries) {
+    if (microtcp_uring_enter (uring, 0, 0)) {
+      return NULL;
+    }
+    if (uring->sqe_tail - __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE)
+        == uring->sq_entries) {
+      errno = EBUSY;
+      return NULL;
+    }
+  }
+  sqe = &uring->sqes[uring->sqe_tail & uring->sq_mask];
+  memset (sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sqe_tail++;
+  return sqe;
+}
+
+/**
+ * Gives a receive buffer back to the kernel
+ */
+static void
+microtcp_uring_recycle (struct microtcp_uring *uring, unsigned int bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = &uring->br->bufs[uring->br_tail & (MICROTCP_URING_BUFS - 1)];
+  buf->addr = (uint64_t) (uintptr_t) (uring->bufs
+      + (size_t) bid * MICROTCP_URING_BUF_LEN);
+  buf->len = MICROTCP_URING_BUF_LEN;
+  buf->bid = bid;
+  uring->br_tail++;
+  __atomic_store_n (&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+microtcp_uring_arm (struct microtcp_uring *uring, unsigned int idx)
+{
+  struct microtcp_uring_root *root = &uring->roots[idx];
+  struct io_uring_sqe *sqe = microtcp_uring_sqe (uring);
+
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = root->socket->sd;
+  sqe->addr = (uint64_t) (uintptr_t) &uring->recv_msg;
+  sqe->len = 1;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = MICROTCP_URING_BGID;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = MICROTCP_URING_TAG(MICROTCP_URING_RECV, root->gen, idx);
+  root->armed = 1;
+  return 0;
+}
+
+static void
+microtcp_uring_recv_done (struct microtcp_uring *uring,
+                          const struct io_uring_cqe *cqe)
+{
+  unsigned int idx = cqe->user_data & 0xffffffff;
+  uint32_t gen = (cqe->user_data >> 32) & MICROTCP_URING_GEN_MASK;
+  struct microtcp_uring_root *root = &uring->roots[idx];
+  int current = root->socket && root->gen == gen;
+  unsigned int bid;
+
+  if (current && !(cqe->flags & IORING_CQE_F_MORE)) {
+    /* Out of buffers, or failed. The datagrams wait in the socket. */
+    root->armed = 0;
+    uring->rearm = 1;
+    if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+      errno = -cqe->res;
+      perror ("RECEIVE ERROR");
+    }
+  }
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+  bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  if (!current || cqe->res < 0) {
+    microtcp_uring_recycle (uring, bid);
+    return;
+  }
+  uring->buf_next[bid] = -1;
+  if (root->head == -1) {
+    root->head = bid;
+  }
+  else {
+    uring->buf_next[root->tail] = bid;
+  }
+  root->tail = bid;
+  if (!root->listed) {
+    root->listed = 1;
+    uring->ready[uring->ready_count++] = idx;
+  }
+}
+
+static void
+microtcp_uring_send_done (struct microtcp_uring *uring,
+                          const struct io_uring_cqe *cqe)
+{
+  unsigned int idx = cqe->user_data & 0xffffffff;
+
+  /* A lost datagram is recovered by the retransmissions */
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -ENOBUFS) {
+    errno = -cqe->res;
+    perror ("SEND ERROR");
+  }
+  uring->slots[idx].next = uring->free_slot;
+  uring->free_slot = idx;
+}
+
+/**
+ * Processes the completions that are there, which takes no system call
+ */
+static void
+microtcp_uring_reap (struct microtcp_uring *uring)
+{
+  unsigned int head = *uring->cq_head;
+  unsigned int tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+  const struct io_uring_cqe *cqe;
+
+  for (; head != tail; head++) {
+    cqe = &uring->cqes[head & uring->cq_mask];
+    switch (cqe->user_data >> 62)
+      {
+      case MICROTCP_URING_RECV:
+        microtcp_uring_recv_done (uring, cqe);
+        break;
+      case MICROTCP_URING_SEND:
+        microtcp_uring_send_done (uring, cqe);
+        break;
+      case MICROTCP_URING_WATCH:
+        uring->watched = 1;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+          uring->watch_armed = 0;
+        }
+        break;
+      default:
+        break;
+      }
+  }
+  __atomic_store_n (uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return whether the kernel has what the ring needs: waits with a
+ * timeout, buffer rings and multishot receives. The latter came along
+ * IORING_OP_SEND_ZC, which the probe can tell.
+ */
+static int
+microtcp_uring_supported (struct microtcp_uring *uring,
+                          const struct io_uring_params *params)
+{
+  struct io_uring_probe *probe;
+  size_t len = sizeof(struct io_uring_probe)
+      + 256 * sizeof(struct io_uring_probe_op);
+  int ok;
+
+  if (!(params->features & IORING_FEAT_EXT_ARG)) {
+    return 0;
+  }
+  probe = calloc (1, len);
+  if (!probe) {
+    return 0;
+  }
+  ok = syscall (__NR_io_uring_register, uring->fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0
+      && probe->last_op >= IORING_OP_SEND_ZC
+      && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+  free (probe);
+  return ok;
+}
+
+static int
+microtcp_uring_map (struct microtcp_uring *uring,
+                    const struct io_uring_params *params)
+{
+  uring->sq_ring_len = params->sq_off.array
+      + params->sq_entries * sizeof(unsigned int);
+  uring->cq_ring_len = params->cq_off.cqes
+      + params->cq_entries * sizeof(struct io_uring_cqe);
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_len > uring->sq_ring_len) {
+      uring->sq_ring_len = uring->cq_ring_len;
+    }
+    uring->cq_ring_len = 0;
+  }
+  uring->sq_ring = mmap (NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd,
+                         IORING_OFF_SQ_RING);
+  if (uring->sq_ring == MAP_FAILED) {
+    uring->sq_ring = NULL;
+    return -1;
+  }
+  uring->cq_ring = uring->sq_ring;
+  if (uring->cq_ring_len) {
+    uring->cq_ring = mmap (NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, uring->fd,
+                           IORING_OFF_CQ_RING);
+    if (uring->cq_ring == MAP_FAILED) {
+      uring->cq_ring = NULL;
+      return -1;
+    }
+  }
+  uring->sqes_len = params->sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap (NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    uring->sqes = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Registers the receive buffers with the kernel, which picks one for
+ * every datagram
+ */
+static int
+microtcp_uring_buffers (struct microtcp_uring *uring)
+{
+  struct io_uring_buf_reg reg;
+  unsigned int i;
+
+  uring->br_len = MICROTCP_URING_BUFS * sizeof(struct io_uring_buf);
+  uring->br = mmap (NULL, uring->br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (uring->br == MAP_FAILED) {
+    uring->br = NULL;
+    return -1;
+  }
+  uring->bufs = malloc ((size_t) MICROTCP_URING_BUFS
+                        * MICROTCP_URING_BUF_LEN);
+  if (!uring->bufs) {
+    return -1;
+  }
+  memset (&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) uring->br;
+  reg.ring_entries = MICROTCP_URING_BUFS;
+  reg.bgid = MICROTCP_URING_BGID;
+  if (syscall (__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING,
+               &reg, 1) == -1) {
+    return -1;
+  }
+  for (i = 0; i < MICROTCP_URING_BUFS; i++) {
+    microtcp_uring_recycle (uring, i);
+  }
+
+  /* The kernel writes the sender address ahead of each datagram */
+  uring->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+  return 0;
+}
+
+struct microtcp_uring *
+microtcp_uring_create (void)
+{
+  struct microtcp_uring *uring = calloc (1, sizeof(struct microtcp_uring));
+  struct io_uring_params params;
+  unsigned int i;
+
+  if (!uring) {
+    return NULL;
+  }
+  memset (&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = MICROTCP_URING_CQ_ENTRIES;
+  uring->fd = syscall (__NR_io_uring_setup, MICROTCP_URING_ENTRIES, &params);
+  uring->watch_fd = -1;
+  if (uring->fd == -1 || !microtcp_uring_supported (uring, &params)
+      || microtcp_uring_map (uring, &params)
+      || microtcp_uring_buffers (uring)) {
+    microtcp_uring_destroy (uring);
+    return NULL;
+  }
+
+  uring->sq_head = (unsigned int *) ((uint8_t *) uring->sq_ring
+      + params.sq_off.head);
+  uring->sq_tail = (unsigned int *) ((uint8_t *) uring->sq_ring
+      + params.sq_off.tail);
+  uring->sq_flags = (unsigned int *) ((uint8_t *) uring->sq_ring
+      + params.sq_off.flags);
+  uring->sq_mask = *(unsigned int *) ((uint8_t *) uring->sq_ring
+      + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->sqe_tail = *uring->sq_tail;
+  /* Entry i of the queue is always sqes[i] */
+  for (i = 0; i < params.sq_entries; i++) {
+    ((unsigned int *) ((uint8_t *) uring->sq_ring
+        + params.sq_off.array))[i] = i;
+  }
+  uring->cq_head = (unsigned int *) ((uint8_t *) uring->cq_ring
+      + params.cq_off.head);
+  uring->cq_tail = (unsigned int *) ((uint8_t *) uring->cq_ring
+      + params.cq_off.tail);
+  uring->cq_mask = *(unsigned int *) ((uint8_t *) uring->cq_ring
+      + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *) ((uint8_t *) uring->cq_ring
+      + params.cq_off.cqes);
+
+  uring->slots = calloc (MICROTCP_URING_SLOTS,
+                         sizeof(struct microtcp_uring_slot));
+  if (!uring->slots) {
+    microtcp_uring_destroy (uring);
+    return NULL;
+  }
+  for (i = 0; i < MICROTCP_URING_SLOTS; i++) {
+    uring->slots[i].msg.msg_name = &uring->slots[i].addr;
+    uring->slots[i].msg.msg_iov = &uring->slots[i].iov;
+    uring->slots[i].msg.msg_iovlen = 1;
+    uring->slots[i].iov.iov_base = uring->slots[i].buf;
+    uring->slots[i].next = i + 1 < MICROTCP_URING_SLOTS ? (int) i + 1 : -1;
+  }
+  uring->free_slot = 0;
+  return uring;
+}
+
+void
+microtcp_uring_destroy (struct microtcp_uring *uring)
+{
+  /* Closing the ring cancels whatever is still running */
+  if (uring->fd != -1) {
+    close (uring->fd);
+  }
+  if (uring->sqes) {
+    munmap (uring->sqes, uring->sqes_len);
+  }
+  if (uring->cq_ring && uring->cq_ring != uring->sq_ring) {
+    munmap (uring->cq_ring, uring->cq_ring_len);
+  }
+  if (uring->sq_ring) {
+    munmap (uring->sq_ring, uring->sq_ring_len);
+  }
+  if (uring->br) {
+    munmap (uring->br, uring->br_len);
+  }
+  free (uring->bufs);
+  free (uring->roots);
+  free (uring->ready);
+  free (uring->slots);
+  free (uring);
+}
+
+int
+microtcp_uring_add (struct microtcp_uring *uring, microtcp_sock_t *socket)
+{
+  struct microtcp_uring_root *roots;
+  unsigned int *ready;
+  unsigned int n;
+  unsigned int idx;
+
+  for (idx = 0; idx < uring->nroots && uring->roots[idx].socket; idx++) {
+  }
+  if (idx == uring->nroots) {
+    n = uring->nroots ? uring->nroots * 2 : 8;
+    roots = realloc (uring->roots, n * sizeof(struct microtcp_uring_root));
+    if (!roots) {
+      return -1;
+    }
+    uring->roots = roots;
+    ready = realloc (uring->ready, n * sizeof(unsigned int));
+    if (!ready) {
+      return -1;
+    }
+    uring->ready = ready;
+    memset (&roots[idx], 0, (n - idx) * sizeof(struct microtcp_uring_root));
+    uring->nroots = n;
+  }
+  uring->roots[idx].socket = socket;
+  uring->roots[idx].gen = (uring->roots[idx].gen + 1)
+      & MICROTCP_URING_GEN_MASK;
+  uring->roots[idx].head = -1;
+  uring->roots[idx].tail = -1;
+  if (microtcp_uring_arm (uring, idx)) {
+    uring->roots[idx].socket = NULL;
+    return -1;
+  }
+  socket->uring = uring;
+  socket->uring_id = idx;
+  return 0;
+}
+
+void
+microtcp_uring_del (struct microtcp_uring *uring, microtcp_sock_t *socket)
+{
+  struct microtcp_uring_root *root = &uring->roots[socket->uring_id];
+  struct io_uring_sqe *sqe;
+  int bid;
+
+  while (root->head != -1) {
+    bid = root->head;
+    root->head = uring->buf_next[bid];
+    microtcp_uring_recycle (uring, bid);
+  }
+  if (root->armed && (sqe = microtcp_uring_sqe (uring))) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = MICROTCP_URING_TAG(MICROTCP_URING_RECV, root->gen,
+                                   socket->uring_id);
+  }
+  root->socket = NULL;
+  root->armed = 0;
+  socket->uring = NULL;
+
+  /* Its queued datagrams leave before the socket may go */
+  microtcp_uring_submit (uring);
+}
+
+void
+microtcp_uring_watch (struct microtcp_uring *uring, int fd)
+{
+  uring->watch_fd = fd;
+}
+
+int
+microtcp_uring_sendmmsg (struct microtcp_uring *uring, int sd,
+                         struct mmsghdr *msgs, unsigned int count)
+{
+  struct microtcp_uring_slot *slot;
+  struct io_uring_sqe *sqe;
+  const struct msghdr *msg;
+  unsigned int i;
+  size_t len;
+  size_t j;
+
+  for (i = 0; i < count; i++) {
+    msg = &msgs[i].msg_hdr;
+    /* All in flight, so wait for the oldest to complete */
+    while (uring->free_slot == -1) {
+      if (microtcp_uring_enter (uring, 1, -1)) {
+        return -1;
+      }
+      microtcp_uring_reap (uring);
+    }
+    slot = &uring->slots[uring->free_slot];
+    len = 0;
+    for (j = 0; j < msg->msg_iovlen; j++) {
+      if (len + msg->msg_iov[j].iov_len > MICROTCP_URING_BUF_LEN) {
+        errno = EMSGSIZE;
+        return -1;
+      }
+      memcpy (slot->buf + len, msg->msg_iov[j].iov_base,
+              msg->msg_iov[j].iov_len);
+      len += msg->msg_iov[j].iov_len;
+    }
+    sqe = microtcp_uring_sqe (uring);
+    if (!sqe) {
+      return -1;
+    }
+    memcpy (&slot->addr, msg->msg_name, msg->msg_namelen);
+    slot->msg.msg_namelen = msg->msg_namelen;
+    slot->iov.iov_len = len;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sd;
+    sqe->addr = (uint64_t) (uintptr_t) &slot->msg;
+    sqe->len = 1;
+    sqe->user_data = MICROTCP_URING_TAG(MICROTCP_URING_SEND, 0,
+                                        uring->free_slot);
+    uring->free_slot = slot->next;
+  }
+  return 0;
+}
+
+int
+microtcp_uring_recvmmsg (struct microtcp_uring *uring,
+                         microtcp_sock_t *socket, struct mmsghdr *msgs,
+                         unsigned int vlen)
+{
+  struct microtcp_uring_root *root = &uring->roots[socket->uring_id];
+  const struct io_uring_recvmsg_out *out;
+  struct msghdr *msg;
+  const uint8_t *buf;
+  unsigned int n = 0;
+  size_t len;
+  int bid;
+
+  microtcp_uring_reap (uring);
+  while (n < vlen && root->head != -1) {
+    bid = root->head;
+    root->head = uring->buf_next[bid];
+    buf = uring->bufs + (size_t) bid * MICROTCP_URING_BUF_LEN;
+    out = (const struct io_uring_recvmsg_out *) buf;
+    msg = &msgs[n].msg_hdr;
+
+    len = out->payloadlen;
+    msg->msg_flags = out->flags;
+    if (len > msg->msg_iov[0].iov_len) {
+      len = msg->msg_iov[0].iov_len;
+      msg->msg_flags |= MSG_TRUNC;
+    }
+    memcpy (msg->msg_iov[0].iov_base, buf + sizeof(*out)
+            + uring->recv_msg.msg_namelen, len);
+    msg->msg_namelen = out->namelen < msg->msg_namelen ?
+        out->namelen : msg->msg_namelen;
+    memcpy (msg->msg_name, buf + sizeof(*out), msg->msg_namelen);
+    msg->msg_controllen = 0;
+    msgs[n].msg_len = len;
+    microtcp_uring_recycle (uring, bid);
+    n++;
+  }
+  if (n == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return n;
+}
+
+int
+microtcp_uring_wait (struct microtcp_uring *uring, int timeout_ms,
+                     int *watched)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int i;
+
+  if (uring->rearm) {
+    uring->rearm = 0;
+    for (i = 0; i < uring->nroots; i++) {
+      if (uring->roots[i].socket && !uring->roots[i].armed
+          && microtcp_uring_arm (uring, i)) {
+        return -1;
+      }
+    }
+  }
+  if (uring->watch_fd != -1 && !uring->watch_armed) {
+    sqe = microtcp_uring_sqe (uring);
+    if (!sqe) {
+      return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = uring->watch_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = MICROTCP_URING_TAG(MICROTCP_URING_WATCH, 0, 0);
+    uring->watch_armed = 1;
+  }
+
+  microtcp_uring_reap (uring);
+  if (microtcp_uring_enter (uring, timeout_ms != 0 && !uring->ready_count
+                            && !uring->watched, timeout_ms)) {
+    return -1;
+  }
+  microtcp_uring_reap (uring);
+  *watched = uring->watched;
+  uring->watched = 0;
+  return 0;
+}
+
+int
+microtcp_uring_ready (struct microtcp_uring *uring, microtcp_sock_t **ready,
+                      int maxready)
+{
+  struct microtcp_uring_root *root;
+  int n = 0;
+
+  while (n < maxready && uring->ready_count) {
+    root = &uring->roots[uring->ready[--uring->ready_count]];
+    root->listed = 0;
+    if (root->socket) {
+      ready[n++] = root->socket;
+    }
+  }
+  return n;
+}
+
+int
+microtcp_uring_submit (struct microtcp_uring *uring)
+{
+  return microtcp_uring_enter (uring, 0, 0);
+}
+
+#else
+
+struct microtcp_uring *
+microtcp_uring_create (void)
+{
+  return NULL;
+}
+
+void
+microtcp_uring_destroy (struct microtcp_uring *uring)
+{
+}
+
+int
+microtcp_uring_add (struct microtcp_uring *uring, microtcp_sock_t *socket)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+microtcp_uring_del (struct microtcp_uring *uring, microtcp_sock_t *socket)
+{
+}
+
+void
+microtcp_uring_watch (struct microtcp_uring *uring, int fd)
+{
+}
+
+int
+microtcp_uring_sendmmsg (struct microtcp_uring *uring, int sd,
+                         struct mmsghdr *msgs, unsigned int count)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_recvmmsg (struct microtcp_uring *uring,
+                         microtcp_sock_t *socket, struct mmsghdr *msgs,
+                         unsigned int vlen)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_wait (struct microtcp_uring *uring, int timeout_ms,
+                     int *watched)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+microtcp_uring_ready (struct microtcp_uring *uring, microtcp_sock_t **ready,
+                      int maxready)
+{
+  return 0;
+}
+
+int
+microtcp_uring_submit (struct microtcp_uring *uring)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_URING_H_
+#define LIB_URING_H_
+
+#include "microtcp.h"
+#include <sys/socket.h>
+
+/* Declared by <sys/socket.h> with _GNU_SOURCE */
+struct mmsghdr;
+
+/*
+ * The datagram I/O of the UDP sockets of a poller through io_uring. Each
+ * UDP socket has a multishot receive that fills the buffers of a
+ * registered buffer ring as datagrams arrive, so taking them costs no
+ * system call. The segments to send are copied to send requests, which
+ * leave with the next wait. An event loop iteration thus takes a single
+ * io_uring_enter(), instead of an epoll_wait() and a recvmmsg() and a
+ * sendmmsg() for every UDP socket.
+ *
+ * Only the thread that created the ring may use it, as with the timer
+ * wheel.
+ */
+
+struct microtcp_uring;
+
+/**
+ * @return the ring, NULL if the kernel lacks the io_uring features it
+ * needs, the caller then does the I/O itself
+ */
+struct microtcp_uring *
+microtcp_uring_create (void);
+
+void
+microtcp_uring_destroy (struct microtcp_uring *uring);
+
+/**
+ * Starts receiving the datagrams of the UDP socket of a socket, which
+ * microtcp_uring_recvmmsg() then returns.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_uring_add (struct microtcp_uring *uring, microtcp_sock_t *socket);
+
+/**
+ * Stops receiving for a socket. The datagrams it did not take are dropped.
+ */
+void
+microtcp_uring_del (struct microtcp_uring *uring, microtcp_sock_t *socket);
+
+/**
+ * Has microtcp_uring_wait() also return when a file descriptor becomes
+ * readable, e.g. an epoll instance for the sockets that are not in the
+ * ring.
+ */
+void
+microtcp_uring_watch (struct microtcp_uring *uring, int fd);
+
+/**
+ * Queues datagrams for sending, like sendmmsg() does. They leave with the
+ * next microtcp_uring_wait() or microtcp_uring_submit().
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_uring_sendmmsg (struct microtcp_uring *uring, int sd,
+                         struct mmsghdr *msgs, unsigned int count);
+
+/**
+ * Takes the datagrams received for a socket, like recvmmsg() does. The
+ * ancillary data is not kept.
+ *
+ * @return the number of datagrams, -1 with errno EAGAIN if there are none
+ */
+int
+microtcp_uring_recvmmsg (struct microtcp_uring *uring,
+                         microtcp_sock_t *socket, struct mmsghdr *msgs,
+                         unsigned int vlen);
+
+/**
+ * Submits the queued requests and waits for some of them to complete.
+ *
+ * @param timeout_ms the longest to wait, 0 to only submit, -1 for no
+ * limit
+ * @param watched set to whether the watched file descriptor became
+ * readable
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_uring_wait (struct microtcp_uring *uring, int timeout_ms,
+                     int *watched);
+
+/**
+ * @param ready set to sockets that have datagrams to take
+ * @return the number of sockets
+ */
+int
+microtcp_uring_ready (struct microtcp_uring *uring, microtcp_sock_t **ready,
+                      int maxready);
+
+/**
+ * Submits the queued requests without waiting.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int
+microtcp_uring_submit (struct microtcp_uring *uring);
+
+#endif /* LIB_URING_H_ */
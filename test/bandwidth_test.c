@@ -162,8 +162,8 @@ server_microtcp (uint16_t listen_port, const char *file)
   uint8_t *buffer;
   FILE *fp;
   microtcp_sock_t sock;
-  microtcp_sock_t *accepted;
-  microtcp_sock_t *received;
+  microtcp_sock_t accepted;
+  ssize_t received;
   ssize_t written;
   ssize_t total_bytes = 0;
   socklen_t client_addr_len;
@@ -208,7 +208,7 @@ server_microtcp (uint16_t listen_port, const char *file)
     return -EXIT_FAILURE;
   }
 
-  if (listen (sock.sd, 1000) == -1) {
+  if (microtcp_listen (&sock, 1000) == -1) {
     perror ("TCP listen");
     free (buffer);
     fclose (fp);
@@ -217,8 +217,8 @@ server_microtcp (uint16_t listen_port, const char *file)
 
   /* Accept a connection from the client */
   client_addr_len = sizeof(struct sockaddr);
-  accepted->sd = microtcp_accept (&sock, &client_addr, &client_addr_len);
-  if (accepted->sd < 0) {
+  if (microtcp_accept_conn (&sock, &accepted, &client_addr,
+                            client_addr_len) == -1) {
     perror ("TCP accept");
     free (buffer);
     fclose (fp);
@@ -236,15 +236,14 @@ server_microtcp (uint16_t listen_port, const char *file)
    */
 
   clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
-  while ((received->sd = recv (accepted->sd, buffer, CHUNK_SIZE, 0)) > 0) {
-    written = fwrite (buffer, sizeof(uint8_t), received->sd, fp);
-    total_bytes += received->sd;
-    if (written * sizeof(uint8_t) != received->sd) {
+  while ((received = microtcp_recv (&accepted, buffer, CHUNK_SIZE, 0)) > 0) {
+    written = fwrite (buffer, sizeof(uint8_t), received, fp);
+    total_bytes += received;
+    if (written * sizeof(uint8_t) != received) {
       printf ("Failed to write to the file the"
               " amount of data received from the network.\n");
-      microtcp_shutdown (accepted, SHUT_RDWR);
+      microtcp_shutdown (&accepted, SHUT_RDWR);
       microtcp_shutdown (&sock, SHUT_RDWR);
-      close (accepted->sd);
       close (sock.sd);
       free (buffer);
       fclose (fp);
@@ -254,9 +253,8 @@ server_microtcp (uint16_t listen_port, const char *file)
   clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
   print_statistics (total_bytes, start_time, end_time);
 
-  microtcp_shutdown (accepted, SHUT_RDWR);
+  microtcp_shutdown (&accepted, SHUT_RDWR);
   microtcp_shutdown (&sock, SHUT_RDWR);
-  close (accepted->sd);
   close (sock.sd);
   fclose (fp);
   free (buffer);
@@ -407,7 +405,7 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
       return -EXIT_FAILURE;
     }
 
-    data_sent = send (sock.sd, buffer, read_items * sizeof(uint8_t), 0);
+    data_sent = microtcp_send (&sock, buffer, read_items * sizeof(uint8_t), 0);
     if (data_sent != read_items * sizeof(uint8_t)) {
       printf ("Failed to send the"
               " amount of data read from the file.\n");
@@ -0,0 +1,137 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Echoes data between many client and server coroutines of
+ * lib/microtcp.hpp over loopback, all on the executor of a single thread.
+ * Half of the connections are dropped instead of closed, and so is the
+ * listener while they are open, which the executor must close behind
+ * them. Exits with a non-zero status if any echo differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <vector>
+
+#include "../lib/microtcp.hpp"
+
+#define CLIENTS 200
+#define BYTES 40000
+#define CHUNK 8192
+
+static int echoed;
+static int failed;
+
+static microtcp::task<>
+echo (microtcp::socket conn, int id)
+{
+  char buf[4096];
+  size_t n;
+
+  while ((n = co_await conn.recv (buf, sizeof(buf)))) {
+    co_await conn.send (buf, n);
+  }
+  if (id % 2) {
+    co_await conn.close ();
+  }
+}
+
+static microtcp::task<>
+server (microtcp::executor &ex, microtcp::socket listener)
+{
+  int i;
+
+  for (i = 0; i < CLIENTS; i++) {
+    ex.spawn (echo (co_await listener.accept (), i));
+  }
+}
+
+static microtcp::task<>
+client (microtcp::executor &ex, struct sockaddr_in sin, int id)
+{
+  std::vector<char> out (BYTES);
+  std::vector<char> in (BYTES);
+  microtcp::socket sock;
+  size_t got = 0;
+  size_t off;
+  size_t len;
+  size_t n;
+
+  for (off = 0; off < BYTES; off++) {
+    out[off] = off * 31 + id;
+  }
+  sock = co_await microtcp::socket::connect (ex, (struct sockaddr *) &sin,
+                                             sizeof(sin));
+  /* Each chunk comes back before the next one leaves */
+  for (off = 0; off < BYTES; off += len) {
+    len = BYTES - off < CHUNK ? BYTES - off : CHUNK;
+    co_await sock.send (out.data () + off, len);
+    while (got < off + len) {
+      n = co_await sock.recv (in.data () + got, BYTES - got);
+      if (n == 0) {
+        fprintf (stderr, "client %d: connection closed at %zu\n", id, got);
+        failed++;
+        co_return;
+      }
+      got += n;
+    }
+  }
+  if (memcmp (in.data (), out.data (), BYTES)) {
+    fprintf (stderr, "client %d: echo differs\n", id);
+    failed++;
+    co_return;
+  }
+  if (id % 2) {
+    co_await sock.close ();
+  }
+  echoed++;
+}
+
+int
+main (void)
+{
+  microtcp::executor ex;
+  microtcp::socket listener;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  int i;
+
+  memset (&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  listener = microtcp::socket::listen (ex, (struct sockaddr *) &sin,
+                                       sizeof(sin), CLIENTS);
+  if (getsockname (listener.native_handle ()->sd, (struct sockaddr *) &sin,
+                   &len)) {
+    perror ("getsockname");
+    return EXIT_FAILURE;
+  }
+
+  ex.spawn (server (ex, std::move (listener)));
+  for (i = 0; i < CLIENTS; i++) {
+    ex.spawn (client (ex, sin, i));
+  }
+  ex.run ();
+
+  printf ("%d of %d connections echoed %d bytes\n", echoed, CLIENTS, BYTES);
+  return failed || echoed != CLIENTS ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,137 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks every CRC-32 variant of utils/crc32.h, including the fused copy
+ * kernels, against crc32() over random lengths and alignments. Exits with
+ * a non-zero status on the first mismatch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../utils/crc32.h"
+
+#define BUF_LEN 8192
+#define ROUNDS 200000
+
+typedef uint32_t
+(*crc32_fn_t) (uint32_t crc, const uint8_t *data, size_t len);
+
+static const struct
+{
+  const char *name;
+  crc32_fn_t fn;
+} variants[] =
+  {
+    { "slice8", update_crc32_slice8 },
+    { "slice16", update_crc32_slice16 },
+#ifdef CRC32_HAVE_PCLMUL
+    { "pclmul", update_crc32_pclmul },
+#endif
+    { "best", update_crc32_best },
+  };
+
+typedef uint32_t
+(*crc32_copy_fn_t) (uint32_t crc, uint8_t *dst, const uint8_t *src,
+                    size_t len);
+
+static const struct
+{
+  const char *name;
+  crc32_copy_fn_t fn;
+} copy_variants[] =
+  {
+    { "copy_slice16", update_crc32_copy_slice16 },
+#ifdef CRC32_HAVE_PCLMUL
+    { "copy_pclmul", update_crc32_copy_pclmul },
+#endif
+    { "copy_best", update_crc32_copy_best },
+  };
+
+int
+main (int argc, char **argv)
+{
+  static uint8_t buf[BUF_LEN];
+  static uint8_t dst[BUF_LEN + 2];
+  const size_t nvariants = sizeof(variants) / sizeof(variants[0]);
+  const size_t ncopy = sizeof(copy_variants) / sizeof(copy_variants[0]);
+  size_t dst_off;
+  uint32_t expected;
+  uint32_t got;
+  size_t off;
+  size_t len;
+  size_t split;
+  size_t v;
+  int i;
+
+  srand (argc > 1 ? atoi (argv[1]) : 1);
+  for (i = 0; i < BUF_LEN; i++) {
+    buf[i] = rand ();
+  }
+
+  /* The check value of the CRC-32 catalogue */
+  if (crc32 ((const uint8_t *) "123456789", 9) != 0xcbf43926) {
+    fprintf (stderr, "crc32() check value mismatch\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < ROUNDS; i++) {
+    off = rand () % 64;
+    /* Mostly short buffers, where the variants switch strategies */
+    len = rand () % (i % 4 ? 256 : BUF_LEN - 64);
+    split = len ? rand () % len : 0;
+    expected = crc32 (buf + off, len);
+
+    for (v = 0; v < nvariants; v++) {
+      /* Also progressively, in two pieces */
+      got = variants[v].fn (0xffffffff, buf + off, split);
+      got = variants[v].fn (got, buf + off + split, len - split) ^ 0xffffffff;
+      if (got != expected
+          || (variants[v].fn (0xffffffff, buf + off, len) ^ 0xffffffff)
+              != expected) {
+        fprintf (stderr, "%s: offset %zu length %zu split %zu: %08x != %08x\n",
+                 variants[v].name, off, len, split, got, expected);
+        return EXIT_FAILURE;
+      }
+    }
+
+    /* The fused kernels must copy exactly len bytes as well */
+    dst_off = rand () % 64;
+    for (v = 0; v < ncopy; v++) {
+      memset (dst, 0x5a, sizeof(dst));
+      got = copy_variants[v].fn (0xffffffff, dst + dst_off, buf + off, split);
+      got = copy_variants[v].fn (got, dst + dst_off + split, buf + off + split,
+                                 len - split) ^ 0xffffffff;
+      if (got != expected || memcmp (dst + dst_off, buf + off, len)
+          || dst[dst_off + len] != 0x5a
+          || (dst_off && dst[dst_off - 1] != 0x5a)) {
+        fprintf (stderr, "%s: offset %zu length %zu split %zu: %08x != %08x\n",
+                 copy_variants[v].name, off, len, split, got, expected);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  printf ("%d random buffers, %zu variants\n", ROUNDS, nvariants + ncopy);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the connection table of lib/demux.h against a plain array over
+ * random insertions, lookups, replacements and removals, with enough
+ * peers to make it grow and wrap its probe sequences. Exits with a
+ * non-zero status on the first mismatch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "../lib/demux.h"
+
+#define PEERS 50000
+#define ROUNDS 1000000
+
+static void
+peer_addr (size_t i, struct sockaddr_storage *addr, socklen_t *len)
+{
+  struct sockaddr_in *in4 = (struct sockaddr_in *) addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) addr;
+
+  memset (addr, 0, sizeof(struct sockaddr_storage));
+  /* Many peers behind few addresses, as behind a NAT */
+  if (i % 4) {
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons (1024 + i / 16);
+    in4->sin_addr.s_addr = htonl (0x0a000000 + i % 16);
+    *len = sizeof(struct sockaddr_in);
+  }
+  else {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons (1024 + i % 1000);
+    in6->sin6_addr.s6_addr[15] = i / 1000;
+    *len = sizeof(struct sockaddr_in6);
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  static char present[PEERS];
+  static char moved[PEERS];
+  static int values[PEERS];
+  static int others[PEERS];
+  struct sockaddr_storage addr;
+  microtcp_demux_t demux;
+  socklen_t len;
+  size_t count = 0;
+  size_t i;
+  void *got;
+  void *want;
+  int r;
+
+  srand (argc > 1 ? atoi (argv[1]) : 1);
+  if (microtcp_demux_init (&demux, 1)) {
+    perror ("microtcp_demux_init");
+    return EXIT_FAILURE;
+  }
+
+  for (r = 0; r < ROUNDS; r++) {
+    i = rand () % PEERS;
+    peer_addr (i, &addr, &len);
+    want = !present[i] ? NULL : moved[i] ? &others[i] : &values[i];
+    got = microtcp_demux_lookup (&demux, (struct sockaddr *) &addr, len);
+    if (got != want) {
+      fprintf (stderr, "round %d: lookup of peer %zu failed\n", r, i);
+      return EXIT_FAILURE;
+    }
+    /* Fill up during the first half, then churn at a steady size */
+    if (!present[i] && (r < ROUNDS / 2 || rand () % 2)) {
+      if (microtcp_demux_insert (&demux, (struct sockaddr *) &addr, len,
+                                 &values[i])) {
+        fprintf (stderr, "round %d: insertion of peer %zu failed\n", r, i);
+        return EXIT_FAILURE;
+      }
+      present[i] = 1;
+      moved[i] = 0;
+      count++;
+    }
+    else if (!present[i] || rand () % 4 == 0) {
+      /* Moves the connection, or adds nothing for a missing peer */
+      if (microtcp_demux_replace (&demux, (struct sockaddr *) &addr, len,
+                                  moved[i] ? &values[i] : &others[i])
+          != want) {
+        fprintf (stderr, "round %d: replacement of peer %zu failed\n", r, i);
+        return EXIT_FAILURE;
+      }
+      moved[i] ^= present[i];
+    }
+    else {
+      if (microtcp_demux_insert (&demux, (struct sockaddr *) &addr, len,
+                                 &values[i]) == 0
+          || microtcp_demux_remove (&demux, (struct sockaddr *) &addr, len)
+              != want) {
+        fprintf (stderr, "round %d: removal of peer %zu failed\n", r, i);
+        return EXIT_FAILURE;
+      }
+      present[i] = 0;
+      count--;
+    }
+    if (demux.count != count) {
+      fprintf (stderr, "round %d: %zu entries instead of %zu\n", r,
+               demux.count, count);
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (i = 0; i < PEERS; i++) {
+    peer_addr (i, &addr, &len);
+    want = !present[i] ? NULL : moved[i] ? &others[i] : &values[i];
+    if (microtcp_demux_lookup (&demux, (struct sockaddr *) &addr, len)
+        != want) {
+      fprintf (stderr, "final lookup of peer %zu failed\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf ("%d operations, %zu peers in %zu slots\n", ROUNDS, demux.count,
+          demux.capacity);
+  microtcp_demux_destroy (&demux);
+  return EXIT_SUCCESS;
+}
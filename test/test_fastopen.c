@@ -0,0 +1,201 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sends a fast open SYN with more data than the receive buffer holds to a
+ * GRO listener, whose datagrams may be that large, and checks that the
+ * connection takes and acknowledges no more than fits. Exits with a
+ * non-zero status on failure, and with zero if UDP_GRO is not supported.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "../lib/microtcp.h"
+#include "../utils/crc32.h"
+
+#define COOKIE_LEN 8
+#define DATA_LEN 20000
+#define CLIENT_ISN 1000
+
+static uint8_t pkt[sizeof(microtcp_header_t) + COOKIE_LEN + DATA_LEN];
+
+/**
+ * Sends a SYN offering fast open, with the cookie and data_len bytes of
+ * data if cookie is not NULL.
+ */
+static int
+send_syn (int sd, const struct sockaddr_in *to, const uint8_t *cookie,
+          size_t data_len)
+{
+  microtcp_header_t *header = (microtcp_header_t *) pkt;
+  size_t len = sizeof(microtcp_header_t);
+  size_t i;
+
+  memset (header, 0, sizeof(microtcp_header_t));
+  header->seq_number = CLIENT_ISN;
+  header->control = MICROTCP_SYN;
+  header->window = 0xffff;
+  header->future_use0 = MICROTCP_OPT_FASTOPEN;
+  if (cookie) {
+    memcpy (pkt + len, cookie, COOKIE_LEN);
+    len += COOKIE_LEN;
+    for (i = 0; i < data_len; i++) {
+      pkt[len + i] = i * 7;
+    }
+    len += data_len;
+  }
+  header->data_len = len - sizeof(microtcp_header_t);
+  header->checksum = crc32 (pkt, len);
+  return sendto (sd, pkt, len, 0, (const struct sockaddr *) to,
+                 sizeof(struct sockaddr_in)) == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * Waits for the SYN-ACK of the listener.
+ */
+static int
+recv_synack (int sd, microtcp_header_t *header, uint8_t *cookie)
+{
+  uint8_t buf[sizeof(microtcp_header_t) + COOKIE_LEN];
+  ssize_t ret = recv (sd, buf, sizeof(buf), 0);
+
+  if (ret < (ssize_t) sizeof(microtcp_header_t)) {
+    return -1;
+  }
+  memcpy (header, buf, sizeof(microtcp_header_t));
+  if ((header->control & (MICROTCP_SYN | MICROTCP_ACK))
+      != (MICROTCP_SYN | MICROTCP_ACK)) {
+    return -1;
+  }
+  if (cookie) {
+    if (header->data_len != COOKIE_LEN) {
+      return -1;
+    }
+    memcpy (cookie, buf + sizeof(microtcp_header_t), COOKIE_LEN);
+  }
+  return 0;
+}
+
+static int
+udp_socket (void)
+{
+  struct timeval timeout = { 5, 0 };
+  int sd = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  if (sd != -1) {
+    setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  return sd;
+}
+
+int
+main (void)
+{
+  microtcp_sock_t listener = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+  microtcp_sock_t conn;
+  microtcp_header_t synack;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  uint8_t cookie[COOKIE_LEN];
+  uint8_t data[DATA_LEN];
+  size_t got;
+  size_t i;
+  int on = 1;
+  int probe = udp_socket ();
+  int client = udp_socket ();
+
+  if (listener.sd == -1 || probe == -1 || client == -1) {
+    perror ("socket");
+    return 1;
+  }
+  if (microtcp_setsockopt (&listener, MICROTCP_SO_GRO, &on, sizeof(on))) {
+    printf ("UDP_GRO not supported, skipped\n");
+    return 0;
+  }
+  memset (&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (microtcp_setsockopt (&listener, MICROTCP_SO_FASTOPEN, &on, sizeof(on))
+      || microtcp_setsockopt (&listener, MICROTCP_SO_NONBLOCK, &on,
+                              sizeof(on))
+      || microtcp_bind (&listener, (struct sockaddr *) &addr, sizeof(addr))
+      || getsockname (listener.sd, (struct sockaddr *) &addr, &addr_len)
+      || microtcp_listen (&listener, 4)) {
+    perror ("listener");
+    return 1;
+  }
+
+  /* A SYN without a cookie asks for one */
+  if (send_syn (probe, &addr, NULL, 0)) {
+    perror ("send");
+    return 1;
+  }
+  if (microtcp_accept_conn (&listener, &conn, NULL, 0) == 0
+      || errno != EAGAIN) {
+    fprintf (stderr, "accepted a connection without a handshake\n");
+    return 1;
+  }
+  if (recv_synack (probe, &synack, cookie)) {
+    fprintf (stderr, "no cookie in the SYN-ACK\n");
+    return 1;
+  }
+
+  /* The cookie is that of the address, whatever the port */
+  if (send_syn (client, &addr, cookie, DATA_LEN)) {
+    perror ("send");
+    return 1;
+  }
+  for (i = 0; microtcp_accept_conn (&listener, &conn, NULL, 0); i++) {
+    if (errno != EAGAIN || i == 1000) {
+      fprintf (stderr, "the fast open SYN set up no connection\n");
+      return 1;
+    }
+    usleep (1000);
+  }
+  got = conn.buf_fill_level;
+  if (got == 0 || got > conn.recvbuf_len || got >= DATA_LEN) {
+    fprintf (stderr, "took %zu bytes into a buffer of %zu\n", got,
+             conn.recvbuf_len);
+    return 1;
+  }
+  if (recv_synack (client, &synack, NULL)
+      || synack.ack_number != CLIENT_ISN + 1 + got) {
+    fprintf (stderr, "the SYN-ACK acknowledges more than was taken\n");
+    return 1;
+  }
+  if (microtcp_recv (&conn, data, sizeof(data), 0) != (ssize_t) got) {
+    fprintf (stderr, "could not read what was taken\n");
+    return 1;
+  }
+  for (i = 0; i < got; i++) {
+    if (data[i] != (uint8_t) (i * 7)) {
+      fprintf (stderr, "byte %zu is corrupt\n", i);
+      return 1;
+    }
+  }
+  close (probe);
+  close (client);
+  return 0;
+}
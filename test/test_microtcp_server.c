@@ -36,7 +36,6 @@
 int main(void)
 {
     microtcp_sock_t server_socket;
-    microtcp_sock_t conn_socket;
 
     struct sockaddr_in server_address;
     struct sockaddr_in client_address;
@@ -58,20 +57,24 @@ int main(void)
                   sizeof(server_address));
     printf("[Server] Bound to port %d\n", SERVER_PORT);
     printf("[Server] Waiting for connection...\n");
-    conn_socket.sd = microtcp_accept(&server_socket,
-                                  (struct sockaddr *)&client_address,
-                                  client_len);
+    /* On success the socket itself becomes the connected socket */
+    if (microtcp_accept(&server_socket,
+                        (struct sockaddr *)&client_address,
+                        client_len) < 0) {
+        perror("[Server] microTCP accept failed");
+        exit(EXIT_FAILURE);
+    }
 
     printf("[Server] Client connected\n");
     memset(buffer, 0, BUFFER_SIZE);
-    microtcp_recv(&conn_socket, buffer, BUFFER_SIZE, 0);
+    microtcp_recv(&server_socket, buffer, BUFFER_SIZE, 0);
     printf("[Server] Received: %s\n", buffer);
 
     char reply[] = "Hello Client!";
-    microtcp_send(&conn_socket, reply, strlen(reply), 0);
+    microtcp_send(&server_socket, reply, strlen(reply), 0);
     printf("[Server] Reply sent\n");
 
-    microtcp_shutdown(&conn_socket, 0);
+    microtcp_shutdown(&server_socket, 0);
     printf("[Server] Connection closed\n");
 
     return 0;
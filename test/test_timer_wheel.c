@@ -0,0 +1,144 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the timer wheel of lib/timer_wheel.h against a plain array of
+ * deadlines, with callbacks that arm and cancel other timers, themselves
+ * included, as the wheel advances by random steps. Exits with a non-zero
+ * status on the first mismatch.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "../lib/timer_wheel.h"
+
+#define TIMERS 1000
+#define ROUNDS 20000
+
+static microtcp_timer_wheel_t wheel;
+static microtcp_timer_t timers[TIMERS];
+static uint64_t deadline[TIMERS];       /* Expiration tick, 0 if disarmed */
+static size_t armed;
+static uint64_t now;                    /* Tick the wheel advances to */
+static int failed;
+
+static void
+arm (size_t i, uint64_t delay_us)
+{
+  uint64_t expires = (now * MICROTCP_TIMER_TICK_US + delay_us
+      + MICROTCP_TIMER_TICK_US - 1) / MICROTCP_TIMER_TICK_US;
+
+  if (expires <= now) {
+    expires = now + 1;
+  }
+  if (!deadline[i]) {
+    armed++;
+  }
+  deadline[i] = expires;
+  microtcp_timer_arm (&wheel, &timers[i], now * MICROTCP_TIMER_TICK_US
+                      + delay_us);
+}
+
+static void
+cancel (size_t i)
+{
+  if (deadline[i]) {
+    armed--;
+  }
+  deadline[i] = 0;
+  microtcp_timer_cancel (&wheel, &timers[i]);
+}
+
+static void
+fired (microtcp_timer_t *timer, void *arg)
+{
+  size_t i = timer - timers;
+  int n;
+
+  (void) arg;
+  if (!deadline[i] || deadline[i] > now || microtcp_timer_armed (timer)) {
+    fprintf (stderr, "tick %llu: timer %zu fired, due at %llu\n",
+             (unsigned long long) now, i, (unsigned long long) deadline[i]);
+    failed = 1;
+  }
+  deadline[i] = 0;
+  armed--;
+
+  /* Act on a few timers, due ones about to fire included */
+  for (n = rand () % 4; n > 0; n--) {
+    i = rand () % TIMERS;
+    if (rand () % 2) {
+      cancel (i);
+    }
+    else {
+      arm (i, rand () % 4 ? rand () % 20000
+          : rand () % (2 * MICROTCP_WHEEL_SLOTS * MICROTCP_TIMER_TICK_US));
+    }
+  }
+}
+
+int
+main (int argc, char **argv)
+{
+  size_t i;
+  int r;
+
+  srand (argc > 1 ? atoi (argv[1]) : 1);
+  now = 1000;
+  microtcp_timer_wheel_init (&wheel, now * MICROTCP_TIMER_TICK_US);
+  for (i = 0; i < TIMERS; i++) {
+    microtcp_timer_init (&timers[i], fired, NULL);
+    arm (i, rand () % 50000);
+  }
+
+  for (r = 0; r < ROUNDS && !failed; r++) {
+    now += rand () % 8;
+    microtcp_timer_wheel_advance (&wheel, now * MICROTCP_TIMER_TICK_US);
+    for (i = 0; i < TIMERS; i++) {
+      if (deadline[i] && deadline[i] <= now) {
+        fprintf (stderr, "tick %llu: timer %zu due at %llu did not fire\n",
+                 (unsigned long long) now, i,
+                 (unsigned long long) deadline[i]);
+        return EXIT_FAILURE;
+      }
+      if (!deadline[i] != !microtcp_timer_armed (&timers[i])) {
+        fprintf (stderr, "tick %llu: timer %zu is %sarmed\n",
+                 (unsigned long long) now, i, deadline[i] ? "not " : "");
+        return EXIT_FAILURE;
+      }
+    }
+    if (wheel.count != armed) {
+      fprintf (stderr, "tick %llu: %zu timers instead of %zu\n",
+               (unsigned long long) now, wheel.count, armed);
+      return EXIT_FAILURE;
+    }
+    /* Keep the wheel busy */
+    if (armed < TIMERS / 2) {
+      arm (rand () % TIMERS, rand () % 50000);
+    }
+  }
+  if (failed) {
+    return EXIT_FAILURE;
+  }
+
+  printf ("%d advances, %zu timers armed\n", ROUNDS, armed);
+  return EXIT_SUCCESS;
+}
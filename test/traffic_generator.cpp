@@ -140,7 +140,8 @@ main (int argc, char **argv)
 
   while(stop_traffic == false) {
     std::this_thread::sleep_for(std::chrono::milliseconds(dpoisson(gen)));
-    microtcp_send(&sock, buffer, BUF_LEN, 0);
+    /* Let the writes share segments instead of ending each in a runt */
+    microtcp_send(&sock, buffer, BUF_LEN, MSG_MORE);
   }
 
   LOG_INFO("Going to terminate microtcp connection...");
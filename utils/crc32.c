@@ -0,0 +1,76 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc32.h"
+
+#ifdef CRC32_HAVE_PCLMUL
+typedef uint32_t
+(*crc32_fn_t) (uint32_t crc, const uint8_t *data, size_t len);
+typedef uint32_t
+(*crc32_copy_fn_t) (uint32_t crc, uint8_t *dst, const uint8_t *src,
+                    size_t len);
+
+/*
+ * The dynamic linker calls the resolvers once, when it binds the
+ * symbols, before any constructor runs.
+ */
+static int
+crc32_have_pclmul (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("pclmul")
+      && __builtin_cpu_supports ("sse4.1");
+}
+
+static crc32_fn_t
+crc32_best_resolve (void)
+{
+  return crc32_have_pclmul () ? update_crc32_pclmul : update_crc32_slice16;
+}
+
+static crc32_copy_fn_t
+crc32_copy_best_resolve (void)
+{
+  return crc32_have_pclmul () ?
+      update_crc32_copy_pclmul : update_crc32_copy_slice16;
+}
+
+uint32_t
+update_crc32_best (uint32_t crc, const uint8_t *data, size_t len)
+    __attribute__((ifunc ("crc32_best_resolve")));
+
+uint32_t
+update_crc32_copy_best (uint32_t crc, uint8_t *dst, const uint8_t *src,
+                        size_t len)
+    __attribute__((ifunc ("crc32_copy_best_resolve")));
+#else
+uint32_t
+update_crc32_best (uint32_t crc, const uint8_t *data, size_t len)
+{
+  return update_crc32_slice16 (crc, data, len);
+}
+
+uint32_t
+update_crc32_copy_best (uint32_t crc, uint8_t *dst, const uint8_t *src,
+                        size_t len)
+{
+  return update_crc32_copy_slice16 (crc, dst, src, len);
+}
+#endif
@@ -0,0 +1,85 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UTILS_SIPHASH_H_
+#define UTILS_SIPHASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * SipHash-2-4 by Aumasson and Bernstein: a keyed 64-bit hash that is cheap
+ * on short inputs and unpredictable without the key, so it can
+ * authenticate values that travel through untrusted peers.
+ */
+
+#define SIPHASH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3)                                         \
+  do {                                                                        \
+    v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32); \
+    v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2;                            \
+    v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0;                            \
+    v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32); \
+  } while (0)
+
+/**
+ * @param key the 128-bit secret key
+ * @return the SipHash-2-4 of the len bytes of data
+ */
+static inline uint64_t
+siphash24 (const uint64_t key[2], const uint8_t *data, size_t len)
+{
+  uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+  uint64_t last = (uint64_t) len << 56;
+  uint64_t m;
+  size_t i;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy (&m, data, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    m = __builtin_bswap64 (m);
+#endif
+    v3 ^= m;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for (i = 0; i < len; i++) {
+    last |= (uint64_t) data[i] << (8 * i);
+  }
+  v3 ^= last;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  SIPHASH_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif /* UTILS_SIPHASH_H_ */